@@ -7,6 +7,7 @@
 #include "debug.h"
 #include "lightrec-private.h"
 #include "memmanager.h"
+#include "memmap.h"
 #include "reaper.h"
 #include "recompiler.h"
 
@@ -216,7 +217,10 @@ static void lightrec_reset_lut_offset(struct lightrec_state *state, void *d)
 	if (block_has_flag(block, BLOCK_IS_DEAD))
 		return;
 
-	addr = block->function ?: state->get_next_block;
+	if (block->function)
+		addr = block->function;
+	else
+		addr = state->get_next_block;
 	lut_write(state, lut_offset(pc), addr);
 }
 
@@ -233,6 +237,12 @@ bool lightrec_block_is_outdated(struct lightrec_state *state, struct block *bloc
 		/* The block was marked as outdated, but the content is still
 		 * the same */
 
+		/* The page was unprotected by the write - protect it again */
+		if (ENABLE_SMC_PROTECT && state->smc_protect) {
+			lightrec_smc_protect(state, kunseg(block->pc),
+					     block->nb_ops * sizeof(u32));
+		}
+
 		if (ENABLE_THREADED_COMPILER) {
 			/*
 			 * When compiling a block that covers ours, the threaded
@@ -4,8 +4,10 @@
  */
 
 #include "constprop.h"
+#include "debug.h"
 #include "disassembler.h"
 #include "lightrec-private.h"
+#include "memmanager.h"
 
 #include <stdbool.h>
 #include <string.h>
@@ -502,6 +504,31 @@ void lightrec_consts_propagate(const struct block *block,
 		}
 		break;
 
+	case OP_META_DIVI:
+	case OP_META_DIVIU:
+		{
+			struct constprop_data lo = { 0 }, hi = { 0 };
+			u16 div = get_divi_imm(c);
+
+			if (is_known(v, c.r.rs)) {
+				lo.known = hi.known = 0xffffffff;
+
+				if (c.i.op == OP_META_DIVI) {
+					lo.value = (s32)v[c.r.rs].value / div;
+					hi.value = (s32)v[c.r.rs].value % div;
+				} else {
+					lo.value = v[c.r.rs].value / div;
+					hi.value = v[c.r.rs].value % div;
+				}
+			}
+
+			if (OPT_FLAG_MULT_DIV && c.r.rd)
+				v[c.r.rd] = lo;
+			if (OPT_FLAG_MULT_DIV && c.r.imm)
+				v[c.r.imm] = hi;
+		}
+		break;
+
 	case OP_REGIMM:
 		break;
 
@@ -721,6 +748,157 @@ void lightrec_consts_propagate(const struct block *block,
 	v[0].known = 0xffffffff;
 }
 
+static const struct constprop_data constprop_init[32] =
+	LIGHTREC_CONSTPROP_INITIALIZER;
+
+static const struct constprop_data *
+lightrec_consts_entry(const struct constprop_cache *cache)
+{
+	return cache->entry ? cache->entry : constprop_init;
+}
+
+void lightrec_consts_init(struct lightrec_state *state,
+			  struct constprop_cache *cache,
+			  const struct block *block)
+{
+	unsigned int nb_ops = block->nb_ops;
+
+	cache->block = block;
+	cache->entry = NULL;
+	cache->nb_valid = 1;
+	cache->checked = 1;
+	cache->last = 0;
+
+	cache->v = lightrec_malloc(state, MEM_FOR_IR,
+				   sizeof(*cache->v) * 32 * nb_ops);
+	cache->keys = lightrec_malloc(state, MEM_FOR_IR,
+				      sizeof(*cache->keys) * nb_ops);
+
+	if (!cache->v || !cache->keys) {
+		pr_warn("Unable to allocate constprop cache, "
+			"falling back to incremental propagation\n");
+		lightrec_consts_free(state, cache);
+		memcpy(cache->scratch, constprop_init, sizeof(constprop_init));
+		return;
+	}
+
+	memcpy(cache->v, constprop_init, sizeof(constprop_init));
+}
+
+void lightrec_consts_free(struct lightrec_state *state,
+			  struct constprop_cache *cache)
+{
+	unsigned int nb_ops = cache->block->nb_ops;
+
+	if (cache->v) {
+		lightrec_free(state, MEM_FOR_IR,
+			      sizeof(*cache->v) * 32 * nb_ops, cache->v);
+		cache->v = NULL;
+	}
+
+	if (cache->keys) {
+		lightrec_free(state, MEM_FOR_IR,
+			      sizeof(*cache->keys) * nb_ops, cache->keys);
+		cache->keys = NULL;
+	}
+}
+
+static void lightrec_consts_key(const struct block *block, unsigned int idx,
+				struct constprop_key *key)
+{
+	const struct opcode *list = block->opcode_list;
+
+	/* Everything lightrec_consts_propagate() reads to compute the state
+	 * at idx from the state at idx - 1 */
+	key->prev[0] = list[idx - 1].opcode;
+	key->prev[1] = idx > 1 ? list[idx - 2].opcode : 0;
+	key->flags = (list[idx].flags & LIGHTREC_SYNC)
+		| (list[idx - 1].flags & (LIGHTREC_SYNC | LIGHTREC_NO_DS)) << 8;
+}
+
+const struct constprop_data *
+lightrec_consts_get(struct constprop_cache *cache, unsigned int idx)
+{
+	const struct block *block = cache->block;
+	struct constprop_key key;
+	unsigned int i;
+
+	if (!cache->v) {
+		/* Without the table, only walking forward is supported */
+		if (idx < cache->last) {
+			memcpy(cache->scratch, lightrec_consts_entry(cache),
+			       sizeof(cache->scratch));
+			cache->last = 0;
+		}
+
+		for (i = cache->last + 1; i <= idx; i++)
+			lightrec_consts_propagate(block, i, cache->scratch);
+
+		cache->last = idx;
+
+		return cache->scratch;
+	}
+
+	/* Going backwards means a new walk; the opcodes may have been modified
+	 * since the states were computed, so check all of them again. */
+	if (idx < cache->last)
+		cache->checked = 1;
+
+	for (i = cache->checked; i <= idx && i < cache->nb_valid; i++) {
+		lightrec_consts_key(block, i, &key);
+
+		if (memcmp(&key, &cache->keys[i], sizeof(key))) {
+			cache->nb_valid = i;
+			break;
+		}
+	}
+
+	for (i = cache->nb_valid; i <= idx; i++) {
+		memcpy(&cache->v[i * 32], &cache->v[(i - 1) * 32],
+		       sizeof(*cache->v) * 32);
+		lightrec_consts_propagate(block, i, &cache->v[i * 32]);
+		lightrec_consts_key(block, i, &cache->keys[i]);
+	}
+
+	if (cache->nb_valid <= idx)
+		cache->nb_valid = idx + 1;
+
+	/* The caller may still modify the opcode at idx, check it again
+	 * next time */
+	cache->checked = idx ? idx : 1;
+	cache->last = idx;
+
+	return &cache->v[idx * 32];
+}
+
+void lightrec_consts_invalidate(struct constprop_cache *cache,
+				unsigned int idx)
+{
+	if (!cache->v) {
+		/* Replay the propagation from the start on the next query */
+		memcpy(cache->scratch, lightrec_consts_entry(cache),
+		       sizeof(cache->scratch));
+		cache->last = 0;
+	} else if (idx && cache->nb_valid > idx) {
+		cache->nb_valid = idx;
+	}
+}
+
+void lightrec_consts_set_entry(struct constprop_cache *cache,
+			       const struct constprop_data *entry)
+{
+	/* Start from known register values instead of the unknown state.
+	 * The entry array must outlive the cache. */
+	cache->entry = entry;
+
+	memcpy(cache->v ? cache->v : cache->scratch, entry,
+	       sizeof(*entry) * 32);
+
+	cache->nb_valid = 1;
+	cache->checked = 1;
+	cache->last = 0;
+}
+
 enum psx_map
 lightrec_get_constprop_map(const struct lightrec_state *state,
 			   const struct constprop_data *v, u8 reg, s16 imm)
@@ -18,6 +18,28 @@ struct constprop_data {
 	u32 sign;
 };
 
+struct constprop_key {
+	u32 prev[2];		/* Opcodes at idx - 1 and idx - 2 */
+	u32 flags;
+};
+
+/* Constant propagation state computed once per block, before each opcode.
+ * An entry is recomputed when one of the opcodes it depends on changed. */
+struct constprop_cache {
+	const struct block *block;
+	struct constprop_data *v;	/* 32 entries per opcode */
+	struct constprop_key *keys;
+	unsigned int nb_valid;		/* Number of entries computed */
+	unsigned int checked;		/* Number of entries checked this walk */
+	unsigned int last;
+
+	/* Known register values at the entry of the block, or NULL */
+	const struct constprop_data *entry;
+
+	/* Fallback used when the table cannot be allocated */
+	struct constprop_data scratch[32];
+};
+
 static inline _Bool is_known(const struct constprop_data *v, u8 reg)
 {
 	return v[reg].known == 0xffffffff;
@@ -38,6 +60,18 @@ void lightrec_consts_propagate(const struct block *block,
 			       unsigned int idx,
 			       struct constprop_data *v);
 
+void lightrec_consts_init(struct lightrec_state *state,
+			  struct constprop_cache *cache,
+			  const struct block *block);
+void lightrec_consts_free(struct lightrec_state *state,
+			  struct constprop_cache *cache);
+const struct constprop_data *
+lightrec_consts_get(struct constprop_cache *cache, unsigned int idx);
+void lightrec_consts_invalidate(struct constprop_cache *cache,
+				unsigned int idx);
+void lightrec_consts_set_entry(struct constprop_cache *cache,
+			       const struct constprop_data *entry);
+
 enum psx_map
 lightrec_get_constprop_map(const struct lightrec_state *state,
 			   const struct constprop_data *v, u8 reg, s16 imm);
@@ -44,6 +44,8 @@ static const char * const std_opcodes[] = {
 	[OP_META_MULTU2]	= "multu2  ",
 	[OP_META_LWU]		= "lwu     ",
 	[OP_META_SWU]		= "swu     ",
+	[OP_META_DIVI]		= "divi    ",
+	[OP_META_DIVIU]		= "diviu   ",
 };
 
 static const char * const special_opcodes[] = {
@@ -159,6 +161,9 @@ static const char * const opcode_io_modes[] = {
 static const char * const opcode_branch_flags[] = {
 	"emulate branch",
 	"local branch",
+	"idle loop",
+	"inline call",
+	"jump table",
 };
 
 static const char * const opcode_movi_flags[] = {
@@ -481,6 +486,15 @@ static int print_op(union code c, u32 pc, char *buf, size_t len,
 				lightrec_reg_name(get_mult_div_hi(c)),
 				lightrec_reg_name(get_mult_div_lo(c)),
 				lightrec_reg_name(c.r.rs), c.r.op);
+	case OP_META_DIVI:
+	case OP_META_DIVIU:
+		*flags_ptr = opcode_multdiv_flags;
+		*nb_flags = ARRAY_SIZE(opcode_multdiv_flags);
+		return snprintf(buf, len, "%s%s,%s,%s,%u",
+				std_opcodes[c.i.op],
+				lightrec_reg_name(get_mult_div_hi(c)),
+				lightrec_reg_name(get_mult_div_lo(c)),
+				lightrec_reg_name(c.r.rs), get_divi_imm(c));
 	default:
 		return snprintf(buf, len, "unknown ("X32_FMT")", c.opcode);
 	}
@@ -19,6 +19,7 @@
 /* Flags for all opcodes */
 #define LIGHTREC_NO_DS		BIT(0)
 #define LIGHTREC_SYNC		BIT(1)
+#define LIGHTREC_HOISTED	BIT(13)
 
 /* Flags for LUI, ORI, ADDIU */
 #define LIGHTREC_MOVI		BIT(2)
@@ -42,10 +43,18 @@
 #define LIGHTREC_IO_MASK	LIGHTREC_IO_MODE(0x7)
 #define LIGHTREC_FLAGS_GET_IO_MODE(x) \
 	(((x) & LIGHTREC_IO_MASK) >> LIGHTREC_IO_MODE_LSB)
+#define LIGHTREC_IO_BURST	BIT(9)
+#define LIGHTREC_IO_BURST_END	BIT(10)
+#define LIGHTREC_IO_NOTIFY	BIT(11)
+#define LIGHTREC_IO_SPEC	BIT(12)
+#define LIGHTREC_IO_PAIR	BIT(14)
 
 /* Flags for branches */
 #define LIGHTREC_EMULATE_BRANCH	BIT(2)
 #define LIGHTREC_LOCAL_BRANCH	BIT(3)
+#define LIGHTREC_IDLE_LOOP	BIT(4)
+#define LIGHTREC_INLINE_CALL	BIT(5)
+#define LIGHTREC_JUMP_TABLE	BIT(6)
 
 /* Flags for div/mult opcodes */
 #define LIGHTREC_NO_LO		BIT(2)
@@ -76,6 +85,7 @@
 #define LIGHTREC_REG_CLEAN	0x3
 
 struct block;
+struct int_op;
 
 enum standard_opcodes {
 	OP_SPECIAL		= 0x00,
@@ -117,6 +127,8 @@ enum standard_opcodes {
 	OP_META_MULTU2		= 0x1a,
 	OP_META_LWU		= 0x1b,
 	OP_META_SWU		= 0x1c,
+	OP_META_DIVI		= 0x1d,
+	OP_META_DIVIU		= 0x1e,
 };
 
 enum special_opcodes {
@@ -293,6 +305,7 @@ struct opcode {
 
 struct opcode_list {
 	u16 nb_ops;
+	struct int_op *int_ops;
 	struct opcode ops[];
 };
 
@@ -328,6 +341,36 @@ static inline _Bool op_flag_load_delay(u32 flags)
 	return OPT_HANDLE_LOAD_DELAYS && (flags & LIGHTREC_LOAD_DELAY);
 }
 
+static inline _Bool op_flag_io_notify(u32 flags)
+{
+	return OPT_FLAG_IO && (flags & LIGHTREC_IO_NOTIFY);
+}
+
+static inline _Bool op_flag_io_spec(u32 flags)
+{
+	return OPT_ENTRY_SPEC && (flags & LIGHTREC_IO_SPEC);
+}
+
+static inline _Bool op_flag_hoisted(u32 flags)
+{
+	return OPT_LICM && (flags & LIGHTREC_HOISTED);
+}
+
+static inline _Bool op_flag_io_burst(u32 flags)
+{
+	return OPT_GROUP_IO && (flags & LIGHTREC_IO_BURST);
+}
+
+static inline _Bool op_flag_io_burst_end(u32 flags)
+{
+	return OPT_GROUP_IO && (flags & LIGHTREC_IO_BURST_END);
+}
+
+static inline _Bool op_flag_io_pair(u32 flags)
+{
+	return OPT_PAIR_IO && (flags & LIGHTREC_IO_PAIR);
+}
+
 static inline _Bool op_flag_emulate_branch(u32 flags)
 {
 	return OPT_DETECT_IMPOSSIBLE_BRANCHES &&
@@ -339,6 +382,21 @@ static inline _Bool op_flag_local_branch(u32 flags)
 	return OPT_LOCAL_BRANCHES && (flags & LIGHTREC_LOCAL_BRANCH);
 }
 
+static inline _Bool op_flag_idle_loop(u32 flags)
+{
+	return OPT_DETECT_IDLE_LOOPS && (flags & LIGHTREC_IDLE_LOOP);
+}
+
+static inline _Bool op_flag_inline_call(u32 flags)
+{
+	return OPT_INLINE_CALLS && (flags & LIGHTREC_INLINE_CALL);
+}
+
+static inline _Bool op_flag_jump_table(u32 flags)
+{
+	return OPT_JUMP_TABLES && (flags & LIGHTREC_JUMP_TABLE);
+}
+
 static inline _Bool op_flag_no_lo(u32 flags)
 {
 	return OPT_FLAG_MULT_DIV && (flags & LIGHTREC_NO_LO);
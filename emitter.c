@@ -61,6 +61,57 @@ static void update_ra_register(struct regcache *reg_cache, jit_state_t *_jit,
 	lightrec_free_reg(reg_cache, link_reg);
 }
 
+static void lightrec_emit_jump_table(struct lightrec_cstate *state,
+				     const struct block *block)
+{
+	const struct block_jump_table *jt = block->jump_table;
+	jit_state_t *_jit = block->_jit;
+	jit_node_t *to_eob[5];
+	unsigned int i, nb = 0;
+
+	jit_note(__FILE__, __LINE__);
+
+	/* The registers have been written back, and the target PC is in
+	 * JIT_V0. Leave the exit checks to the dispatcher. */
+	if (lightrec_store_next_pc())
+		jit_ldxi_ui(JIT_V0, LIGHTREC_REG_STATE, lightrec_offset(next_pc));
+
+	to_eob[nb++] = jit_blei(LIGHTREC_REG_CYCLE, 0);
+
+	if (state->state->ops.hw_notify) {
+		jit_ldxi_uc(JIT_R1, LIGHTREC_REG_STATE,
+			    lightrec_offset(hw_dirty_any));
+		to_eob[nb++] = jit_bnei(JIT_R1, 0);
+	}
+
+	jit_ldxi_ui(JIT_R1, LIGHTREC_REG_STATE,
+		    lightrec_offset(regs.gpr) + (jt->reg << 2));
+	to_eob[nb++] = jit_bgei_u(JIT_R1, jt->nb);
+
+	/* The table in RAM may have changed since the block was compiled;
+	 * only use our copy if it matches the actual target */
+	jit_lshi(JIT_R1, JIT_R1, 2);
+	jit_ldxi_ui(JIT_R2, JIT_R1, (uintptr_t)jt->table);
+	to_eob[nb++] = jit_bner(JIT_R2, JIT_V0);
+
+	/* Jump straight to the target's LUT entry */
+	jit_ldxi_ui(JIT_R1, JIT_R1, (uintptr_t)&jt->table[jt->nb]);
+	jit_add_state(JIT_R1, JIT_R1);
+
+	if (lut_is_32bit(state->state))
+		jit_ldxi_ui(JIT_R1, JIT_R1, lightrec_offset(code_lut));
+	else
+		jit_ldxi(JIT_R1, JIT_R1, lightrec_offset(code_lut));
+
+	to_eob[nb++] = jit_beqi(JIT_R1, 0);
+
+	jit_stxi_i(lightrec_offset(curr_pc), LIGHTREC_REG_STATE, JIT_V0);
+	jit_jmpr(JIT_R1);
+
+	for (i = 0; i < nb; i++)
+		jit_patch(to_eob[i]);
+}
+
 static void lightrec_emit_end_of_block(struct lightrec_cstate *state,
 				       const struct block *block, u16 offset,
 				       s8 reg_new_pc, u32 imm, u8 ra_reg,
@@ -117,6 +168,9 @@ static void lightrec_emit_end_of_block(struct lightrec_cstate *state,
 
 		lightrec_jump_to_ds_check(state, _jit);
 	} else {
+		if (op_flag_jump_table(op->flags) && block->jump_table)
+			lightrec_emit_jump_table(state, block);
+
 		lightrec_jump_to_eob(state, _jit);
 	}
 
@@ -145,6 +199,99 @@ void lightrec_emit_jump_to_interpreter(struct lightrec_cstate *state,
 	lightrec_jump_to_fn(_jit, state->state->interpreter_func);
 }
 
+void lightrec_emit_cold_check(struct lightrec_cstate *state,
+			      struct block *block)
+{
+	const struct block_entry_spec *spec = block->entry_spec;
+	struct regcache *reg_cache = state->reg_cache;
+	struct native_register *regs_backup;
+	jit_state_t *_jit = block->_jit;
+	jit_node_t *to_c[2], *to_end;
+	unsigned int i, nb = 0;
+	u8 tmp;
+
+	_jit_name(block->_jit, __func__);
+
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	/* Run the block with the interpreter, which samples the entry values,
+	 * until there are enough samples */
+	if (block_samples_entry(block)) {
+		jit_ldi_uc(tmp, (void *)&spec->nb_samples);
+		to_c[nb++] = jit_blti(tmp, ENTRY_SPEC_MIN_SAMPLES);
+	}
+
+	/* Count the executions; once the block is hot, the interpreter will
+	 * flag it for recompilation */
+	if (OPT_HOT_RECOMPILE && !block_has_flag(block, BLOCK_IS_HOT)) {
+		jit_ldi_uc(tmp, (void *)&block->nb_execs);
+		to_c[nb++] = jit_bgei(tmp, HOT_BLOCK_THRESHOLD);
+		jit_addi(tmp, tmp, 1);
+		jit_sti_c((void *)&block->nb_execs, tmp);
+	}
+
+	lightrec_free_reg(reg_cache, tmp);
+	lightrec_free_regs(reg_cache);
+
+	to_end = jit_b();
+
+	for (i = 0; i < nb; i++)
+		jit_patch(to_c[i]);
+
+	regs_backup = lightrec_regcache_enter_branch(reg_cache);
+	lightrec_emit_jump_to_interpreter(state, block, 0);
+	lightrec_regcache_leave_branch(reg_cache, regs_backup);
+
+	jit_patch(to_end);
+}
+
+void lightrec_emit_entry_check(struct lightrec_cstate *state,
+			       const struct block *block)
+{
+	const struct block_entry_spec *spec = block->entry_spec;
+	struct regcache *reg_cache = state->reg_cache;
+	struct native_register *regs_backup;
+	jit_state_t *_jit = block->_jit;
+	jit_node_t *addr;
+	unsigned int i;
+	u8 rs, tmp, tmp2;
+
+	_jit_name(block->_jit, __func__);
+
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	jit_movi(tmp, 0);
+
+	/* tmp |= (reg & known) ^ value, for each assumed register */
+	for (i = 0; i < spec->nb_regs; i++) {
+		if (!spec->known[i])
+			continue;
+
+		rs = lightrec_alloc_reg_in(reg_cache, _jit, spec->reg[i], 0);
+
+		jit_andi(tmp2, rs, spec->known[i]);
+		jit_xori(tmp2, tmp2, spec->value[i]);
+		jit_orr(tmp, tmp, tmp2);
+
+		lightrec_free_reg(reg_cache, rs);
+	}
+
+	addr = jit_beqi(tmp, 0);
+
+	lightrec_free_reg(reg_cache, tmp2);
+	lightrec_free_reg(reg_cache, tmp);
+	lightrec_free_regs(reg_cache);
+
+	/* The entry values don't match the ones the block was compiled for;
+	 * run it with the interpreter instead. */
+	regs_backup = lightrec_regcache_enter_branch(reg_cache);
+	lightrec_emit_jump_to_interpreter(state, block, 0);
+	lightrec_regcache_leave_branch(reg_cache, regs_backup);
+
+	jit_patch(addr);
+}
+
 static void lightrec_emit_eob(struct lightrec_cstate *state,
 			      const struct block *block, u16 offset)
 {
@@ -191,10 +338,84 @@ static void rec_J(struct lightrec_cstate *state, const struct block *block, u16
 				   31, 0, true);
 }
 
+static void rec_inline_call(struct lightrec_cstate *state,
+			    const struct block *block, u16 offset)
+{
+	const struct block_inline_call *inl = block->inline_call;
+	struct regcache *reg_cache = state->reg_cache;
+	const struct opcode *op = &block->opcode_list[offset];
+	jit_node_t *to_slow[INLINE_CALL_MAX_OPS];
+	struct native_register *regs_backup;
+	jit_state_t *_jit = block->_jit;
+	u32 link = get_branch_pc(block, offset, 2);
+	u32 cycles = state->cycles;
+	struct block callee = {
+		._jit = _jit,
+		.opcode_list = (struct opcode *)inl->ops,
+		.pc = inl->pc,
+		.nb_ops = inl->nb_ops,
+	};
+	unsigned int i;
+	u8 tmp;
+
+	_jit_name(block->_jit, __func__);
+	jit_note(__FILE__, __LINE__);
+
+	/* The inlined code is only valid as long as the callee's code did
+	 * not change */
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	for (i = 0; i < inl->nb_ops; i++) {
+		jit_ldi_i(tmp, (void *)&inl->code[i]);
+		to_slow[i] = jit_bnei(tmp, (s32)inl->words[i]);
+	}
+
+	lightrec_free_reg(reg_cache, tmp);
+	lightrec_free_regs(reg_cache);
+	regs_backup = lightrec_regcache_enter_branch(reg_cache);
+
+	update_ra_register(reg_cache, _jit, 31, block->pc, link);
+
+	state->cycles += lightrec_cycles_of_opcode(state->state, op->c);
+
+	if (!op_flag_no_ds(op->flags)) {
+		state->cycles += lightrec_cycles_of_opcode(state->state,
+							   op[1].c);
+		if (op[1].opcode)
+			lightrec_rec_opcode(state, block, offset + 1);
+	}
+
+	/* Run the body of the callee, and return to the caller through the
+	 * JR $ra, whose target is known */
+	for (i = 0; !is_return(inl->ops[i].c); i++) {
+		lightrec_rec_opcode(state, &callee, i);
+		state->cycles += lightrec_cycles_of_opcode(state->state,
+							   inl->ops[i].c);
+	}
+
+	lightrec_emit_end_of_block(state, &callee, i, -1, link, 31, 0, true);
+
+	for (i = 0; i < inl->nb_ops; i++)
+		jit_patch(to_slow[i]);
+
+	lightrec_regcache_leave_branch(reg_cache, regs_backup);
+
+	/* The callee changed: jump to it through the dispatcher */
+	state->cycles = cycles;
+	lightrec_emit_end_of_block(state, block, offset, -1, inl->pc,
+				   31, link, true);
+}
+
 static void rec_JAL(struct lightrec_cstate *state, const struct block *block, u16 offset)
 {
 	union code c = block->opcode_list[offset].c;
 
+	if (op_flag_inline_call(block->opcode_list[offset].flags)
+	    && block->inline_call) {
+		rec_inline_call(state, block, offset);
+		return;
+	}
+
 	_jit_name(block->_jit, __func__);
 	lightrec_emit_end_of_block(state, block, offset, -1,
 				   (block->pc & 0xf0000000) | (c.j.imm << 2),
@@ -247,7 +468,7 @@ static void rec_b(struct lightrec_cstate *state, const struct block *block, u16
 	struct lightrec_branch *branch;
 	const struct opcode *op = &block->opcode_list[offset],
 			    *ds = get_delay_slot(block->opcode_list, offset);
-	jit_node_t *addr;
+	jit_node_t *addr, *to_end;
 	bool is_forward = (s16)op->i.imm >= 0;
 	int op_cycles = lightrec_cycles_of_opcode(state->state, op->c);
 	u32 target_offset, cycles = state->cycles + op_cycles;
@@ -292,6 +513,14 @@ static void rec_b(struct lightrec_cstate *state, const struct block *block, u16
 		regs_backup = lightrec_regcache_enter_branch(reg_cache);
 	}
 
+	if (op_flag_idle_loop(op->flags)) {
+		/* Nothing will change until the next event; consume all the
+		 * remaining cycles instead of spinning. */
+		to_end = jit_blei(LIGHTREC_REG_CYCLE, 0);
+		jit_movi(LIGHTREC_REG_CYCLE, 0);
+		jit_patch(to_end);
+	}
+
 	if (op_flag_local_branch(op->flags)) {
 		/* Recompile the delay slot */
 		if (!op_flag_no_ds(op->flags) && ds->opcode) {
@@ -1250,6 +1479,169 @@ static u32 rec_ram_mask(const struct lightrec_state *state)
 	return (RAM_SIZE << (state->mirrors_mapped * 2)) - 1;
 }
 
+static bool rec_io_can_cache_ram(const struct lightrec_cstate *cstate,
+				  const struct opcode *op)
+{
+	if (op_flag_load_delay(op->flags) && !cstate->no_load_delay)
+		return false;
+
+	switch (op->i.op) {
+	case OP_LB:
+	case OP_LBU:
+	case OP_LH:
+	case OP_LHU:
+	case OP_LW:
+	case OP_SB:
+	case OP_SH:
+	case OP_SW:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Emit an inline cache for an I/O opcode that was tagged as hitting hardware
+ * registers: if the address is in RAM, access it directly, otherwise fall
+ * back to the C wrapper. Sites that alternate between RAM and hardware
+ * registers then don't need the block to be recompiled.
+ * As the two paths join, all the registers used by either path are allocated
+ * before the branch, so that the register cache is the same in both. */
+static void rec_io_cache_ram(struct lightrec_cstate *cstate,
+			     const struct block *block, u16 offset,
+			     jit_code_t code, jit_code_t swap_code,
+			     bool is_load, bool invalidate)
+{
+	const struct lightrec_state *state = cstate->state;
+	struct regcache *reg_cache = cstate->reg_cache;
+	union code c = block->opcode_list[offset].c;
+	jit_state_t *_jit = block->_jit;
+	jit_node_t *to_c, *to_end;
+	u8 r1, cw, rs, rt = 0, tmp, tmp2, zero = 0, swap = 0;
+	s8 reg;
+
+	jit_note(__FILE__, __LINE__);
+
+	/* Same as rec_io(): the C wrapper works on the register file */
+	lightrec_clean_reg_if_loaded(reg_cache, _jit, c.i.rs, false);
+	if (likely(c.i.rt))
+		lightrec_clean_reg_if_loaded(reg_cache, _jit, c.i.rt, is_load);
+
+	/* Make sure JIT_R1 is not mapped; it will be used in the C wrapper. */
+	r1 = lightrec_alloc_reg(reg_cache, _jit, JIT_R1);
+
+	reg = lightrec_get_reg_with_value(reg_cache,
+					  (intptr_t) state->c_wrapper);
+	if (reg < 0) {
+		cw = lightrec_alloc_reg_temp(reg_cache, _jit);
+		jit_ldxi(cw, LIGHTREC_REG_STATE, lightrec_offset(c_wrapper));
+
+		lightrec_temp_set_value(reg_cache, cw,
+					(intptr_t) state->c_wrapper);
+	} else {
+		cw = (u8) reg;
+	}
+
+#ifdef __mips__
+	if (cw != _T9)
+		lightrec_unload_reg(reg_cache, _jit, _T9);
+#endif
+
+	rs = lightrec_alloc_reg_in(reg_cache, _jit, c.i.rs, 0);
+	if (!is_load)
+		rt = lightrec_alloc_reg_in(reg_cache, _jit, c.i.rt, 0);
+
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	if (!is_load && invalidate)
+		zero = lightrec_alloc_reg_in(reg_cache, _jit, 0, 0);
+	if (!is_load && is_big_endian() && swap_code && c.i.rt)
+		swap = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	/* Convert to KUNSEG, and branch to the C wrapper if not in RAM */
+	jit_addi(tmp, rs, (s16)c.i.imm);
+	jit_andi(tmp, tmp, 0x1fffffff);
+	to_c = jit_bgei_u(tmp, RAM_SIZE * 4);
+
+	if (invalidate) {
+		/* Compute the offset to the code LUT */
+		jit_andi(tmp2, tmp, (RAM_SIZE - 1) & ~3);
+
+		if (!lut_is_32bit(state))
+			jit_lshi(tmp2, tmp2, 1);
+		jit_add_state(tmp2, tmp2);
+	}
+
+	jit_andi(tmp, tmp, rec_ram_mask(state));
+	if (state->offset_ram)
+		jit_addi(tmp, tmp, state->offset_ram);
+
+	if (is_load) {
+		jit_new_node_www(code, tmp, tmp, 0);
+
+		if (is_big_endian() && swap_code) {
+			jit_new_node_ww(swap_code, tmp, tmp);
+
+			if (c.i.op == OP_LH)
+				jit_extr_s(tmp, tmp);
+		}
+
+		if (c.i.rt) {
+			jit_stxi_i(lightrec_offset(regs.gpr) + (c.i.rt << 2),
+				   LIGHTREC_REG_STATE, tmp);
+		}
+	} else {
+		if (is_big_endian() && swap_code && c.i.rt) {
+			jit_new_node_ww(swap_code, swap, rt);
+			jit_new_node_www(code, 0, tmp, swap);
+		} else {
+			jit_new_node_www(code, 0, tmp, rt);
+		}
+
+		/* Write NULL to the code LUT to invalidate any block there */
+		if (invalidate) {
+			if (lut_is_32bit(state))
+				jit_stxi_i(lightrec_offset(code_lut), tmp2, zero);
+			else
+				jit_stxi(lightrec_offset(code_lut), tmp2, zero);
+		}
+	}
+
+	to_end = jit_b();
+
+	/* Slow path: call the C wrapper */
+	jit_patch(to_c);
+
+	jit_movi(r1, (unsigned int)C_WRAPPER_RW << (1 + __WORDSIZE / 32));
+
+	jit_prepare();
+	jit_pushargi(c.opcode);
+
+	lightrec_regcache_mark_live(reg_cache, _jit);
+	jit_callr(cw);
+	lightrec_regcache_mark_live(reg_cache, _jit);
+
+	jit_patch(to_end);
+
+	if (!is_load) {
+		if (is_big_endian() && swap_code && c.i.rt)
+			lightrec_free_reg(reg_cache, swap);
+		if (invalidate)
+			lightrec_free_reg(reg_cache, zero);
+		lightrec_free_reg(reg_cache, rt);
+	}
+	lightrec_free_reg(reg_cache, tmp2);
+	lightrec_free_reg(reg_cache, tmp);
+	lightrec_free_reg(reg_cache, rs);
+	lightrec_free_reg(reg_cache, cw);
+	lightrec_free_reg(reg_cache, r1);
+
+	/* The loaded value was written to the register file by both paths;
+	 * drop any stale copy of the output register (e.g. if rs == rt). */
+	if (is_load && c.i.rt)
+		lightrec_discard_reg_if_loaded(reg_cache, c.i.rt);
+}
+
 static u32 rec_io_mask(const struct lightrec_state *state)
 {
 	u32 length = state->maps[PSX_MAP_HW_REGISTERS].length;
@@ -1282,6 +1674,28 @@ static void rec_and_mask(struct lightrec_cstate *cstate,
 	lightrec_free_reg(reg_cache, reg_imm);
 }
 
+static const struct opcode *
+rec_io_get_pair(const struct lightrec_cstate *cstate,
+		const struct block *block, u16 offset)
+{
+	const struct opcode *op = &block->opcode_list[offset];
+
+	if (!op_flag_io_pair(op->flags))
+		return NULL;
+
+	/* Without mirrors, the immediate is added before masking, so the
+	 * second access cannot reuse the address of the first one */
+	if (!cstate->state->mirrors_mapped && !op_flag_no_mask(op->flags))
+		return NULL;
+
+	/* The I/O mode of either opcode may have changed since the pair was
+	 * detected */
+	if ((op->flags ^ op[1].flags) & LIGHTREC_IO_MASK)
+		return NULL;
+
+	return &op[1];
+}
+
 static void rec_store_memory(struct lightrec_cstate *cstate,
 			     const struct block *block,
 			     u16 offset, jit_code_t code,
@@ -1305,6 +1719,8 @@ static void rec_store_memory(struct lightrec_cstate *cstate,
 	bool need_tmp = !no_mask || add_imm || invalidate;
 	bool swc2 = c.i.op == OP_SWC2;
 	u8 in_reg = swc2 ? REG_TEMP : c.i.rt;
+	const struct opcode *pair = rec_io_get_pair(cstate, block, offset);
+	s16 delta = pair ? (s16)pair->i.imm - (s16)c.i.imm : 0;
 
 	rs = lightrec_alloc_reg_in(reg_cache, _jit, c.i.rs, 0);
 	if (need_tmp)
@@ -1355,6 +1771,24 @@ static void rec_store_memory(struct lightrec_cstate *cstate,
 
 	lightrec_free_reg(reg_cache, rt);
 
+	if (pair) {
+		/* Store the second word from the same base address */
+		rt = lightrec_alloc_reg_in(reg_cache, _jit, pair->i.rt, 0);
+
+		if (is_big_endian() && swap_code && pair->i.rt) {
+			tmp3 = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+			jit_new_node_ww(swap_code, tmp3, rt);
+			jit_new_node_www(code, imm + delta, addr_reg2, tmp3);
+
+			lightrec_free_reg(reg_cache, tmp3);
+		} else {
+			jit_new_node_www(code, imm + delta, addr_reg2, rt);
+		}
+
+		lightrec_free_reg(reg_cache, rt);
+	}
+
 	if (invalidate) {
 		tmp3 = lightrec_alloc_reg_in(reg_cache, _jit, 0, 0);
 
@@ -1380,6 +1814,15 @@ static void rec_store_memory(struct lightrec_cstate *cstate,
 		else
 			jit_stxi(lut_offt, addr_reg, tmp3);
 
+		if (pair) {
+			lut_offt += (s32)delta << (1 - lut_is_32bit(state));
+
+			if (lut_is_32bit(state))
+				jit_stxi_i(lut_offt, addr_reg, tmp3);
+			else
+				jit_stxi(lut_offt, addr_reg, tmp3);
+		}
+
 		lightrec_free_reg(reg_cache, tmp3);
 	}
 
@@ -1388,6 +1831,8 @@ static void rec_store_memory(struct lightrec_cstate *cstate,
 	if (need_tmp)
 		lightrec_free_reg(reg_cache, tmp);
 	lightrec_free_reg(reg_cache, rs);
+
+	cstate->io_paired = !!pair;
 }
 
 static void rec_store_ram(struct lightrec_cstate *cstate,
@@ -1415,15 +1860,84 @@ static void rec_store_scratch(struct lightrec_cstate *cstate,
 				0x1fffffff, false);
 }
 
+static void rec_io_mark_dirty(struct lightrec_cstate *cstate,
+			      const struct block *block, u16 offset)
+{
+	struct regcache *reg_cache = cstate->reg_cache;
+	union code c = block->opcode_list[offset].c;
+	jit_state_t *_jit = block->_jit;
+	u8 rs, tmp, one;
+
+	jit_note(__FILE__, __LINE__);
+
+	rs = lightrec_alloc_reg_in(reg_cache, _jit, c.i.rs, 0);
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+	one = lightrec_alloc_reg_temp_with_value(reg_cache, _jit, 1);
+
+	/* Set the register's byte in the dirty map; the host will be notified
+	 * by the dispatcher once this block exits. */
+	jit_addi(tmp, rs, (s16)c.i.imm);
+	jit_rshi_u(tmp, tmp, 2);
+	jit_andi(tmp, tmp, HW_DIRTY_SIZE - 1);
+	jit_add_state(tmp, tmp);
+	jit_stxi_c(lightrec_offset(hw_dirty), tmp, one);
+	jit_stxi_c(lightrec_offset(hw_dirty_any), LIGHTREC_REG_STATE, one);
+
+	lightrec_free_reg(reg_cache, one);
+	lightrec_free_reg(reg_cache, tmp);
+	lightrec_free_reg(reg_cache, rs);
+}
+
 static void rec_store_io(struct lightrec_cstate *cstate,
 			 const struct block *block, u16 offset,
 			 jit_code_t code, jit_code_t swap_code)
 {
 	_jit_note(block->_jit, __FILE__, __LINE__);
 
-	return rec_store_memory(cstate, block, offset, code, swap_code,
-				cstate->state->offset_io,
-				rec_io_mask(cstate->state), false);
+	rec_store_memory(cstate, block, offset, code, swap_code,
+			 cstate->state->offset_io,
+			 rec_io_mask(cstate->state), false);
+
+	if (op_flag_io_notify(block->opcode_list[offset].flags))
+		rec_io_mark_dirty(cstate, block, offset);
+}
+
+static void rec_store_fastmem(struct lightrec_cstate *cstate,
+			      const struct block *block, u16 offset,
+			      jit_code_t code, jit_code_t swap_code)
+{
+	const struct lightrec_state *state = cstate->state;
+	struct regcache *reg_cache = cstate->reg_cache;
+	union code c = block->opcode_list[offset].c;
+	jit_state_t *_jit = block->_jit;
+	bool swc2 = c.i.op == OP_SWC2;
+	u8 rs, rt, tmp, tmp2, in_reg = swc2 ? REG_TEMP : c.i.rt;
+
+	jit_note(__FILE__, __LINE__);
+
+	/* The whole 32-bit address space is mapped, so the zero-extended
+	 * address can be used as an offset without any masking */
+	rs = lightrec_alloc_reg_in(reg_cache, _jit, c.i.rs, REG_ZEXT);
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	rec_add_offset(cstate, _jit, tmp, rs, state->offset_ram);
+	lightrec_free_reg(reg_cache, rs);
+
+	rt = lightrec_alloc_reg_in(reg_cache, _jit, in_reg, 0);
+
+	if (is_big_endian() && swap_code && in_reg) {
+		tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+		jit_new_node_ww(swap_code, tmp2, rt);
+		jit_new_node_www(code, (s16)c.i.imm, tmp, tmp2);
+
+		lightrec_free_reg(reg_cache, tmp2);
+	} else {
+		jit_new_node_www(code, (s16)c.i.imm, tmp, rt);
+	}
+
+	lightrec_free_reg(reg_cache, rt);
+	lightrec_free_reg(reg_cache, tmp);
 }
 
 static void rec_store_direct_no_invalidate(struct lightrec_cstate *cstate,
@@ -1441,6 +1955,11 @@ static void rec_store_direct_no_invalidate(struct lightrec_cstate *cstate,
 	u8 addr_reg, tmp, tmp2 = 0, rs, rt, in_reg = swc2 ? REG_TEMP : c.i.rt;
 	s16 imm;
 
+	if (state->fastmem && c.i.op != OP_META_SWU) {
+		rec_store_fastmem(cstate, block, offset, code, swap_code);
+		return;
+	}
+
 	jit_note(__FILE__, __LINE__);
 	rs = lightrec_alloc_reg_in(reg_cache, _jit, c.i.rs, 0);
 	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
@@ -1617,6 +2136,47 @@ static void rec_store_direct(struct lightrec_cstate *cstate, const struct block
 	lightrec_free_reg(reg_cache, tmp2);
 }
 
+static void rec_store_burst(struct lightrec_cstate *cstate,
+			    const struct block *block, u16 offset)
+{
+	struct regcache *reg_cache = cstate->reg_cache;
+	const struct opcode *op = &block->opcode_list[offset];
+	jit_state_t *_jit = block->_jit;
+	union code c = op->c;
+	s16 entry;
+	u8 rs, rt, tmp;
+
+	jit_note(__FILE__, __LINE__);
+
+	/* Record the opcode and its operands; the writes will be performed
+	 * all at once by the last opcode of the group. */
+	entry = lightrec_offset(burst)
+		+ cstate->nb_burst * sizeof(struct lightrec_burst_entry);
+
+	rs = lightrec_alloc_reg_in(reg_cache, _jit, c.i.rs, 0);
+	rt = lightrec_alloc_reg_in(reg_cache, _jit, c.i.rt, 0);
+	tmp = lightrec_alloc_reg_temp_with_value(reg_cache, _jit, c.opcode);
+
+	jit_stxi_i(entry + offsetof(struct lightrec_burst_entry, opcode),
+		   LIGHTREC_REG_STATE, tmp);
+	jit_stxi_i(entry + offsetof(struct lightrec_burst_entry, base),
+		   LIGHTREC_REG_STATE, rs);
+	jit_stxi_i(entry + offsetof(struct lightrec_burst_entry, data),
+		   LIGHTREC_REG_STATE, rt);
+
+	lightrec_free_reg(reg_cache, tmp);
+	lightrec_free_reg(reg_cache, rt);
+	lightrec_free_reg(reg_cache, rs);
+
+	cstate->nb_burst++;
+
+	if (op_flag_io_burst_end(op->flags)) {
+		call_to_c_wrapper(cstate, block, cstate->nb_burst,
+				  C_WRAPPER_RW_BURST);
+		cstate->nb_burst = 0;
+	}
+}
+
 static void rec_store(struct lightrec_cstate *state,
 		      const struct block *block, u16 offset,
 		      jit_code_t code, jit_code_t swap_code)
@@ -1624,7 +2184,8 @@ static void rec_store(struct lightrec_cstate *state,
 	u32 flags = block->opcode_list[offset].flags;
 	u32 mode = LIGHTREC_FLAGS_GET_IO_MODE(flags);
 	bool no_invalidate = op_flag_no_invalidate(flags) ||
-		(state->state->opt_flags & LIGHTREC_OPT_INV_DMA_ONLY);
+		(state->state->opt_flags & LIGHTREC_OPT_INV_DMA_ONLY) ||
+		state->state->smc_protect;
 	union code c = block->opcode_list[offset].c;
 	bool is_swc2 = c.i.op == OP_SWC2;
 
@@ -1660,6 +2221,18 @@ static void rec_store(struct lightrec_cstate *state,
 	case LIGHTREC_IO_DIRECT_HW:
 		rec_store_io(state, block, offset, code, swap_code);
 		break;
+	case LIGHTREC_IO_HW:
+		if (op_flag_io_burst(flags)) {
+			rec_store_burst(state, block, offset);
+			return;
+		}
+
+		if (rec_io_can_cache_ram(state, &block->opcode_list[offset])) {
+			rec_io_cache_ram(state, block, offset, code, swap_code,
+					 false, !no_invalidate);
+			return;
+		}
+		fallthrough;
 	default:
 		rec_io(state, block, offset, true, false);
 		return;
@@ -1719,8 +2292,9 @@ static void rec_load_memory(struct lightrec_cstate *cstate,
 	struct opcode *op = &block->opcode_list[offset];
 	bool load_delay = op_flag_load_delay(op->flags) && !cstate->no_load_delay;
 	jit_state_t *_jit = block->_jit;
-	u8 rs, rt, out_reg, addr_reg, flags = REG_EXT;
+	u8 rs, rt, rt2 = 0, out_reg, addr_reg, flags = REG_EXT;
 	bool no_mask = op_flag_no_mask(op->flags);
+	const struct opcode *pair = rec_io_get_pair(cstate, block, offset);
 	union code c = op->c;
 	s16 imm;
 
@@ -1736,6 +2310,8 @@ static void rec_load_memory(struct lightrec_cstate *cstate,
 
 	rs = lightrec_alloc_reg_in(reg_cache, _jit, c.i.rs, 0);
 	rt = lightrec_alloc_reg_out(reg_cache, _jit, out_reg, flags);
+	if (pair)
+		rt2 = lightrec_alloc_reg_out(reg_cache, _jit, pair->i.rt, flags);
 
 	if ((op->i.op == OP_META_LWU && c.i.imm)
 	    || (!state->mirrors_mapped && c.i.imm && !no_mask)) {
@@ -1760,6 +2336,22 @@ static void rec_load_memory(struct lightrec_cstate *cstate,
 		addr_reg = rt;
 	}
 
+	if (pair) {
+		/* Load the second word first, as the address may live in the
+		 * first target register */
+		jit_new_node_www(code, rt2, addr_reg,
+				 imm + (s16)pair->i.imm - (s16)c.i.imm);
+
+		if (is_big_endian() && swap_code) {
+			jit_new_node_ww(swap_code, rt2, rt2);
+
+			if (__WORDSIZE == 64)
+				jit_extr_i(rt2, rt2);
+		}
+
+		lightrec_free_reg(reg_cache, rt2);
+	}
+
 	jit_new_node_www(code, rt, addr_reg, imm);
 
 	if (is_big_endian() && swap_code) {
@@ -1773,6 +2365,8 @@ static void rec_load_memory(struct lightrec_cstate *cstate,
 
 	lightrec_free_reg(reg_cache, rs);
 	lightrec_free_reg(reg_cache, rt);
+
+	cstate->io_paired = !!pair;
 }
 
 static void rec_load_ram(struct lightrec_cstate *cstate,
@@ -1815,6 +2409,52 @@ static void rec_load_io(struct lightrec_cstate *cstate,
 			cstate->state->offset_io, rec_io_mask(cstate->state));
 }
 
+static void rec_load_fastmem(struct lightrec_cstate *cstate,
+			     const struct block *block, u16 offset,
+			     jit_code_t code, jit_code_t swap_code,
+			     bool is_unsigned)
+{
+	const struct lightrec_state *state = cstate->state;
+	struct regcache *reg_cache = cstate->reg_cache;
+	struct opcode *op = &block->opcode_list[offset];
+	bool load_delay = op_flag_load_delay(op->flags) && !cstate->no_load_delay;
+	jit_state_t *_jit = block->_jit;
+	u8 rs, rt, out_reg, flags = REG_EXT;
+	union code c = op->c;
+
+	if (load_delay || c.i.op == OP_LWC2)
+		out_reg = REG_TEMP;
+	else if (c.i.rt)
+		out_reg = c.i.rt;
+	else
+		return;
+
+	if (is_unsigned)
+		flags |= REG_ZEXT;
+
+	jit_note(__FILE__, __LINE__);
+
+	/* The whole 32-bit address space is mapped, so the zero-extended
+	 * address can be used as an offset without any masking */
+	rs = lightrec_alloc_reg_in(reg_cache, _jit, c.i.rs, REG_ZEXT);
+	rt = lightrec_alloc_reg_out(reg_cache, _jit, out_reg, flags);
+
+	rec_add_offset(cstate, _jit, rt, rs, state->offset_ram);
+	jit_new_node_www(code, rt, rt, (s16)c.i.imm);
+
+	if (is_big_endian() && swap_code) {
+		jit_new_node_ww(swap_code, rt, rt);
+
+		if (c.i.op == OP_LH)
+			jit_extr_s(rt, rt);
+		else if (c.i.op == OP_LW && __WORDSIZE == 64)
+			jit_extr_i(rt, rt);
+	}
+
+	lightrec_free_reg(reg_cache, rs);
+	lightrec_free_reg(reg_cache, rt);
+}
+
 static void rec_load_direct(struct lightrec_cstate *cstate,
 			    const struct block *block, u16 offset,
 			    jit_code_t code, jit_code_t swap_code,
@@ -1834,6 +2474,12 @@ static void rec_load_direct(struct lightrec_cstate *cstate,
 	s8 offt_reg;
 	s16 imm;
 
+	if (state->fastmem && c.i.op != OP_META_LWU) {
+		rec_load_fastmem(cstate, block, offset, code,
+				 swap_code, is_unsigned);
+		return;
+	}
+
 	if (load_delay || c.i.op == OP_LWC2)
 		out_reg = REG_TEMP;
 	else if (c.i.rt)
@@ -1980,6 +2626,13 @@ static void rec_load(struct lightrec_cstate *state, const struct block *block,
 	case LIGHTREC_IO_DIRECT:
 		rec_load_direct(state, block, offset, code, swap_code, is_unsigned);
 		break;
+	case LIGHTREC_IO_HW:
+		if (rec_io_can_cache_ram(state, op)) {
+			rec_io_cache_ram(state, block, offset, code, swap_code,
+					 true, false);
+			return;
+		}
+		fallthrough;
 	default:
 		rec_io(state, block, offset, false, true);
 		return;
@@ -2768,6 +3421,133 @@ static void rec_meta_MULT2(struct lightrec_cstate *state,
 	jit_note(__FILE__, __LINE__);
 }
 
+static void rec_meta_DIVI(struct lightrec_cstate *state,
+			  const struct block *block, u16 offset)
+{
+	struct regcache *reg_cache = state->reg_cache;
+	union code c = block->opcode_list[offset].c;
+	jit_state_t *_jit = block->_jit;
+	u8 reg_lo = get_mult_div_lo(c);
+	u8 reg_hi = get_mult_div_hi(c);
+	u32 flags = block->opcode_list[offset].flags;
+	bool is_signed = c.i.op == OP_META_DIVI;
+	u32 div = get_divi_imm(c);
+	bool pow2 = !(div & (div - 1));
+	u8 rs, lo, hi, q, tmp, tmp2;
+	unsigned int l;
+	u64 m;
+
+	_jit_name(block->_jit, __func__);
+	jit_note(__FILE__, __LINE__);
+
+	rs = lightrec_alloc_reg_in(reg_cache, _jit, c.r.rs,
+				   is_signed ? REG_EXT : REG_ZEXT);
+	q = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	if (pow2) {
+		l = ctz32(div);
+
+		if (!l) {
+			jit_movr(q, rs);
+		} else if (is_signed) {
+			/* Bias negative dividends so that the shift rounds
+			 * towards zero */
+			jit_rshi(q, rs, 31);
+			jit_andi(q, q, div - 1);
+			jit_addr(q, q, rs);
+			jit_rshi(q, q, l);
+		} else {
+			jit_rshi_u(q, rs, l);
+		}
+	} else {
+		/* Multiply by the reciprocal (Granlund & Montgomery), which
+		 * gives the exact quotient for all 32-bit dividends */
+		l = 32 - clz32(div - 1);
+		tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+		if (is_signed) {
+			m = 1 + (1ull << (31 + l)) / div;
+
+			if (__WORDSIZE == 32) {
+				tmp = lightrec_alloc_reg_temp_with_value(reg_cache, _jit,
+									 (s32)m);
+				jit_hmulr(q, rs, tmp);
+
+				if (m & BIT(31))
+					jit_addr(q, q, rs);
+
+				jit_rshi(q, q, l - 1);
+			} else {
+				tmp = lightrec_alloc_reg_temp_with_value(reg_cache, _jit,
+									 (intptr_t)m);
+				jit_mulr(q, rs, tmp);
+				jit_rshi(q, q, 31 + l);
+			}
+
+			/* Add one to the quotient of negative dividends */
+			jit_rshi(tmp2, rs, 31);
+			jit_subr(q, q, tmp2);
+		} else {
+			m = 1 + (1ull << (32 + l)) / div;
+
+			if (__WORDSIZE == 32) {
+				tmp = lightrec_alloc_reg_temp_with_value(reg_cache, _jit,
+									 (u32)m);
+				jit_hmulr_u(q, rs, tmp);
+
+				if (m >> 32) {
+					/* The multiplier needs 33 bits */
+					jit_subr(tmp2, rs, q);
+					jit_rshi_u(tmp2, tmp2, 1);
+					jit_addr(q, q, tmp2);
+					jit_rshi_u(q, q, l - 1);
+				} else {
+					jit_rshi_u(q, q, l);
+				}
+			} else {
+				tmp = lightrec_alloc_reg_temp_with_value(reg_cache, _jit,
+									 (intptr_t)(m << (32 - l)));
+				jit_hmulr_u(q, rs, tmp);
+			}
+		}
+
+		lightrec_free_reg(reg_cache, tmp);
+		lightrec_free_reg(reg_cache, tmp2);
+	}
+
+	/* HI is computed first, as its output register may be our rs input
+	 * register; LO is then only a copy of the quotient. */
+	if (!op_flag_no_hi(flags)) {
+		hi = lightrec_alloc_reg_out(reg_cache, _jit, reg_hi, 0);
+
+		if (pow2 && !is_signed) {
+			jit_andi(hi, rs, div - 1);
+		} else {
+			tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+			if (pow2)
+				jit_lshi(tmp, q, l);
+			else
+				jit_muli(tmp, q, div);
+
+			jit_subr(hi, rs, tmp);
+
+			lightrec_free_reg(reg_cache, tmp);
+		}
+
+		lightrec_free_reg(reg_cache, hi);
+	}
+
+	if (!op_flag_no_lo(flags)) {
+		lo = lightrec_alloc_reg_out(reg_cache, _jit, reg_lo, 0);
+		jit_movr(lo, q);
+		lightrec_free_reg(reg_cache, lo);
+	}
+
+	lightrec_free_reg(reg_cache, q);
+	lightrec_free_reg(reg_cache, rs);
+}
+
 static void rec_meta_COM(struct lightrec_cstate *state,
 			 const struct block *block, u16 offset)
 {
@@ -2862,6 +3642,8 @@ static const lightrec_rec_func_t rec_standard[64] = {
 	[OP_META_MULTU2]	= rec_meta_MULT2,
 	[OP_META_LWU]		= rec_meta_LWU,
 	[OP_META_SWU]		= rec_meta_SWU,
+	[OP_META_DIVI]		= rec_meta_DIVI,
+	[OP_META_DIVIU]		= rec_meta_DIVI,
 };
 
 static const lightrec_rec_func_t rec_special[64] = {
@@ -2994,6 +3776,31 @@ static void rec_META(struct lightrec_cstate *state,
 		(*f)(state, block, offset);
 }
 
+static bool lightrec_rec_hoisted(struct lightrec_cstate *state,
+				 const struct block *block, u16 offset)
+{
+	const struct opcode *op;
+	unsigned int i;
+	bool hoisted = false;
+
+	/* Emit the loop-invariant opcodes of the loop starting at this offset
+	 * before its label; they are skipped in the loop body. */
+	for (i = offset; i < block->nb_ops; i++) {
+		op = &block->opcode_list[i];
+
+		if ((i > offset && op_flag_sync(op->flags))
+		    || has_delay_slot(op->c))
+			break;
+
+		if (op_flag_hoisted(op->flags)) {
+			(*rec_standard[op->i.op])(state, block, i);
+			hoisted = true;
+		}
+	}
+
+	return hoisted;
+}
+
 void lightrec_rec_opcode(struct lightrec_cstate *state,
 			 const struct block *block, u16 offset)
 {
@@ -3015,10 +3822,24 @@ void lightrec_rec_opcode(struct lightrec_cstate *state,
 		pr_debug("Adding branch target at offset 0x%x\n", offset << 2);
 		target = &state->targets[state->nb_targets++];
 		target->offset = offset;
-		target->label = jit_indirect();
+		target->entry = jit_indirect();
+		target->label = target->entry;
+
+		/* Entering the loop from the LUT runs its pre-header, so that
+		 * the hoisted values are computed again after e.g. a round
+		 * trip to the dispatcher; only the back edges skip it. */
+		if (OPT_LICM && lightrec_rec_hoisted(state, block, offset)) {
+			lightrec_storeback_regs(reg_cache, _jit);
+			lightrec_regcache_reset(reg_cache);
+
+			target->label = jit_label();
+		}
 	}
 
-	if (likely(op->opcode)) {
+	if (state->io_paired) {
+		/* Already emitted along with the previous opcode */
+		state->io_paired = false;
+	} else if (likely(op->opcode) && !op_flag_hoisted(op->flags)) {
 		f = rec_standard[op->i.op];
 
 		if (!HAS_DEFAULT_ELM && unlikely(!f))
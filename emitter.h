@@ -15,5 +15,9 @@ struct opcode;
 void lightrec_rec_opcode(struct lightrec_cstate *state, const struct block *block, u16 offset);
 void lightrec_emit_jump_to_interpreter(struct lightrec_cstate *state,
 				       const struct block *block, u16 offset);
+void lightrec_emit_cold_check(struct lightrec_cstate *state,
+			      struct block *block);
+void lightrec_emit_entry_check(struct lightrec_cstate *state,
+			       const struct block *block);
 
 #endif /* __EMITTER_H__ */
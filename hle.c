@@ -0,0 +1,548 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include "debug.h"
+#include "disassembler.h"
+#include "hle.h"
+#include "lightrec-private.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define HLE_REGS_RS	0x03e00000
+#define HLE_REGS_RT	0x001f0000
+#define HLE_REGS_RD	0x0000f800
+
+/* Opcodes run by the BIOS vector and its table dispatcher */
+#define HLE_BIOS_DISPATCH_OPS	12
+
+struct lightrec_hle_pattern {
+	const char *name;
+
+	/* The code must not go past the end of the block, as only the
+	 * block's code is checked for modifications */
+	const u32 *code;
+	unsigned int nb_ops;
+
+	/* Returns the number of opcodes the guest code would have run */
+	bool (*run)(struct lightrec_state *state, u32 *nb_ops);
+};
+
+static const u32 memset_words_code[] = {
+	0x10a00006,	// beqz		a1, 2f
+	0x24a2ffff,	// addiu	v0,a1,-1
+	0x2403ffff,	// li		v1,-1
+	0xac800000,	// 1: sw	zero,0(a0)
+	0x2442ffff,	// addiu	v0,v0,-1
+	0x1443fffd,	// bne		v0,v1, 1b
+	0x24840004,	// addiu	a0,a0,4
+	0x03e00008,	// 2: jr	ra
+	0x00000000,	// nop
+};
+
+static const u32 bzero_code[] = {
+	0x10a00005,	// beqz		a1, 2f
+	0x00000000,	// nop
+	0xa0800000,	// 1: sb	zero,0(a0)
+	0x24a5ffff,	// addiu	a1,a1,-1
+	0x14a0fffd,	// bnez		a1, 1b
+	0x24840001,	// addiu	a0,a0,1
+	0x03e00008,	// 2: jr	ra
+	0x00000000,	// nop
+};
+
+static const u32 memset_code[] = {
+	0x10c00005,	// beqz		a2, 2f
+	0x00801021,	// move		v0,a0
+	0xa0850000,	// 1: sb	a1,0(a0)
+	0x24c6ffff,	// addiu	a2,a2,-1
+	0x14c0fffd,	// bnez		a2, 1b
+	0x24840001,	// addiu	a0,a0,1
+	0x03e00008,	// 2: jr	ra
+	0x00000000,	// nop
+};
+
+static const u32 memcpy_code[] = {
+	0x10c00007,	// beqz		a2, 2f
+	0x00801021,	// move		v0,a0
+	0x90a30000,	// 1: lbu	v1,0(a1)
+	0x24c6ffff,	// addiu	a2,a2,-1
+	0xa0830000,	// sb		v1,0(a0)
+	0x24a50001,	// addiu	a1,a1,1
+	0x14c0fffb,	// bnez		a2, 1b
+	0x24840001,	// addiu	a0,a0,1
+	0x03e00008,	// 2: jr	ra
+	0x00000000,	// nop
+};
+
+static const u32 memmove_code[] = {
+	0x10c00013,	// beqz		a2, 4f
+	0x00801021,	// move		v0,a0
+	0x00a4182b,	// sltu		v1,a1,a0
+	0x14600009,	// bnez		v1, 2f
+	0x00a64021,	// addu		t0,a1,a2
+	0x90a30000,	// 1: lbu	v1,0(a1)
+	0x24c6ffff,	// addiu	a2,a2,-1
+	0xa0830000,	// sb		v1,0(a0)
+	0x24a50001,	// addiu	a1,a1,1
+	0x14c0fffb,	// bnez		a2, 1b
+	0x24840001,	// addiu	a0,a0,1
+	0x03e00008,	// jr		ra
+	0x00000000,	// nop
+	/* Backwards copy at 2f, and jr ra at 4f: not part of the block */
+};
+
+static const u32 strlen_code[] = {
+	0x00001021,	// move		v0,zero
+	0x80830000,	// 1: lb	v1,0(a0)
+	0x24840001,	// addiu	a0,a0,1
+	0x1460fffd,	// bnez		v1, 1b
+	0x24420001,	// addiu	v0,v0,1
+	0x03e00008,	// jr		ra
+	0x2442ffff,	// addiu	v0,v0,-1
+};
+
+static const u32 strcmp_code[] = {
+	0x90820000,	// 1: lbu	v0,0(a0)
+	0x90a30000,	// lbu		v1,0(a1)
+	0x24840001,	// addiu	a0,a0,1
+	0x14430003,	// bne		v0,v1, 2f
+	0x24a50001,	// addiu	a1,a1,1
+	0x1440fffa,	// bnez		v0, 1b
+	0x00000000,	// nop
+	0x03e00008,	// 2: jr	ra
+	0x00431023,	// subu		v0,v0,v1
+};
+
+struct lightrec_hle_bios {
+	u32 vector;
+	u32 table;		/* Address of the jump table in kernel RAM */
+	u32 nb_funcs;
+};
+
+static const struct lightrec_hle_bios hle_bios_tables[] = {
+	[HLE_BIOS_A0 - HLE_BIOS_A0] = { 0xa0, 0x200, 0xc0 },
+	[HLE_BIOS_B0 - HLE_BIOS_A0] = { 0xb0, 0x874, 0x5e },
+	[HLE_BIOS_C0 - HLE_BIOS_A0] = { 0xc0, 0x674, 0x1e },
+};
+
+static void * hle_get_ptr(struct lightrec_state *state, u32 addr, u32 *avail)
+{
+	const struct lightrec_mem_map *map;
+	uintptr_t offset;
+	void *host;
+
+	map = lightrec_get_map(state, &host, kunseg(addr));
+
+	/* Only plain memory can be accessed directly */
+	if (!map || map->ops || !map->address)
+		return NULL;
+
+	offset = (uintptr_t)host - (uintptr_t)map->address;
+	*avail = map->length - offset;
+
+	return host;
+}
+
+static void * hle_get_range(struct lightrec_state *state, u32 addr, u32 len)
+{
+	void *host;
+	u32 avail;
+
+	host = hle_get_ptr(state, addr, &avail);
+	if (!host || len > avail)
+		return NULL;
+
+	return host;
+}
+
+static void hle_invalidate(struct lightrec_state *state, u32 addr, u32 len)
+{
+	if (len && !(state->opt_flags & LIGHTREC_OPT_INV_DMA_ONLY))
+		lightrec_invalidate(state, addr, len + (addr & 0x3));
+}
+
+static bool hle_memset_words(struct lightrec_state *state, u32 *nb_ops)
+{
+	u32 *gpr = state->regs.gpr;
+	u32 len = gpr[5] * 4;
+	void *host;
+
+	if (gpr[5] > RAM_SIZE / 4)
+		return false;
+
+	if (len) {
+		host = hle_get_range(state, gpr[4], len);
+		if (!host)
+			return false;
+
+		memset(host, 0, len);
+		hle_invalidate(state, gpr[4], len);
+	}
+
+	*nb_ops = len ? 5 + gpr[5] * 4 : 4;
+
+	gpr[2] = 0xffffffff;
+	gpr[4] += len;
+
+	return true;
+}
+
+static bool hle_bzero(struct lightrec_state *state, u32 *nb_ops)
+{
+	u32 *gpr = state->regs.gpr;
+	u32 len = gpr[5];
+	void *host;
+
+	if (len) {
+		host = hle_get_range(state, gpr[4], len);
+		if (!host)
+			return false;
+
+		memset(host, 0, len);
+		hle_invalidate(state, gpr[4], len);
+	}
+
+	*nb_ops = 4 + len * 4;
+
+	gpr[4] += len;
+	gpr[5] = 0;
+
+	return true;
+}
+
+static bool hle_memset(struct lightrec_state *state, u32 *nb_ops)
+{
+	u32 *gpr = state->regs.gpr;
+	u32 len = gpr[6];
+	void *host;
+
+	if (len) {
+		host = hle_get_range(state, gpr[4], len);
+		if (!host)
+			return false;
+
+		memset(host, (u8)gpr[5], len);
+		hle_invalidate(state, gpr[4], len);
+	}
+
+	*nb_ops = 4 + len * 4;
+
+	gpr[2] = gpr[4];
+	gpr[4] += len;
+	gpr[6] = 0;
+
+	return true;
+}
+
+static bool hle_memcpy(struct lightrec_state *state, u32 *nb_ops)
+{
+	u32 *gpr = state->regs.gpr;
+	u32 len = gpr[6];
+	u8 *dst, *src;
+
+	if (len) {
+		dst = hle_get_range(state, gpr[4], len);
+		src = hle_get_range(state, gpr[5], len);
+		if (!dst || !src)
+			return false;
+
+		/* The guest loop copies forward one byte at a time, which
+		 * repeats the data when the destination overlaps the end of
+		 * the source; leave that case to the guest code. */
+		if (dst > src && dst < src + len)
+			return false;
+
+		memmove(dst, src, len);
+		hle_invalidate(state, gpr[4], len);
+	}
+
+	*nb_ops = 4 + len * 6;
+
+	gpr[2] = gpr[4];
+	gpr[4] += len;
+	gpr[5] += len;
+	gpr[6] = 0;
+
+	return true;
+}
+
+static bool hle_memmove(struct lightrec_state *state, u32 *nb_ops)
+{
+	u32 *gpr = state->regs.gpr;
+	u32 len = gpr[6];
+	void *dst, *src;
+
+	/* Only the forward copy is part of the matched code; the empty and
+	 * backwards copies jump out of the block, to code that was not
+	 * checked. */
+	if (!len || gpr[5] < gpr[4])
+		return false;
+
+	dst = hle_get_range(state, gpr[4], len);
+	src = hle_get_range(state, gpr[5], len);
+	if (!dst || !src)
+		return false;
+
+	memmove(dst, src, len);
+	hle_invalidate(state, gpr[4], len);
+
+	*nb_ops = 7 + len * 6;
+
+	gpr[2] = gpr[4];
+	gpr[4] += len;
+	gpr[5] += len;
+	gpr[6] = 0;
+
+	return true;
+}
+
+static bool hle_strlen(struct lightrec_state *state, u32 *nb_ops)
+{
+	u32 *gpr = state->regs.gpr;
+	const u8 *str, *end;
+	u32 avail, len;
+
+	str = hle_get_ptr(state, gpr[4], &avail);
+	if (!str)
+		return false;
+
+	end = memchr(str, 0, avail);
+	if (!end)
+		return false;
+
+	len = (u32)(end - str);
+
+	*nb_ops = 7 + len * 4;
+
+	gpr[2] = len;
+	gpr[4] += len + 1;
+
+	return true;
+}
+
+static bool hle_strcmp(struct lightrec_state *state, u32 *nb_ops)
+{
+	u32 *gpr = state->regs.gpr;
+	const u8 *s1, *s2;
+	u32 avail1, avail2, i;
+
+	s1 = hle_get_ptr(state, gpr[4], &avail1);
+	s2 = hle_get_ptr(state, gpr[5], &avail2);
+	if (!s1 || !s2)
+		return false;
+
+	for (i = 0; i < avail1 && i < avail2; i++) {
+		if (s1[i] != s2[i] || !s1[i])
+			break;
+	}
+
+	if (i == avail1 || i == avail2)
+		return false;
+
+	*nb_ops = 7 * i + (s1[i] != s2[i] ? 7 : 9);
+
+	gpr[2] = (u32)s1[i] - (u32)s2[i];
+	gpr[4] += i + 1;
+	gpr[5] += i + 1;
+
+	return true;
+}
+
+static const struct lightrec_hle_pattern hle_patterns[] = {
+	[HLE_MEMSET_WORDS] = {
+		"memset", memset_words_code,
+		ARRAY_SIZE(memset_words_code), hle_memset_words,
+	},
+	[HLE_BZERO] = {
+		"bzero", bzero_code, ARRAY_SIZE(bzero_code), hle_bzero,
+	},
+	[HLE_MEMSET] = {
+		"memset", memset_code, ARRAY_SIZE(memset_code), hle_memset,
+	},
+	[HLE_MEMCPY] = {
+		"memcpy", memcpy_code, ARRAY_SIZE(memcpy_code), hle_memcpy,
+	},
+	[HLE_MEMMOVE] = {
+		"memmove", memmove_code, ARRAY_SIZE(memmove_code), hle_memmove,
+	},
+	[HLE_STRLEN] = {
+		"strlen", strlen_code, ARRAY_SIZE(strlen_code), hle_strlen,
+	},
+	[HLE_STRCMP] = {
+		"strcmp", strcmp_code, ARRAY_SIZE(strcmp_code), hle_strcmp,
+	},
+};
+
+static bool hle_reg_is_temp(u8 reg)
+{
+	/* $at, $v1, $t0-$t9 */
+	return reg == 1 || reg == 3 || (reg >= 8 && reg <= 15)
+		|| reg == 24 || reg == 25;
+}
+
+static bool hle_match_reg(u8 *map, u8 *rmap, u8 pattern, u8 reg)
+{
+	/* Temporary registers may be renamed, as long as the renaming is
+	 * consistent through the whole routine. */
+	if (!hle_reg_is_temp(pattern) || !hle_reg_is_temp(reg))
+		return pattern == reg;
+
+	if (!map[pattern] && !rmap[reg]) {
+		map[pattern] = reg;
+		rmap[reg] = pattern;
+	}
+
+	return map[pattern] == reg;
+}
+
+static bool hle_match_opcode(u8 *map, u8 *rmap, union code p, union code c)
+{
+	u32 regs;
+
+	switch (p.i.op) {
+	case OP_SPECIAL:
+		regs = HLE_REGS_RS | HLE_REGS_RT | HLE_REGS_RD;
+		break;
+	case OP_REGIMM:
+		regs = HLE_REGS_RS;
+		break;
+	case OP_J:
+	case OP_JAL:
+	case OP_CP0:
+	case OP_CP2:
+	case OP_LWC2:
+	case OP_SWC2:
+		regs = 0;
+		break;
+	default:
+		regs = HLE_REGS_RS | HLE_REGS_RT;
+		break;
+	}
+
+	if ((p.opcode ^ c.opcode) & ~regs)
+		return false;
+
+	return (!(regs & HLE_REGS_RS) || hle_match_reg(map, rmap, p.r.rs, c.r.rs))
+		&& (!(regs & HLE_REGS_RT) || hle_match_reg(map, rmap, p.r.rt, c.r.rt))
+		&& (!(regs & HLE_REGS_RD) || hle_match_reg(map, rmap, p.r.rd, c.r.rd));
+}
+
+static bool hle_match(struct lightrec_state *state,
+		      const struct lightrec_hle_pattern *hle, u32 pc)
+{
+	u8 map[32] = { 0 }, rmap[32] = { 0 };
+	const u32 *code;
+	unsigned int i;
+	union code c;
+
+	/* The opcode list may have been modified by the previous passes, so
+	 * match against the guest code. */
+	code = hle_get_range(state, pc, hle->nb_ops * 4);
+	if (!code)
+		return false;
+
+	for (i = 0; i < hle->nb_ops; i++) {
+		c.opcode = LE32TOH(code[i]);
+
+		if (!hle_match_opcode(map, rmap, (union code)hle->code[i], c))
+			return false;
+	}
+
+	return true;
+}
+
+static u8 hle_find_bios_vector(struct lightrec_state *state, u32 pc)
+{
+	unsigned int i;
+
+	if (!state->ops.bios_call &&
+	    !(state->opt_flags & LIGHTREC_OPT_BIOS_CALLS))
+		return HLE_NONE;
+
+	for (i = 0; i < ARRAY_SIZE(hle_bios_tables); i++) {
+		if (kunseg(pc) == hle_bios_tables[i].vector)
+			return HLE_BIOS_A0 + i;
+	}
+
+	return HLE_NONE;
+}
+
+u8 lightrec_hle_find(struct lightrec_state *state, u32 pc)
+{
+	unsigned int i;
+	u8 func;
+
+	func = hle_find_bios_vector(state, pc);
+	if (func != HLE_NONE) {
+		pr_debug("Block at "PC_FMT" is a BIOS vector\n", pc);
+		return func;
+	}
+
+	for (i = HLE_NONE + 1; i < ARRAY_SIZE(hle_patterns); i++) {
+		if (hle_match(state, &hle_patterns[i], pc)) {
+			pr_debug("Block at "PC_FMT" is a %s\n",
+				 pc, hle_patterns[i].name);
+			return (u8) i;
+		}
+	}
+
+	return HLE_NONE;
+}
+
+static bool hle_bios_call(struct lightrec_state *state, u8 func,
+			  u32 *cycles, u32 *pc)
+{
+	const struct lightrec_hle_bios *bios = &hle_bios_tables[func - HLE_BIOS_A0];
+	u32 *gpr = state->regs.gpr;
+	u32 nb = gpr[9];
+	const u32 *entry;
+
+	if (state->ops.bios_call &&
+	    state->ops.bios_call(state, bios->vector, nb)) {
+		pr_debug("Host handled BIOS call %02"PRIX32"(%02"PRIX32"h)\n",
+			 bios->vector, nb);
+		*pc = gpr[31];
+	} else {
+		if (!(state->opt_flags & LIGHTREC_OPT_BIOS_CALLS)
+		    || nb >= bios->nb_funcs)
+			return false;
+
+		entry = hle_get_range(state, bios->table + nb * 4, 4);
+		if (!entry)
+			return false;
+
+		*pc = LE32TOH(*entry);
+	}
+
+	*cycles = HLE_BIOS_DISPATCH_OPS * state->cycles_per_op;
+
+	return true;
+}
+
+bool lightrec_hle_run(struct lightrec_state *state, u8 func,
+		      u32 *cycles, u32 *pc)
+{
+	const struct lightrec_hle_pattern *hle;
+	u32 nb_ops;
+
+	if (func >= HLE_BIOS_A0)
+		return hle_bios_call(state, func, cycles, pc);
+
+	hle = &hle_patterns[func];
+
+	if (!hle->run(state, &nb_ops)) {
+		pr_debug("Unable to run host %s, using guest code\n", hle->name);
+		return false;
+	}
+
+	pr_debug("Called host %s\n", hle->name);
+
+	*cycles = nb_ops * state->cycles_per_op;
+	*pc = state->regs.gpr[31];
+
+	return true;
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#ifndef __LIGHTREC_HLE_H__
+#define __LIGHTREC_HLE_H__
+
+#include "lightrec.h"
+
+enum lightrec_hle_func {
+	HLE_NONE,
+	HLE_MEMSET_WORDS,
+	HLE_BZERO,
+	HLE_MEMSET,
+	HLE_MEMCPY,
+	HLE_MEMMOVE,
+	HLE_STRLEN,
+	HLE_STRCMP,
+
+	HLE_BIOS_A0,
+	HLE_BIOS_B0,
+	HLE_BIOS_C0,
+};
+
+u8 lightrec_hle_find(struct lightrec_state *state, u32 pc);
+
+/* Run the host version of the given routine, and return the PC to continue
+ * at in "pc". Returns false if it cannot handle the current arguments, in
+ * which case the guest code must run. */
+_Bool lightrec_hle_run(struct lightrec_state *state, u8 func,
+		       u32 *cycles, u32 *pc);
+
+#endif /* __LIGHTREC_HLE_H__ */
@@ -6,6 +6,7 @@
 #include "disassembler.h"
 #include "interpreter.h"
 #include "lightrec-private.h"
+#include "memmanager.h"
 #include "optimizer.h"
 #include "regcache.h"
 
@@ -32,9 +33,68 @@ struct interpreter {
 	u32 cycles;
 	bool delay_slot;
 	bool load_delay;
+	bool threaded;
+	bool resume;
 	u16 offset;
 };
 
+enum int_op_handler {
+	INT_OP_STEP,
+	INT_OP_NOP,
+	INT_OP_LI,
+	INT_OP_ADDIU,
+	INT_OP_SLTI,
+	INT_OP_SLTIU,
+	INT_OP_ANDI,
+	INT_OP_ORI,
+	INT_OP_XORI,
+	INT_OP_SLL,
+	INT_OP_SRL,
+	INT_OP_SRA,
+	INT_OP_SLLV,
+	INT_OP_SRLV,
+	INT_OP_SRAV,
+	INT_OP_ADDU,
+	INT_OP_SUBU,
+	INT_OP_AND,
+	INT_OP_OR,
+	INT_OP_XOR,
+	INT_OP_NOR,
+	INT_OP_SLT,
+	INT_OP_SLTU,
+	INT_OP_MOV,
+	INT_OP_EXTC,
+	INT_OP_EXTS,
+	INT_OP_COM,
+	INT_OP_LOAD,
+	INT_OP_STORE,
+
+	/* Superinstructions, covering two opcodes */
+	INT_OP_LI2,
+	INT_OP_LI_LOAD,
+	INT_OP_LI_STORE,
+	INT_OP_ADDIU_LOAD,
+	INT_OP_ADDIU_STORE,
+	INT_OP_LOAD_NOP,
+	INT_OP_SLT_BRANCH,
+	INT_OP_SLTU_BRANCH,
+	INT_OP_SLTI_BRANCH,
+	INT_OP_SLTIU_BRANCH,
+};
+
+/* Pre-decoded form of an opcode, built once per block. Simple ALU opcodes
+ * are run directly from the dispatch loop using the unpacked operands;
+ * loads and stores try the direct RAM/scratchpad path first; everything else
+ * (branches, coprocessor opcodes...) uses the INT_OP_STEP handler, which runs
+ * the regular int_standard[] handler for a single opcode. For I-type
+ * opcodes, 'rd' holds the destination register and 'imm' the already
+ * extended immediate value. */
+struct int_op {
+	u32 imm;
+	u8 handler;
+	u8 rd, rs, rt;
+};
+
 static u32 int_get_branch_pc(const struct interpreter *inter)
 {
 	return get_branch_pc(inter->block, inter->offset, 0);
@@ -60,7 +120,7 @@ static inline u32 lightrec_int_op(struct interpreter *inter)
 	return execute(int_standard[inter->op->i.op], inter);
 }
 
-static inline u32 jump_skip(struct interpreter *inter)
+static inline void int_skip(struct interpreter *inter)
 {
 	inter->op = next_op(inter);
 	inter->offset++;
@@ -69,6 +129,17 @@ static inline u32 jump_skip(struct interpreter *inter)
 		inter->state->current_cycle += inter->cycles;
 		inter->cycles = 0;
 	}
+}
+
+static inline u32 jump_skip(struct interpreter *inter)
+{
+	int_skip(inter);
+
+	if (inter->threaded) {
+		/* Return to the dispatch loop instead of chaining handlers */
+		inter->resume = true;
+		return 0;
+	}
 
 	return lightrec_int_op(inter);
 }
@@ -377,10 +448,29 @@ static u32 int_special_JALR(struct interpreter *inter)
 
 static u32 int_do_branch(struct interpreter *inter, u32 old_pc, u32 next_pc)
 {
+	struct block *block = inter->block;
+	u16 offset;
+
 	if (!inter->delay_slot && op_flag_local_branch(inter->op->flags) &&
 	    (s16)inter->op->c.i.imm >= 0) {
 		next_pc = old_pc + ((1 + (s16)inter->op->c.i.imm) << 2);
-		next_pc = lightrec_emulate_block(inter->state, inter->block, next_pc);
+
+		if (inter->threaded) {
+			/* Jump to the target from the dispatch loop, accounting
+			 * for the cycles of the branch opcode like the nested
+			 * call to lightrec_emulate_block() would. */
+			offset = (kunseg(next_pc) - kunseg(block->pc)) >> 2;
+
+			inter->cycles += lightrec_cycles_of_opcode(inter->state,
+								   inter->op->c);
+			inter->op = &block->opcode_list[offset];
+			inter->offset = offset;
+			inter->resume = true;
+
+			return 0;
+		}
+
+		next_pc = lightrec_emulate_block(inter->state, block, next_pc);
 	}
 
 	return next_pc;
@@ -596,6 +686,109 @@ static u32 int_LUI(struct interpreter *inter)
 	return jump_next(inter);
 }
 
+static void * int_get_direct_host(struct lightrec_state *state, u32 kaddr,
+				  bool *is_ram)
+{
+	const struct lightrec_mem_map *map;
+	enum psx_map idx;
+	u32 offset;
+
+	if (kaddr < RAM_SIZE * 4) {
+		/* RAM or one of its mirrors */
+		idx = kaddr / RAM_SIZE;
+		if (idx)
+			idx += PSX_MAP_MIRROR1 - 1;
+	} else if ((kaddr >> 12) == 0x1f800) {
+		idx = PSX_MAP_SCRATCH_PAD;
+	} else {
+		return NULL;
+	}
+
+	if (idx >= state->nb_maps)
+		return NULL;
+
+	map = &state->maps[idx];
+	offset = kaddr - map->pc;
+
+	if (offset >= map->length)
+		return NULL;
+
+	while (map->mirror_of)
+		map = map->mirror_of;
+
+	/* Maps with custom callbacks must go through lightrec_rw() */
+	if (map->ops)
+		return NULL;
+
+	*is_ram = map == &state->maps[PSX_MAP_KERNEL_USER_RAM];
+
+	return map->address + offset;
+}
+
+/* Serve plain loads and stores to RAM and scratchpad inline, with the same
+ * semantics as the default memory callbacks used by lightrec_rw().
+ * Returns false if the access must take the regular path. */
+static bool int_io_direct(struct lightrec_state *state, union code c,
+			  u32 base, u32 *data)
+{
+	u32 kaddr = kunseg(base + (s16)c.i.imm);
+	bool is_ram;
+	void *host;
+
+	switch (c.i.op) {
+	case OP_LB:
+	case OP_LBU:
+	case OP_LH:
+	case OP_LHU:
+	case OP_LW:
+	case OP_SB:
+	case OP_SH:
+	case OP_SW:
+		break;
+	default:
+		return false;
+	}
+
+	host = int_get_direct_host(state, kaddr, &is_ram);
+	if (!host)
+		return false;
+
+	switch (c.i.op) {
+	case OP_LB:
+		*data = (s32)*(s8 *)host;
+		return true;
+	case OP_LBU:
+		*data = *(u8 *)host;
+		return true;
+	case OP_LH:
+		*data = (s32)(s16)LE16TOH(*(u16 *)host);
+		return true;
+	case OP_LHU:
+		*data = LE16TOH(*(u16 *)host);
+		return true;
+	case OP_LW:
+		*data = LE32TOH(*(u32 *)host);
+		return true;
+	case OP_SB:
+		*(u8 *)host = (u8)*data;
+		break;
+	case OP_SH:
+		*(u16 *)host = HTOLE16((u16)*data);
+		break;
+	case OP_SW:
+	default:
+		*(u32 *)host = HTOLE32(*data);
+		break;
+	}
+
+	/* Invalidate any block starting at this address */
+	if (is_ram && !state->smc_protect &&
+	    !(state->opt_flags & LIGHTREC_OPT_INV_DMA_ONLY))
+		lut_write(state, lut_offset(kaddr), NULL);
+
+	return true;
+}
+
 static u32 int_io(struct interpreter *inter, bool is_load)
 {
 	struct opcode_i *op = &inter->op->i;
@@ -605,10 +798,19 @@ static u32 int_io(struct interpreter *inter, bool is_load)
 	if (!inter->load_delay && inter->block)
 		flags = &inter->op->flags;
 
+	val = reg_cache[op->rt];
+
+	/* Untagged opcodes always go through lightrec_rw(), so that they are
+	 * tagged on their first execution. */
+	if ((!flags || LIGHTREC_FLAGS_GET_IO_MODE(*flags)) &&
+	    int_io_direct(inter->state, inter->op->c, reg_cache[op->rs], &val))
+		goto out;
+
 	val = lightrec_rw(inter->state, inter->op->c,
-			  reg_cache[op->rs], reg_cache[op->rt],
+			  reg_cache[op->rs], val,
 			  flags, inter->block, inter->offset);
 
+out:
 	if (is_load && op->rt)
 		reg_cache[op->rt] = val;
 
@@ -1018,6 +1220,32 @@ static u32 int_META_MULT2(struct interpreter *inter)
 	return jump_next(inter);
 }
 
+static u32 int_META_DIVI(struct interpreter *inter)
+{
+	u32 *reg_cache = inter->state->regs.gpr;
+	union code c = inter->op->c;
+	u32 rs = reg_cache[c.r.rs];
+	u16 div = get_divi_imm(c);
+	u8 reg_lo = get_mult_div_lo(c);
+	u8 reg_hi = get_mult_div_hi(c);
+	u32 lo, hi;
+
+	if (c.i.op == OP_META_DIVI) {
+		lo = (s32)rs / div;
+		hi = (s32)rs % div;
+	} else {
+		lo = rs / div;
+		hi = rs % div;
+	}
+
+	if (!op_flag_no_hi(inter->op->flags))
+		reg_cache[reg_hi] = hi;
+	if (!op_flag_no_lo(inter->op->flags))
+		reg_cache[reg_lo] = lo;
+
+	return jump_next(inter);
+}
+
 static u32 int_META_COM(struct interpreter *inter)
 {
 	u32 *reg_cache = inter->state->regs.gpr;
@@ -1069,6 +1297,8 @@ static const lightrec_int_func_t int_standard[64] = {
 	[OP_META_MULTU2]	= int_META_MULT2,
 	[OP_META_LWU]		= int_load,
 	[OP_META_SWU]		= int_store,
+	[OP_META_DIVI]		= int_META_DIVI,
+	[OP_META_DIVIU]		= int_META_DIVI,
 };
 
 static const lightrec_int_func_t int_special[64] = {
@@ -1187,6 +1417,532 @@ static u32 int_META(struct interpreter *inter)
 	return execute(f, inter);
 }
 
+static void int_decode_op(struct int_op *iop, const struct opcode *op)
+{
+	union code c = op->c;
+
+	iop->handler = INT_OP_STEP;
+	iop->imm = 0;
+	iop->rd = 0;
+	iop->rs = 0;
+	iop->rt = 0;
+
+	switch (c.i.op) {
+	case OP_SPECIAL:
+		iop->rd = c.r.rd;
+		iop->rs = c.r.rs;
+		iop->rt = c.r.rt;
+		iop->imm = c.r.imm;
+
+		switch (c.r.op) {
+		case OP_SPECIAL_SLL:
+			iop->handler = c.opcode ? INT_OP_SLL : INT_OP_NOP;
+			break;
+		case OP_SPECIAL_SRL:
+			iop->handler = INT_OP_SRL;
+			break;
+		case OP_SPECIAL_SRA:
+			iop->handler = INT_OP_SRA;
+			break;
+		case OP_SPECIAL_SLLV:
+			iop->handler = INT_OP_SLLV;
+			break;
+		case OP_SPECIAL_SRLV:
+			iop->handler = INT_OP_SRLV;
+			break;
+		case OP_SPECIAL_SRAV:
+			iop->handler = INT_OP_SRAV;
+			break;
+		case OP_SPECIAL_MFHI:
+			iop->handler = INT_OP_MOV;
+			iop->rs = REG_HI;
+			break;
+		case OP_SPECIAL_MTHI:
+			iop->handler = INT_OP_MOV;
+			iop->rd = REG_HI;
+			break;
+		case OP_SPECIAL_MFLO:
+			iop->handler = INT_OP_MOV;
+			iop->rs = REG_LO;
+			break;
+		case OP_SPECIAL_MTLO:
+			iop->handler = INT_OP_MOV;
+			iop->rd = REG_LO;
+			break;
+		case OP_SPECIAL_ADD:
+		case OP_SPECIAL_ADDU:
+			iop->handler = INT_OP_ADDU;
+			break;
+		case OP_SPECIAL_SUB:
+		case OP_SPECIAL_SUBU:
+			iop->handler = INT_OP_SUBU;
+			break;
+		case OP_SPECIAL_AND:
+			iop->handler = INT_OP_AND;
+			break;
+		case OP_SPECIAL_OR:
+			iop->handler = INT_OP_OR;
+			break;
+		case OP_SPECIAL_XOR:
+			iop->handler = INT_OP_XOR;
+			break;
+		case OP_SPECIAL_NOR:
+			iop->handler = INT_OP_NOR;
+			break;
+		case OP_SPECIAL_SLT:
+			iop->handler = INT_OP_SLT;
+			break;
+		case OP_SPECIAL_SLTU:
+			iop->handler = INT_OP_SLTU;
+			break;
+		default:
+			break;
+		}
+		break;
+	case OP_ADDI:
+	case OP_ADDIU:
+		iop->handler = c.i.rs ? INT_OP_ADDIU : INT_OP_LI;
+		iop->imm = (s32)(s16)c.i.imm;
+		break;
+	case OP_SLTI:
+		iop->handler = INT_OP_SLTI;
+		iop->imm = (s32)(s16)c.i.imm;
+		break;
+	case OP_SLTIU:
+		iop->handler = INT_OP_SLTIU;
+		iop->imm = (s32)(s16)c.i.imm;
+		break;
+	case OP_ANDI:
+		iop->handler = INT_OP_ANDI;
+		iop->imm = c.i.imm;
+		break;
+	case OP_ORI:
+		iop->handler = c.i.rs ? INT_OP_ORI : INT_OP_LI;
+		iop->imm = c.i.imm;
+		break;
+	case OP_XORI:
+		iop->handler = INT_OP_XORI;
+		iop->imm = c.i.imm;
+		break;
+	case OP_LUI:
+		iop->handler = INT_OP_LI;
+		iop->imm = c.i.imm << 16;
+		break;
+	case OP_LB:
+	case OP_LBU:
+	case OP_LH:
+	case OP_LHU:
+	case OP_LW:
+		iop->handler = INT_OP_LOAD;
+		break;
+	case OP_SB:
+	case OP_SH:
+	case OP_SW:
+		/* Self-modifying code is handled by int_store() */
+		if (!op_flag_smc(op->flags))
+			iop->handler = INT_OP_STORE;
+		break;
+	case OP_META:
+		switch (c.m.op) {
+		case OP_META_MOV:
+			iop->handler = INT_OP_MOV;
+			break;
+		case OP_META_EXTC:
+			iop->handler = INT_OP_EXTC;
+			break;
+		case OP_META_EXTS:
+			iop->handler = INT_OP_EXTS;
+			break;
+		case OP_META_COM:
+			iop->handler = INT_OP_COM;
+			break;
+		default:
+			break;
+		}
+
+		iop->rd = c.m.rd;
+		iop->rs = c.m.rs;
+		break;
+	default:
+		break;
+	}
+
+	switch (c.i.op) {
+	case OP_ADDI:
+	case OP_ADDIU:
+	case OP_SLTI:
+	case OP_SLTIU:
+	case OP_ANDI:
+	case OP_ORI:
+	case OP_XORI:
+	case OP_LUI:
+	case OP_LB:
+	case OP_LBU:
+	case OP_LH:
+	case OP_LHU:
+	case OP_LW:
+	case OP_SB:
+	case OP_SH:
+	case OP_SW:
+		iop->rd = c.i.rt;
+		iop->rs = c.i.rs;
+		iop->rt = c.i.rt;
+		break;
+	default:
+		break;
+	}
+
+	/* ALU opcodes writing $zero have no effect */
+	if (iop->handler > INT_OP_NOP && iop->handler <= INT_OP_COM && !iop->rd)
+		iop->handler = INT_OP_NOP;
+}
+
+static bool int_is_mem_handler(u8 handler)
+{
+	return handler == INT_OP_LOAD || handler == INT_OP_STORE;
+}
+
+/* Fuse the opcode at index i with the one following it, if they form a
+ * common idiom. The pre-decoded form of the second opcode is left intact, as
+ * it can still be reached directly as the target of a local branch. */
+static void int_fuse_ops(struct int_op *iops, const struct opcode *list, u16 i)
+{
+	struct int_op *iop = &iops[i], *next = &iops[i + 1];
+	union code c = list[i].c, nc = list[i + 1].c;
+
+	switch (iop->handler) {
+	case INT_OP_LI:
+		if (c.i.op != OP_LUI)
+			break;
+
+		/* LUI + ORI/ADDIU: constant materialization */
+		if ((nc.i.op == OP_ORI || nc.i.op == OP_ADDIU) &&
+		    nc.i.rs == c.i.rt && nc.i.rt == c.i.rt) {
+			iop->handler = INT_OP_LI2;
+
+			if (nc.i.op == OP_ORI)
+				iop->imm |= nc.i.imm;
+			else
+				iop->imm += (s32)(s16)nc.i.imm;
+			break;
+		}
+
+		/* LUI + load/store: absolute access */
+		if (int_is_mem_handler(next->handler) && next->rs == iop->rd) {
+			iop->handler = next->handler == INT_OP_LOAD ?
+				INT_OP_LI_LOAD : INT_OP_LI_STORE;
+		}
+		break;
+	case INT_OP_ADDIU:
+		/* ADDIU + load/store, e.g. stack frame setup */
+		if (int_is_mem_handler(next->handler) && next->rs == iop->rd) {
+			iop->handler = next->handler == INT_OP_LOAD ?
+				INT_OP_ADDIU_LOAD : INT_OP_ADDIU_STORE;
+		}
+		break;
+	case INT_OP_LOAD:
+		/* Load followed by the NOP filling its load delay slot */
+		if (next->handler == INT_OP_NOP)
+			iop->handler = INT_OP_LOAD_NOP;
+		break;
+	case INT_OP_SLT:
+	case INT_OP_SLTU:
+	case INT_OP_SLTI:
+	case INT_OP_SLTIU:
+		/* Compare-and-branch */
+		if ((nc.i.op != OP_BEQ && nc.i.op != OP_BNE) ||
+		    nc.i.rt != 0 || nc.i.rs != iop->rd)
+			break;
+
+		if (iop->handler == INT_OP_SLT)
+			iop->handler = INT_OP_SLT_BRANCH;
+		else if (iop->handler == INT_OP_SLTU)
+			iop->handler = INT_OP_SLTU_BRANCH;
+		else if (iop->handler == INT_OP_SLTI)
+			iop->handler = INT_OP_SLTI_BRANCH;
+		else
+			iop->handler = INT_OP_SLTIU_BRANCH;
+		break;
+	default:
+		break;
+	}
+}
+
+static struct int_op * int_get_ops(struct lightrec_state *state,
+				   struct block *block)
+{
+	struct opcode_list *list = container_of(block->opcode_list,
+						struct opcode_list, ops);
+	struct int_op *iops;
+	unsigned int i;
+
+	if (likely(list->int_ops))
+		return list->int_ops;
+
+	iops = lightrec_malloc(state, MEM_FOR_IR,
+			       sizeof(*iops) * list->nb_ops);
+	if (!iops)
+		return NULL;
+
+	for (i = 0; i < block->nb_ops; i++)
+		int_decode_op(&iops[i], &block->opcode_list[i]);
+
+	for (i = 0; i + 1 < block->nb_ops; i++)
+		int_fuse_ops(iops, block->opcode_list, i);
+
+	list->int_ops = iops;
+
+	return iops;
+}
+
+void lightrec_free_int_ops(struct lightrec_state *state,
+			   struct opcode_list *list)
+{
+	lightrec_free(state, MEM_FOR_IR,
+		      sizeof(*list->int_ops) * list->nb_ops, list->int_ops);
+}
+
+#ifdef __GNUC__
+#define INT_LABEL(name)	int_label_##name:
+#define INT_DISPATCH()	goto *int_labels[iop->handler]
+#else
+#define INT_LABEL(name)
+#define INT_DISPATCH()	continue
+#endif
+
+#define INT_CASE(name)	case INT_OP_##name: INT_LABEL(name)
+
+#define INT_SKIP() do {							\
+	inter->cycles += lightrec_cycles_of_opcode(state, inter->op->c);	\
+	int_skip(inter);							\
+	iop++;								\
+} while (0)
+
+#define INT_NEXT() do {							\
+	INT_SKIP();							\
+	INT_DISPATCH();							\
+} while (0)
+
+static inline bool int_load_direct(struct interpreter *inter,
+				   const struct int_op *iop, u32 *val)
+{
+	struct lightrec_state *state = inter->state;
+
+	/* Untagged opcodes must go through lightrec_rw() */
+	return LIGHTREC_FLAGS_GET_IO_MODE(inter->op->flags) &&
+		int_io_direct(state, inter->op->c, state->regs.gpr[iop->rs], val);
+}
+
+static inline bool int_store_direct(struct interpreter *inter,
+				    const struct int_op *iop)
+{
+	struct lightrec_state *state = inter->state;
+	u32 val = state->regs.gpr[iop->rt];
+
+	return LIGHTREC_FLAGS_GET_IO_MODE(inter->op->flags) &&
+		int_io_direct(state, inter->op->c, state->regs.gpr[iop->rs], &val);
+}
+
+static u32 int_run_ops(struct interpreter *inter, const struct int_op *iops)
+{
+#ifdef __GNUC__
+	static const void * const int_labels[] = {
+		[INT_OP_STEP]	= &&int_label_STEP,
+		[INT_OP_NOP]	= &&int_label_NOP,
+		[INT_OP_LI]	= &&int_label_LI,
+		[INT_OP_ADDIU]	= &&int_label_ADDIU,
+		[INT_OP_SLTI]	= &&int_label_SLTI,
+		[INT_OP_SLTIU]	= &&int_label_SLTIU,
+		[INT_OP_ANDI]	= &&int_label_ANDI,
+		[INT_OP_ORI]	= &&int_label_ORI,
+		[INT_OP_XORI]	= &&int_label_XORI,
+		[INT_OP_SLL]	= &&int_label_SLL,
+		[INT_OP_SRL]	= &&int_label_SRL,
+		[INT_OP_SRA]	= &&int_label_SRA,
+		[INT_OP_SLLV]	= &&int_label_SLLV,
+		[INT_OP_SRLV]	= &&int_label_SRLV,
+		[INT_OP_SRAV]	= &&int_label_SRAV,
+		[INT_OP_ADDU]	= &&int_label_ADDU,
+		[INT_OP_SUBU]	= &&int_label_SUBU,
+		[INT_OP_AND]	= &&int_label_AND,
+		[INT_OP_OR]	= &&int_label_OR,
+		[INT_OP_XOR]	= &&int_label_XOR,
+		[INT_OP_NOR]	= &&int_label_NOR,
+		[INT_OP_SLT]	= &&int_label_SLT,
+		[INT_OP_SLTU]	= &&int_label_SLTU,
+		[INT_OP_MOV]	= &&int_label_MOV,
+		[INT_OP_EXTC]	= &&int_label_EXTC,
+		[INT_OP_EXTS]	= &&int_label_EXTS,
+		[INT_OP_COM]	= &&int_label_COM,
+		[INT_OP_LOAD]	= &&int_label_LOAD,
+		[INT_OP_STORE]	= &&int_label_STORE,
+		[INT_OP_LI2]	= &&int_label_LI2,
+		[INT_OP_LI_LOAD]	= &&int_label_LI_LOAD,
+		[INT_OP_LI_STORE]	= &&int_label_LI_STORE,
+		[INT_OP_ADDIU_LOAD]	= &&int_label_ADDIU_LOAD,
+		[INT_OP_ADDIU_STORE]	= &&int_label_ADDIU_STORE,
+		[INT_OP_LOAD_NOP]	= &&int_label_LOAD_NOP,
+		[INT_OP_SLT_BRANCH]	= &&int_label_SLT_BRANCH,
+		[INT_OP_SLTU_BRANCH]	= &&int_label_SLTU_BRANCH,
+		[INT_OP_SLTI_BRANCH]	= &&int_label_SLTI_BRANCH,
+		[INT_OP_SLTIU_BRANCH]	= &&int_label_SLTIU_BRANCH,
+	};
+#endif
+	struct lightrec_state *state = inter->state;
+	const struct int_op *iop = &iops[inter->offset];
+	u32 *gpr = state->regs.gpr;
+	u32 pc, val;
+
+	for (;;) {
+		switch (iop->handler) {
+		INT_CASE(STEP)
+int_do_step:
+			inter->resume = false;
+
+			pc = lightrec_int_op(inter);
+			if (!inter->resume)
+				return pc;
+
+			iop = &iops[inter->offset];
+			INT_DISPATCH();
+		INT_CASE(NOP)
+			INT_NEXT();
+		INT_CASE(LI)
+			gpr[iop->rd] = iop->imm;
+			INT_NEXT();
+		INT_CASE(ADDIU)
+			gpr[iop->rd] = gpr[iop->rs] + iop->imm;
+			INT_NEXT();
+		INT_CASE(SLTI)
+			gpr[iop->rd] = (s32)gpr[iop->rs] < (s32)iop->imm;
+			INT_NEXT();
+		INT_CASE(SLTIU)
+			gpr[iop->rd] = gpr[iop->rs] < iop->imm;
+			INT_NEXT();
+		INT_CASE(ANDI)
+			gpr[iop->rd] = gpr[iop->rs] & iop->imm;
+			INT_NEXT();
+		INT_CASE(ORI)
+			gpr[iop->rd] = gpr[iop->rs] | iop->imm;
+			INT_NEXT();
+		INT_CASE(XORI)
+			gpr[iop->rd] = gpr[iop->rs] ^ iop->imm;
+			INT_NEXT();
+		INT_CASE(SLL)
+			gpr[iop->rd] = gpr[iop->rt] << iop->imm;
+			INT_NEXT();
+		INT_CASE(SRL)
+			gpr[iop->rd] = gpr[iop->rt] >> iop->imm;
+			INT_NEXT();
+		INT_CASE(SRA)
+			gpr[iop->rd] = (s32)gpr[iop->rt] >> iop->imm;
+			INT_NEXT();
+		INT_CASE(SLLV)
+			gpr[iop->rd] = gpr[iop->rt] << (gpr[iop->rs] & 0x1f);
+			INT_NEXT();
+		INT_CASE(SRLV)
+			gpr[iop->rd] = gpr[iop->rt] >> (gpr[iop->rs] & 0x1f);
+			INT_NEXT();
+		INT_CASE(SRAV)
+			gpr[iop->rd] = (s32)gpr[iop->rt] >> (gpr[iop->rs] & 0x1f);
+			INT_NEXT();
+		INT_CASE(ADDU)
+			gpr[iop->rd] = gpr[iop->rs] + gpr[iop->rt];
+			INT_NEXT();
+		INT_CASE(SUBU)
+			gpr[iop->rd] = gpr[iop->rs] - gpr[iop->rt];
+			INT_NEXT();
+		INT_CASE(AND)
+			gpr[iop->rd] = gpr[iop->rs] & gpr[iop->rt];
+			INT_NEXT();
+		INT_CASE(OR)
+			gpr[iop->rd] = gpr[iop->rs] | gpr[iop->rt];
+			INT_NEXT();
+		INT_CASE(XOR)
+			gpr[iop->rd] = gpr[iop->rs] ^ gpr[iop->rt];
+			INT_NEXT();
+		INT_CASE(NOR)
+			gpr[iop->rd] = ~(gpr[iop->rs] | gpr[iop->rt]);
+			INT_NEXT();
+		INT_CASE(SLT)
+			gpr[iop->rd] = (s32)gpr[iop->rs] < (s32)gpr[iop->rt];
+			INT_NEXT();
+		INT_CASE(SLTU)
+			gpr[iop->rd] = gpr[iop->rs] < gpr[iop->rt];
+			INT_NEXT();
+		INT_CASE(MOV)
+			gpr[iop->rd] = gpr[iop->rs];
+			INT_NEXT();
+		INT_CASE(EXTC)
+			gpr[iop->rd] = (u32)(s32)(s8)gpr[iop->rs];
+			INT_NEXT();
+		INT_CASE(EXTS)
+			gpr[iop->rd] = (u32)(s32)(s16)gpr[iop->rs];
+			INT_NEXT();
+		INT_CASE(COM)
+			gpr[iop->rd] = ~gpr[iop->rs];
+			INT_NEXT();
+		INT_CASE(LOAD)
+int_do_load:
+			if (!int_load_direct(inter, iop, &val))
+				goto int_do_step;
+
+			if (iop->rd)
+				gpr[iop->rd] = val;
+			INT_NEXT();
+		INT_CASE(STORE)
+int_do_store:
+			if (!int_store_direct(inter, iop))
+				goto int_do_step;
+			INT_NEXT();
+		INT_CASE(LI2)
+			gpr[iop->rd] = iop->imm;
+			INT_SKIP();
+			INT_NEXT();
+		INT_CASE(LI_LOAD)
+			gpr[iop->rd] = iop->imm;
+			INT_SKIP();
+			goto int_do_load;
+		INT_CASE(LI_STORE)
+			gpr[iop->rd] = iop->imm;
+			INT_SKIP();
+			goto int_do_store;
+		INT_CASE(ADDIU_LOAD)
+			gpr[iop->rd] = gpr[iop->rs] + iop->imm;
+			INT_SKIP();
+			goto int_do_load;
+		INT_CASE(ADDIU_STORE)
+			gpr[iop->rd] = gpr[iop->rs] + iop->imm;
+			INT_SKIP();
+			goto int_do_store;
+		INT_CASE(LOAD_NOP)
+			if (!int_load_direct(inter, iop, &val))
+				goto int_do_step;
+
+			if (iop->rd)
+				gpr[iop->rd] = val;
+			INT_SKIP();
+			INT_NEXT();
+		INT_CASE(SLT_BRANCH)
+			gpr[iop->rd] = (s32)gpr[iop->rs] < (s32)gpr[iop->rt];
+			INT_SKIP();
+			goto int_do_step;
+		INT_CASE(SLTU_BRANCH)
+			gpr[iop->rd] = gpr[iop->rs] < gpr[iop->rt];
+			INT_SKIP();
+			goto int_do_step;
+		INT_CASE(SLTI_BRANCH)
+			gpr[iop->rd] = (s32)gpr[iop->rs] < (s32)iop->imm;
+			INT_SKIP();
+			goto int_do_step;
+		INT_CASE(SLTIU_BRANCH)
+			gpr[iop->rd] = gpr[iop->rs] < iop->imm;
+			INT_SKIP();
+			goto int_do_step;
+		}
+	}
+}
+
 static u32 lightrec_emulate_block_list(struct lightrec_state *state,
 				       struct block *block, u32 offset)
 {
@@ -1196,9 +1952,17 @@ static u32 lightrec_emulate_block_list(struct lightrec_state *state,
 		.offset = offset,
 		.op = &block->opcode_list[offset],
 	};
+	const struct int_op *iops;
 	u32 pc;
 
-	pc = lightrec_int_op(&inter);
+	iops = int_get_ops(state, block);
+	if (likely(iops)) {
+		inter.threaded = true;
+		pc = int_run_ops(&inter, iops);
+	} else {
+		/* Out of memory - fall back to chaining the handlers */
+		pc = lightrec_int_op(&inter);
+	}
 
 	/* Add the cycles of the last branch */
 	inter.cycles += lightrec_cycles_of_opcode(inter.state, inter.op->c);
@@ -1212,6 +1976,14 @@ u32 lightrec_emulate_block(struct lightrec_state *state, struct block *block, u3
 {
 	u32 offset = (kunseg(pc) - kunseg(block->pc)) >> 2;
 
+	if (OPT_ENTRY_SPEC && offset == 0 && block->entry_spec)
+		lightrec_entry_spec_sample(state, block);
+
+	/* The compiled code of cold blocks jumps here once they become hot */
+	if (OPT_HOT_RECOMPILE && offset == 0 && block->function &&
+	    !block_has_flag(block, BLOCK_IS_HOT | BLOCK_IS_DEAD))
+		lightrec_count_block_exec(state, block);
+
 	if (offset < block->nb_ops)
 		return lightrec_emulate_block_list(state, block, offset);
 
@@ -9,9 +9,13 @@
 #include "lightrec.h"
 
 struct block;
+struct opcode_list;
 
 u32 lightrec_emulate_block(struct lightrec_state *state, struct block *block, u32 pc);
 u32 lightrec_handle_load_delay(struct lightrec_state *state,
 			       struct block *block, u32 pc, u32 reg);
 
+void lightrec_free_int_ops(struct lightrec_state *state,
+			   struct opcode_list *list);
+
 #endif /* __LIGHTREC_INTERPRETER_H__ */
@@ -23,6 +23,11 @@
 #include <inttypes.h>
 #include <stdint.h>
 
+/* The option kept its old name for the external lightrec-config.h files */
+#ifndef OPT_REPLACE_FUNCTIONS
+#define OPT_REPLACE_FUNCTIONS OPT_REPLACE_MEMSET
+#endif
+
 #define X32_FMT "0x%08"PRIx32
 #define PC_FMT "PC "X32_FMT
 
@@ -81,15 +86,47 @@
 #define BLOCK_SHOULD_RECOMPILE	BIT(1)
 #define BLOCK_FULLY_TAGGED	BIT(2)
 #define BLOCK_IS_DEAD		BIT(3)
-#define BLOCK_IS_MEMSET		BIT(4)
+#define BLOCK_IS_HLE		BIT(4)
 #define BLOCK_NO_OPCODE_LIST	BIT(5)
 #define BLOCK_PRELOAD_PC	BIT(6)
+#define BLOCK_IS_HOT		BIT(7)
 
 #define RAM_SIZE	0x200000
 #define BIOS_SIZE	0x80000
 
 #define CODE_LUT_SIZE	((RAM_SIZE + BIOS_SIZE) >> 2)
 
+/* Page table used to resolve memory maps over the KUNSEG space */
+#define MAP_PAGE_SHIFT	16
+#define MAP_PAGES	(0x20000000 >> MAP_PAGE_SHIFT)
+#define MAP_PAGE_MIXED	0xff
+
+/* Dirty map of the lazily-notified hardware registers, one byte per
+ * 32-bit register of the 0x1f801000-0x1f802fff area */
+#define HW_DIRTY_BASE	0x1f801000
+#define HW_DIRTY_SIZE	0x800
+
+/* Maximum number of hardware register writes grouped in one call */
+#define IO_BURST_MAX	8
+
+/* Registers profiled at the entry of a block, number of entries profiled
+ * before the block is specialized on their values, and number of failed
+ * entry checks before the block is compiled again without assumptions */
+#define ENTRY_SPEC_REGS		4
+#define ENTRY_SPEC_MIN_SAMPLES	8
+#define ENTRY_SPEC_MAX_FAILS	4
+
+/* Number of executions after which a compiled block is considered hot, and
+ * recompiled with the expensive optimization passes */
+#define HOT_BLOCK_THRESHOLD	64
+
+/* Maximum size of a leaf function inlined at its call sites, including the
+ * final JR $ra and its delay slot */
+#define INLINE_CALL_MAX_OPS	8
+
+/* Maximum number of entries of a switch jump table */
+#define JUMP_TABLE_MAX		256
+
 #define REG_LO 32
 #define REG_HI 33
 #define REG_TEMP (offsetof(struct lightrec_state, temp_reg) / sizeof(u32))
@@ -113,17 +150,53 @@ struct u16x2 {
 #endif
 };
 
+struct lightrec_map_page {
+	const struct lightrec_mem_map *map;	/* With mirrors resolved */
+	uintptr_t offset;			/* Host address - PSX address */
+	u8 idx;
+};
+
+struct block_entry_spec {
+	u32 value[ENTRY_SPEC_REGS];
+	u32 known[ENTRY_SPEC_REGS];
+	u8 reg[ENTRY_SPEC_REGS];
+	u8 nb_regs;
+	u8 nb_samples;
+	u8 nb_fails;
+	_Bool active;		/* The compiled code assumes the entry values */
+	_Bool disabled;
+};
+
+struct block_inline_call {
+	const u32 *code;	/* Host address of the callee's code */
+	u32 words[INLINE_CALL_MAX_OPS];
+	struct opcode ops[INLINE_CALL_MAX_OPS];
+	u32 pc;
+	u8 nb_ops;
+};
+
+struct block_jump_table {
+	u16 nb;
+	u8 reg;			/* Register holding the index */
+	u32 table[];		/* Targets, then byte offsets of their LUT entries */
+};
+
 struct block {
 	jit_state_t *_jit;
 	struct opcode *opcode_list;
 	void (*function)(void);
 	const u32 *code;
 	struct block *next;
+	struct block_entry_spec *entry_spec;
+	struct block_inline_call *inline_call;
+	struct block_jump_table *jump_table;
 	u32 pc;
 	u32 hash;
 	u32 precompile_date;
 	unsigned int code_size;
 	u16 nb_ops;
+	u8 hle_func;
+	u8 nb_execs;
 #if ENABLE_THREADED_COMPILER
 	_Atomic u8 flags;
 #else
@@ -138,15 +211,23 @@ struct lightrec_branch {
 
 struct lightrec_branch_target {
 	struct jit_node *label;
+	struct jit_node *entry;		/* Entry point from the LUT */
 	u32 offset;
 };
 
+struct lightrec_burst_entry {
+	u32 opcode;
+	u32 base;
+	u32 data;
+};
+
 enum c_wrappers {
 	C_WRAPPER_RW,
 	C_WRAPPER_RW_GENERIC,
 	C_WRAPPER_MFC,
 	C_WRAPPER_MTC,
 	C_WRAPPER_CP,
+	C_WRAPPER_RW_BURST,
 	C_WRAPPERS_COUNT,
 };
 
@@ -159,10 +240,12 @@ struct lightrec_cstate {
 	unsigned int nb_local_branches;
 	unsigned int nb_targets;
 	unsigned int cycles;
+	unsigned int nb_burst;
 
 	struct regcache *reg_cache;
 
 	_Bool no_load_delay;
+	_Bool io_paired;
 };
 
 struct lightrec_state {
@@ -171,7 +254,9 @@ struct lightrec_state {
 	u32 curr_pc;
 	u32 next_pc;
 	uintptr_t wrapper_regs[NUM_TEMPS];
+	struct lightrec_burst_entry burst[IO_BURST_MAX];
 	u8 in_delay_slot_n;
+	u8 hw_dirty_any;
 	u32 current_cycle;
 	u32 target_cycle;
 	u32 exit_flags;
@@ -184,11 +269,12 @@ struct lightrec_state {
 	struct recompiler *rec;
 	struct lightrec_cstate *cstate;
 	struct reaper *reaper;
+	struct constprop_cache *constprop;
 	void *tlsf;
 	void (*eob_wrapper_func)(void);
 	void (*interpreter_func)(void);
 	void (*ds_check_func)(void);
-	void (*memset_func)(void);
+	void (*hle_func)(void);
 	void (*get_next_block)(void);
 	struct lightrec_ops ops;
 	unsigned int nb_precompile;
@@ -197,8 +283,16 @@ struct lightrec_state {
 	const struct lightrec_mem_map *maps;
 	uintptr_t offset_ram, offset_bios, offset_scratch, offset_io;
 	u32 opt_flags;
+	u32 opt_passes;
+	_Bool pass_stats_enabled;
+	struct lightrec_pass_stats pass_stats[LIGHTREC_PASS_COUNT];
 	_Bool with_32bit_lut;
 	_Bool mirrors_mapped;
+	_Bool fastmem;
+	_Bool smc_protect;
+	struct lightrec_smc *smc;
+	u8 hw_dirty[HW_DIRTY_SIZE];
+	struct lightrec_map_page map_pages[MAP_PAGES];
 	void *code_lut[];
 };
 
@@ -210,6 +304,11 @@ u32 lightrec_rw(struct lightrec_state *state, union code op, u32 addr,
 
 void lightrec_free_block(struct lightrec_state *state, struct block *block);
 
+void lightrec_count_block_exec(struct lightrec_state *state,
+			       struct block *block);
+void lightrec_entry_spec_sample(struct lightrec_state *state,
+				struct block *block);
+
 void remove_from_code_lut(struct blockcache *cache, struct block *block);
 
 const struct lightrec_mem_map *
@@ -320,6 +419,12 @@ static inline u8 get_mult_div_hi(union code c)
 	return (OPT_FLAG_MULT_DIV && c.r.imm) ? c.r.imm : REG_HI;
 }
 
+/* The 11-bit divisor of DIVI/DIVIU is stored in the rt and function fields */
+static inline u16 get_divi_imm(union code c)
+{
+	return (c.r.rt << 6) | c.r.op;
+}
+
 static inline s16 s16_max(s16 a, s16 b)
 {
 	return a > b ? a : b;
@@ -362,6 +467,30 @@ static inline u8 block_clear_flags(struct block *block, u8 mask)
 #endif
 }
 
+/* Blocks whose entry values are still being profiled */
+static inline _Bool block_samples_entry(const struct block *block)
+{
+	const struct block_entry_spec *spec = block->entry_spec;
+
+	return OPT_ENTRY_SPEC && spec && !spec->active && !spec->disabled;
+}
+
+/* The code of cold blocks counts their executions until they become hot,
+ * and lets the interpreter sample their entry values */
+static inline _Bool block_is_cold(struct block *block)
+{
+	return (OPT_HOT_RECOMPILE && !block_has_flag(block, BLOCK_IS_HOT))
+		|| block_samples_entry(block);
+}
+
+/* Cold blocks need their opcode list for the hot passes, and small blocks
+ * for inlining them into their callers */
+static inline _Bool block_keeps_opcode_list(struct block *block)
+{
+	return block_is_cold(block) ||
+		(OPT_INLINE_CALLS && block->nb_ops <= INLINE_CALL_MAX_OPS);
+}
+
 static inline _Bool can_sign_extend(s32 value, u8 order)
 {
       return ((u32)(value >> (order - 1)) + 1) < 2;
@@ -7,11 +7,13 @@
 #include "debug.h"
 #include "disassembler.h"
 #include "emitter.h"
+#include "hle.h"
 #include "interpreter.h"
 #include "lightrec-config.h"
 #include "lightning-wrapper.h"
 #include "lightrec.h"
 #include "memmanager.h"
+#include "memmap.h"
 #include "reaper.h"
 #include "recompiler.h"
 #include "regcache.h"
@@ -228,6 +230,16 @@ lightrec_get_map_idx(struct lightrec_state *state, u32 kaddr)
 {
 	const struct lightrec_mem_map *map;
 	unsigned int i;
+	u8 idx;
+
+	if (likely(kaddr < MAP_PAGES << MAP_PAGE_SHIFT)) {
+		idx = state->map_pages[kaddr >> MAP_PAGE_SHIFT].idx;
+
+		/* Pages shared by several maps (e.g. scratchpad and hardware
+		 * registers) fall back to the slow lookup */
+		if (likely(idx != MAP_PAGE_MIXED))
+			return (enum psx_map) idx;
+	}
 
 	for (i = 0; i < state->nb_maps; i++) {
 		map = &state->maps[i];
@@ -239,13 +251,79 @@ lightrec_get_map_idx(struct lightrec_state *state, u32 kaddr)
 	return PSX_MAP_UNKNOWN;
 }
 
+static void lightrec_init_map_pages(struct lightrec_state *state)
+{
+	const struct lightrec_mem_map *map;
+	struct lightrec_map_page *page;
+	unsigned int i, j;
+	u32 start, end;
+	u8 idx;
+
+	for (i = 0; i < MAP_PAGES; i++) {
+		start = i << MAP_PAGE_SHIFT;
+		end = start + BIT(MAP_PAGE_SHIFT);
+		idx = PSX_MAP_UNKNOWN;
+
+		/* Find the first map that overlaps the page, as it is the one
+		 * the linear lookup would return. It can only be used as-is
+		 * if it covers the whole page. */
+		for (j = 0; j < state->nb_maps; j++) {
+			map = &state->maps[j];
+
+			if (map->pc >= end || map->pc + map->length <= start)
+				continue;
+
+			if (map->pc <= start && map->pc + map->length >= end &&
+			    j < MAP_PAGE_MIXED)
+				idx = (u8) j;
+			else
+				idx = MAP_PAGE_MIXED;
+			break;
+		}
+
+		page = &state->map_pages[i];
+		page->idx = idx;
+		page->map = NULL;
+		page->offset = 0;
+
+		if (idx == PSX_MAP_UNKNOWN || idx == MAP_PAGE_MIXED)
+			continue;
+
+		/* Resolve the mirrors now, so that a lookup is a single read
+		 * of the page table */
+		map = &state->maps[idx];
+		start = map->pc;
+
+		while (map->mirror_of)
+			map = map->mirror_of;
+
+		page->map = map;
+		page->offset = (uintptr_t)map->address - start;
+	}
+}
+
 const struct lightrec_mem_map *
 lightrec_get_map(struct lightrec_state *state, void **host, u32 kaddr)
 {
 	const struct lightrec_mem_map *map;
+	const struct lightrec_map_page *page;
 	enum psx_map idx;
 	u32 addr;
 
+	if (likely(kaddr < MAP_PAGES << MAP_PAGE_SHIFT)) {
+		page = &state->map_pages[kaddr >> MAP_PAGE_SHIFT];
+
+		if (likely(page->map)) {
+			if (host)
+				*host = (void *)(kaddr + page->offset);
+
+			return page->map;
+		}
+
+		if (page->idx == PSX_MAP_UNKNOWN)
+			return NULL;
+	}
+
 	idx = lightrec_get_map_idx(state, kaddr);
 	if (idx == PSX_MAP_UNKNOWN)
 		return NULL;
@@ -262,6 +340,34 @@ lightrec_get_map(struct lightrec_state *state, void **host, u32 kaddr)
 	return map;
 }
 
+static u32 hw_dirty_idx(u32 kaddr)
+{
+	return (kaddr >> 2) & (HW_DIRTY_SIZE - 1);
+}
+
+static u32 hw_dirty_addr(u32 idx)
+{
+	return HW_DIRTY_BASE + (((idx - hw_dirty_idx(HW_DIRTY_BASE))
+				 & (HW_DIRTY_SIZE - 1)) << 2);
+}
+
+static void lightrec_flush_hw_regs(struct lightrec_state *state)
+{
+	unsigned int i, idx;
+
+	state->hw_dirty_any = 0;
+
+	/* Notify the host in address order */
+	for (i = 0; i < HW_DIRTY_SIZE; i++) {
+		idx = (i + hw_dirty_idx(HW_DIRTY_BASE)) & (HW_DIRTY_SIZE - 1);
+
+		if (state->hw_dirty[idx]) {
+			state->hw_dirty[idx] = 0;
+			state->ops.hw_notify(state, hw_dirty_addr(idx));
+		}
+	}
+}
+
 u32 lightrec_rw(struct lightrec_state *state, union code op, u32 base,
 		u32 data, u32 *flags, struct block *block, u16 offset)
 {
@@ -304,6 +410,12 @@ u32 lightrec_rw(struct lightrec_state *state, union code op, u32 base,
 	} else if (flags &&
 		   LIGHTREC_FLAGS_GET_IO_MODE(*flags) == LIGHTREC_IO_DIRECT_HW) {
 		ops = &lightrec_default_ops;
+
+		/* The host will be notified when exiting the block */
+		if (op_flag_io_notify(*flags)) {
+			state->hw_dirty[hw_dirty_idx(addr)] = 1;
+			state->hw_dirty_any = 1;
+		}
 	} else {
 		if (flags && !LIGHTREC_FLAGS_GET_IO_MODE(*flags))
 			*flags |= LIGHTREC_IO_MODE(LIGHTREC_IO_HW);
@@ -419,6 +531,42 @@ static void lightrec_rw_generic_cb(struct lightrec_state *state, u32 arg)
 	lightrec_rw_helper(state, op->c, &op->flags, block, offset);
 }
 
+static void lightrec_rw_burst_cb(struct lightrec_state *state, u32 count)
+{
+	struct lightrec_hw_write writes[IO_BURST_MAX];
+	const struct lightrec_mem_map *map, *burst_map = NULL;
+	const struct lightrec_burst_entry *entry;
+	unsigned int i, nb = 0;
+	union code op;
+	u32 addr;
+
+	for (i = 0; i < count; i++) {
+		entry = &state->burst[i];
+		op = (union code) entry->opcode;
+		addr = kunseg(entry->base + (s16) op.i.imm);
+		map = lightrec_get_map(state, NULL, addr);
+
+		if (nb && map != burst_map) {
+			burst_map->ops->write_burst(state, writes, nb);
+			nb = 0;
+		}
+
+		if (map && map->ops && map->ops->write_burst) {
+			writes[nb].opcode = entry->opcode;
+			writes[nb].addr = addr;
+			writes[nb].data = entry->data;
+			burst_map = map;
+			nb++;
+		} else {
+			lightrec_rw(state, op, entry->base,
+				    entry->data, NULL, NULL, 0);
+		}
+	}
+
+	if (nb)
+		burst_map->ops->write_burst(state, writes, nb);
+}
+
 static u32 clamp_s32(s32 val, s32 min, s32 max)
 {
 	return val < min ? min : val > max ? max : val;
@@ -733,6 +881,45 @@ static struct block * lightrec_get_block(struct lightrec_state *state, u32 pc)
 	return block;
 }
 
+void lightrec_count_block_exec(struct lightrec_state *state,
+			       struct block *block)
+{
+	struct opcode_list *list;
+	u8 old_flags;
+
+	if (++block->nb_execs < HOT_BLOCK_THRESHOLD)
+		return;
+
+	pr_debug("Block at "PC_FMT" is hot - optimize it further\n", block->pc);
+
+	/* The hot passes modify the opcode list, which the threaded compiler
+	 * may be reading right now */
+	if (ENABLE_THREADED_COMPILER)
+		lightrec_recompiler_remove(state->rec, block);
+
+	block_set_flags(block, BLOCK_IS_HOT);
+
+	if (block_has_flag(block, BLOCK_NO_OPCODE_LIST)) {
+		lut_write(state, lut_offset(block->pc), block->function);
+		return;
+	}
+
+	lightrec_optimize_hot(state, block);
+
+	/* The hot passes modified the opcodes; the interpreter must decode
+	 * them again */
+	list = container_of(block->opcode_list, struct opcode_list, ops);
+	if (list->int_ops) {
+		lightrec_free_int_ops(state, list);
+		list->int_ops = NULL;
+	}
+
+	/* The code still counts the executions; don't run it anymore */
+	old_flags = block_set_flags(block, BLOCK_SHOULD_RECOMPILE);
+	if (!(old_flags & BLOCK_SHOULD_RECOMPILE))
+		lut_write(state, lut_offset(block->pc), NULL);
+}
+
 static void * get_next_block_func(struct lightrec_state *state, u32 pc)
 {
 	struct block *block;
@@ -740,6 +927,9 @@ static void * get_next_block_func(struct lightrec_state *state, u32 pc)
 	void *func;
 	int err;
 
+	if (ENABLE_SMC_PROTECT && state->smc_protect)
+		lightrec_smc_flush(state);
+
 	do {
 		func = lut_read(state, lut_offset(pc));
 		if (func && func != state->get_next_block)
@@ -750,12 +940,22 @@ static void * get_next_block_func(struct lightrec_state *state, u32 pc)
 		if (unlikely(!block))
 			break;
 
-		if (OPT_REPLACE_MEMSET &&
-		    block_has_flag(block, BLOCK_IS_MEMSET)) {
-			func = state->memset_func;
+		if (OPT_REPLACE_FUNCTIONS &&
+		    block_has_flag(block, BLOCK_IS_HLE)) {
+			func = state->hle_func;
 			break;
 		}
 
+		if (OPT_HOT_RECOMPILE && block->function &&
+		    !block_has_flag(block, BLOCK_IS_HOT | BLOCK_IS_DEAD))
+			lightrec_count_block_exec(state, block);
+
+		/* Keep profiling the entry values of compiled blocks until
+		 * there are enough samples to specialize them */
+		if (OPT_ENTRY_SPEC && block->function && pc == block->pc &&
+		    block_samples_entry(block))
+			lightrec_entry_spec_sample(state, block);
+
 		should_recompile = block_has_flag(block, BLOCK_SHOULD_RECOMPILE) &&
 			!block_has_flag(block, BLOCK_NEVER_COMPILE) &&
 			!block_has_flag(block, BLOCK_IS_DEAD);
@@ -1006,6 +1206,11 @@ static struct block * generate_wrapper(struct lightrec_state *state)
 
 	block->_jit = _jit;
 	block->opcode_list = NULL;
+	block->entry_spec = NULL;
+	block->inline_call = NULL;
+	block->jump_table = NULL;
+	block->hle_func = HLE_NONE;
+	block->nb_execs = 0;
 	block->flags = BLOCK_NO_OPCODE_LIST;
 	block->nb_ops = 0;
 
@@ -1033,28 +1238,24 @@ err_no_mem:
 	return NULL;
 }
 
-static u32 lightrec_memset(struct lightrec_state *state)
+static u32 lightrec_hle(struct lightrec_state *state, u32 pc)
 {
-	u32 kunseg_pc = kunseg(state->regs.gpr[4]);
-	void *host;
-	const struct lightrec_mem_map *map = lightrec_get_map(state, &host, kunseg_pc);
-	u32 length = state->regs.gpr[5] * 4;
+	struct block *block = lightrec_get_block(state, pc);
+	u32 cycles, next_pc;
 
-	if (!map) {
-		pr_err("Unable to find memory map for memset target address "PC_FMT"\n",
-		       kunseg_pc);
-		return 0;
+	if (unlikely(!block)) {
+		lightrec_set_exit_flags(state, LIGHTREC_EXIT_NOMEM);
+		return pc;
 	}
 
-	pr_debug("Calling host memset, "PC_FMT" (host address 0x%"PRIxPTR") for %"PRIu32" bytes\n",
-		 kunseg_pc, (uintptr_t)host, length);
-	memset(host, 0, length);
+	/* Run the guest code if the host variant can't handle the call */
+	if (!block_has_flag(block, BLOCK_IS_HLE) ||
+	    !lightrec_hle_run(state, block->hle_func, &cycles, &next_pc))
+		return lightrec_emulate_block(state, block, pc);
 
-	if (!(state->opt_flags & LIGHTREC_OPT_INV_DMA_ONLY))
-		lightrec_invalidate_map(state, map, kunseg_pc, length);
+	state->current_cycle += cycles;
 
-	/* Rough estimation of the number of cycles consumed */
-	return 8 + 5 * (length  + 3 / 4);
+	return next_pc;
 }
 
 static u32 lightrec_check_load_delay(struct lightrec_state *state, u32 pc, u8 reg)
@@ -1108,7 +1309,7 @@ static struct block * generate_dispatcher(struct lightrec_state *state)
 {
 	struct block *block;
 	jit_state_t *_jit;
-	jit_node_t *to_end, *loop, *loop2,
+	jit_node_t *to_end, *loop, *loop2, *no_dirty,
 		   *addr, *addr2, *addr3, *addr4, *addr5;
 	unsigned int i;
 	u32 offset;
@@ -1149,6 +1350,24 @@ static struct block * generate_dispatcher(struct lightrec_state *state)
 
 	loop2 = jit_label();
 
+	if (state->ops.hw_notify) {
+		/* Notify the host of the hardware registers that were written
+		 * by the block we just exited */
+		jit_ldxi_uc(JIT_R1, LIGHTREC_REG_STATE,
+			    lightrec_offset(hw_dirty_any));
+		no_dirty = jit_beqi(JIT_R1, 0);
+
+		update_cycle_counter_before_c(_jit);
+
+		jit_prepare();
+		jit_pushargr(LIGHTREC_REG_STATE);
+		jit_finishi(lightrec_flush_hw_regs);
+
+		update_cycle_counter_after_c(_jit);
+
+		jit_patch(no_dirty);
+	}
+
 	/* Jump to end if state->target_cycle < state->current_cycle */
 	to_end = jit_blei(LIGHTREC_REG_CYCLE, 0);
 
@@ -1183,7 +1402,8 @@ static struct block * generate_dispatcher(struct lightrec_state *state)
 
 	/* Slow path: call C function get_next_block_func() */
 
-	if (ENABLE_FIRST_PASS || OPT_DETECT_IMPOSSIBLE_BRANCHES) {
+	if (ENABLE_FIRST_PASS || ENABLE_THREADED_COMPILER ||
+	    OPT_DETECT_IMPOSSIBLE_BRANCHES) {
 		/* We may call the interpreter - update state->current_cycle */
 		update_cycle_counter_before_c(_jit);
 	}
@@ -1193,14 +1413,16 @@ static struct block * generate_dispatcher(struct lightrec_state *state)
 	jit_pushargr(JIT_V0);
 
 	/* Save the cycles register if needed */
-	if (!(ENABLE_FIRST_PASS || OPT_DETECT_IMPOSSIBLE_BRANCHES))
+	if (!(ENABLE_FIRST_PASS || ENABLE_THREADED_COMPILER ||
+	    OPT_DETECT_IMPOSSIBLE_BRANCHES))
 		jit_movr(JIT_V0, LIGHTREC_REG_CYCLE);
 
 	/* Get the next block */
 	jit_finishi(&get_next_block_func);
 	jit_retval(JIT_V1);
 
-	if (ENABLE_FIRST_PASS || OPT_DETECT_IMPOSSIBLE_BRANCHES) {
+	if (ENABLE_FIRST_PASS || ENABLE_THREADED_COMPILER ||
+	    OPT_DETECT_IMPOSSIBLE_BRANCHES) {
 		/* The interpreter may have updated state->current_cycle and
 		 * state->target_cycle - recalc the delta */
 		update_cycle_counter_after_c(_jit);
@@ -1223,22 +1445,21 @@ static struct block * generate_dispatcher(struct lightrec_state *state)
 
 	jit_retr(LIGHTREC_REG_CYCLE);
 
-	if (OPT_REPLACE_MEMSET) {
+	if (OPT_REPLACE_FUNCTIONS) {
 		/* Blocks will jump here when they need to call
-		 * lightrec_memset() */
+		 * lightrec_hle(), with the block's PC in JIT_V0 */
 		addr3 = jit_indirect();
 
-		jit_movr(JIT_V1, LIGHTREC_REG_CYCLE);
+		update_cycle_counter_before_c(_jit);
 
 		jit_prepare();
 		jit_pushargr(LIGHTREC_REG_STATE);
+		jit_pushargr(JIT_V0);
+		jit_finishi(lightrec_hle);
 
-		jit_finishi(lightrec_memset);
-		jit_retval(LIGHTREC_REG_CYCLE);
-
-		jit_ldxi_ui(JIT_V0, LIGHTREC_REG_STATE, lightrec_offset(regs.gpr[31]));
+		jit_retval(JIT_V0);
 
-		jit_subr(LIGHTREC_REG_CYCLE, JIT_V1, LIGHTREC_REG_CYCLE);
+		update_cycle_counter_after_c(_jit);
 
 		jit_patch_at(jit_b(), loop2);
 	}
@@ -1296,6 +1517,11 @@ static struct block * generate_dispatcher(struct lightrec_state *state)
 
 	block->_jit = _jit;
 	block->opcode_list = NULL;
+	block->entry_spec = NULL;
+	block->inline_call = NULL;
+	block->jump_table = NULL;
+	block->hle_func = HLE_NONE;
+	block->nb_execs = 0;
 	block->flags = BLOCK_NO_OPCODE_LIST;
 	block->nb_ops = 0;
 
@@ -1309,8 +1535,8 @@ static struct block * generate_dispatcher(struct lightrec_state *state)
 		state->interpreter_func = jit_address(addr4);
 	if (OPT_HANDLE_LOAD_DELAYS)
 		state->ds_check_func = jit_address(addr5);
-	if (OPT_REPLACE_MEMSET)
-		state->memset_func = jit_address(addr3);
+	if (OPT_REPLACE_FUNCTIONS)
+		state->hle_func = jit_address(addr3);
 	state->get_next_block = jit_address(addr);
 
 	if (ENABLE_DISASSEMBLER) {
@@ -1351,6 +1577,9 @@ void lightrec_free_opcode_list(struct lightrec_state *state, struct opcode *ops)
 {
 	struct opcode_list *list = container_of(ops, struct opcode_list, ops);
 
+	if (list->int_ops)
+		lightrec_free_int_ops(state, list);
+
 	lightrec_free(state, MEM_FOR_IR,
 		      sizeof(*list) + list->nb_ops * sizeof(struct opcode),
 		      list);
@@ -1388,6 +1617,7 @@ static struct opcode * lightrec_disassemble(struct lightrec_state *state,
 	}
 
 	list->nb_ops = (u16) length;
+	list->int_ops = NULL;
 
 	for (i = 0; i < length; i++) {
 		list->ops[i].opcode = LE32TOH(src[i]);
@@ -1426,12 +1656,22 @@ static struct block * lightrec_precompile_block(struct lightrec_state *state,
 		return NULL;
 	}
 
+	/* Write-protect the code, so that any write to it will invalidate the
+	 * block */
+	if (ENABLE_SMC_PROTECT && state->smc_protect)
+		lightrec_smc_protect(state, kunseg(pc), length);
+
 	block->pc = pc;
 	block->_jit = NULL;
 	block->function = NULL;
 	block->opcode_list = list;
 	block->code = code;
 	block->next = NULL;
+	block->entry_spec = NULL;
+	block->inline_call = NULL;
+	block->jump_table = NULL;
+	block->hle_func = HLE_NONE;
+	block->nb_execs = 0;
 	block->flags = 0;
 	block->code_size = 0;
 	block->precompile_date = state->current_cycle;
@@ -1459,8 +1699,8 @@ static struct block * lightrec_precompile_block(struct lightrec_state *state,
 
 	block->hash = lightrec_calculate_block_hash(block);
 
-	if (OPT_REPLACE_MEMSET && block_has_flag(block, BLOCK_IS_MEMSET))
-		addr = state->memset_func;
+	if (OPT_REPLACE_FUNCTIONS && block_has_flag(block, BLOCK_IS_HLE))
+		addr = state->hle_func;
 	else
 		addr = state->get_next_block;
 	lut_write(state, lut_offset(pc), addr);
@@ -1475,6 +1715,11 @@ static bool lightrec_block_is_fully_tagged(const struct block *block)
 	const struct opcode *op;
 	unsigned int i;
 
+	/* The interpreter needs the opcode list to profile the entry values,
+	 * and when the entry check fails. */
+	if (OPT_ENTRY_SPEC && block->entry_spec && !block->entry_spec->disabled)
+		return false;
+
 	for (i = 0; i < block->nb_ops; i++) {
 		op = &block->opcode_list[i];
 
@@ -1564,6 +1809,14 @@ int lightrec_compile_block(struct lightrec_cstate *cstate,
 	u8 old_flags;
 	u32 offset;
 
+	/* Clear the flag before reading the opcode flags, so that opcodes
+	 * tagged by the interpreter while the block is being compiled will
+	 * trigger another recompilation. */
+	old_flags = block_clear_flags(block, BLOCK_SHOULD_RECOMPILE);
+
+	if (OPT_ENTRY_SPEC)
+		lightrec_specialize_entry(state, block);
+
 	fully_tagged = lightrec_block_is_fully_tagged(block);
 	if (fully_tagged)
 		block_set_flags(block, BLOCK_FULLY_TAGGED);
@@ -1584,12 +1837,21 @@ int lightrec_compile_block(struct lightrec_cstate *cstate,
 
 	cstate->cycles = 0;
 	cstate->nb_local_branches = 0;
+	cstate->nb_burst = 0;
 	cstate->nb_targets = 0;
 	cstate->no_load_delay = false;
+	cstate->io_paired = false;
 
 	jit_prolog();
 	jit_tramp(256);
 
+	/* Local branches to the first opcode jump after the entry checks */
+	if (block_is_cold(block))
+		lightrec_emit_cold_check(cstate, block);
+
+	if (OPT_ENTRY_SPEC && block->entry_spec && block->entry_spec->active)
+		lightrec_emit_entry_check(cstate, block);
+
 	start_of_block = jit_label();
 
 	for (i = 0; i < block->nb_ops; i++) {
@@ -1651,6 +1913,8 @@ int lightrec_compile_block(struct lightrec_cstate *cstate,
 	if (!new_fn) {
 		if (!ENABLE_THREADED_COMPILER)
 			pr_err("Unable to compile block!\n");
+		if (old_flags & BLOCK_SHOULD_RECOMPILE)
+			block_set_flags(block, BLOCK_SHOULD_RECOMPILE);
 		block->_jit = oldjit;
 		jit_clear_state();
 		_jit_destroy_state(_jit);
@@ -1663,10 +1927,11 @@ int lightrec_compile_block(struct lightrec_cstate *cstate,
 		lightrec_reaper_pause(state->reaper);
 
 	block->function = new_fn;
-	block_clear_flags(block, BLOCK_SHOULD_RECOMPILE);
 
-	/* Add compiled function to the LUT */
-	lut_write(state, lut_offset(block->pc), block->function);
+	/* Add compiled function to the LUT, unless one of its opcodes got
+	 * tagged in the meantime and it must be compiled again */
+	if (!block_has_flag(block, BLOCK_SHOULD_RECOMPILE))
+		lut_write(state, lut_offset(block->pc), block->function);
 
 	/* Detect old blocks that have been covered by the new one */
 	for (i = 0; ENABLE_THREADED_COMPILER && i < cstate->nb_targets; i++) {
@@ -1710,7 +1975,7 @@ int lightrec_compile_block(struct lightrec_cstate *cstate,
 		 * be compiled. We can override the LUT entry with our new
 		 * block's entry point. */
 		offset = lut_offset(block->pc) + target->offset;
-		lut_write(state, offset, jit_address(target->label));
+		lut_write(state, offset, jit_address(target->entry));
 
 		if (ENABLE_THREADED_COMPILER) {
 			block2 = dead_blocks[i];
@@ -1744,10 +2009,11 @@ int lightrec_compile_block(struct lightrec_cstate *cstate,
 
 	jit_clear_state();
 
-	if (fully_tagged)
+	if (fully_tagged && !block_keeps_opcode_list(block))
 		old_flags = block_set_flags(block, BLOCK_NO_OPCODE_LIST);
 
-	if (fully_tagged && !(old_flags & BLOCK_NO_OPCODE_LIST)) {
+	if (fully_tagged && !block_keeps_opcode_list(block) &&
+	    !(old_flags & BLOCK_NO_OPCODE_LIST)) {
 		pr_debug("Block "PC_FMT" is fully tagged"
 			 " - free opcode list\n", block->pc);
 
@@ -1821,6 +2087,12 @@ u32 lightrec_execute(struct lightrec_state *state, u32 pc, u32 target_cycle)
 		state->current_cycle = state->target_cycle - cycles_delta;
 	}
 
+	if (ENABLE_SMC_PROTECT && state->smc_protect)
+		lightrec_smc_flush(state);
+
+	if (state->hw_dirty_any)
+		lightrec_flush_hw_regs(state);
+
 	if (ENABLE_THREADED_COMPILER)
 		lightrec_reaper_reap(state->reaper);
 
@@ -1845,6 +2117,9 @@ u32 lightrec_run_interpreter(struct lightrec_state *state, u32 pc,
 
 		pc = lightrec_emulate_block(state, block, pc);
 
+		if (state->hw_dirty_any)
+			lightrec_flush_hw_regs(state);
+
 		if (ENABLE_THREADED_COMPILER)
 			lightrec_reaper_reap(state->reaper);
 	} while (state->current_cycle < state->target_cycle);
@@ -1855,6 +2130,61 @@ u32 lightrec_run_interpreter(struct lightrec_state *state, u32 pc,
 	return pc;
 }
 
+void lightrec_entry_spec_sample(struct lightrec_state *state,
+				struct block *block)
+{
+	struct block_entry_spec *spec = block->entry_spec;
+	const u32 *gpr = state->regs.gpr;
+	unsigned int i;
+	u8 old_flags;
+
+	if (spec->disabled)
+		return;
+
+	if (!spec->active) {
+		/* Not compiled yet - record which bits are stable */
+		for (i = 0; i < spec->nb_regs; i++) {
+			if (spec->nb_samples)
+				spec->known[i] &= ~(spec->value[i] ^ gpr[spec->reg[i]]);
+			else
+				spec->known[i] = 0xffffffff;
+
+			spec->value[i] = gpr[spec->reg[i]] & spec->known[i];
+		}
+
+		if (spec->nb_samples < 0xff)
+			spec->nb_samples++;
+
+		/* Enough samples - compile the block again, specialized on
+		 * the bits that were the same in all of them */
+		if (spec->nb_samples == ENTRY_SPEC_MIN_SAMPLES &&
+		    block->function) {
+			old_flags = block_set_flags(block, BLOCK_SHOULD_RECOMPILE);
+			if (!(old_flags & BLOCK_SHOULD_RECOMPILE))
+				lut_write(state, lut_offset(block->pc), NULL);
+		}
+		return;
+	}
+
+	for (i = 0; i < spec->nb_regs; i++) {
+		if ((gpr[spec->reg[i]] & spec->known[i]) != spec->value[i])
+			break;
+	}
+
+	/* The entry check passed; we're not coming from the compiled code */
+	if (i == spec->nb_regs || ++spec->nb_fails < ENTRY_SPEC_MAX_FAILS)
+		return;
+
+	pr_debug("Entry values of block at "PC_FMT" are not stable"
+		 " - recompile without them\n", block->pc);
+
+	lightrec_unspecialize_entry(block);
+
+	old_flags = block_set_flags(block, BLOCK_SHOULD_RECOMPILE);
+	if (!(old_flags & BLOCK_SHOULD_RECOMPILE))
+		lut_write(state, lut_offset(block->pc), NULL);
+}
+
 void lightrec_free_block(struct lightrec_state *state, struct block *block)
 {
 	u8 old_flags;
@@ -1870,6 +2200,19 @@ void lightrec_free_block(struct lightrec_state *state, struct block *block)
 		lightrec_free_function(state, block->function);
 		lightrec_unregister(MEM_FOR_CODE, block->code_size);
 	}
+	if (block->entry_spec) {
+		lightrec_free(state, MEM_FOR_IR, sizeof(*block->entry_spec),
+			      block->entry_spec);
+	}
+	if (block->inline_call) {
+		lightrec_free(state, MEM_FOR_IR, sizeof(*block->inline_call),
+			      block->inline_call);
+	}
+	if (block->jump_table) {
+		lightrec_free(state, MEM_FOR_IR, sizeof(*block->jump_table)
+			      + block->jump_table->nb * 2 * sizeof(u32),
+			      block->jump_table);
+	}
 	lightrec_free(state, MEM_FOR_IR, sizeof(*block), block);
 }
 
@@ -1954,6 +2297,7 @@ struct lightrec_state * lightrec_init(char *argv0,
 	state->with_32bit_lut = with_32bit_lut;
 	state->in_delay_slot_n = 0xff;
 	state->cycles_per_op = 2;
+	state->opt_passes = LIGHTREC_ALL_PASSES;
 
 	state->block_cache = lightrec_blockcache_init(state);
 	if (!state->block_cache)
@@ -1976,6 +2320,8 @@ struct lightrec_state * lightrec_init(char *argv0,
 	state->nb_maps = nb;
 	state->maps = maps;
 
+	lightrec_init_map_pages(state);
+
 	memcpy(&state->ops, ops, sizeof(*ops));
 
 	state->dispatcher = generate_dispatcher(state);
@@ -1991,6 +2337,7 @@ struct lightrec_state * lightrec_init(char *argv0,
 	state->c_wrappers[C_WRAPPER_MFC] = lightrec_mfc_cb;
 	state->c_wrappers[C_WRAPPER_MTC] = lightrec_mtc_cb;
 	state->c_wrappers[C_WRAPPER_CP] = lightrec_cp_cb;
+	state->c_wrappers[C_WRAPPER_RW_BURST] = lightrec_rw_burst_cb;
 
 	map = &maps[PSX_MAP_BIOS];
 	state->offset_bios = (uintptr_t)map->address - map->pc;
@@ -2009,16 +2356,31 @@ struct lightrec_state * lightrec_init(char *argv0,
 	    maps[PSX_MAP_MIRROR3].address == map->address + 0x600000)
 		state->mirrors_mapped = true;
 
-	if (state->offset_bios == 0 &&
-	    state->offset_scratch == 0 &&
-	    state->offset_ram == 0 &&
-	    state->offset_io == 0 &&
-	    state->mirrors_mapped) {
+	if (ENABLE_FASTMEM && state->mirrors_mapped &&
+	    state->offset_bios == state->offset_ram &&
+	    state->offset_scratch == state->offset_ram &&
+	    lightrec_is_fastmem(state->offset_ram)) {
+		pr_info("Using fastmem. Emitted code will be best.\n");
+		state->fastmem = true;
+	} else if (state->offset_bios == 0 &&
+		   state->offset_scratch == 0 &&
+		   state->offset_ram == 0 &&
+		   state->offset_io == 0 &&
+		   state->mirrors_mapped) {
 		pr_info("Memory map is perfect. Emitted code will be best.\n");
+	} else if (state->offset_bios == state->offset_ram &&
+		   state->offset_scratch == state->offset_ram &&
+		   state->mirrors_mapped) {
+		pr_info("Memory map is good. Emitted code will be fast.\n");
 	} else {
 		pr_info("Memory map is sub-par. Emitted code will be slow.\n");
 	}
 
+	if (ENABLE_SMC_PROTECT && lightrec_smc_protect_init(state)) {
+		pr_info("Using page protection to detect self-modifying code\n");
+		state->smc_protect = true;
+	}
+
 	if (state->with_32bit_lut)
 		pr_info("Using 32-bit LUT\n");
 
@@ -2053,6 +2415,9 @@ void lightrec_destroy(struct lightrec_state *state)
 	state->current_cycle = ~state->current_cycle;
 	lightrec_print_info(state);
 
+	if (ENABLE_SMC_PROTECT && state->smc_protect)
+		lightrec_smc_protect_exit(state);
+
 	lightrec_free_block_cache(state->block_cache);
 	lightrec_free_block(state, state->dispatcher);
 	lightrec_free_block(state, state->c_wrapper_block);
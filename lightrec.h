@@ -68,6 +68,46 @@ struct lightrec_mem_map;
 /* Unsafe optimizations flags */
 #define LIGHTREC_OPT_INV_DMA_ONLY	(1 << 0)
 #define LIGHTREC_OPT_SP_GP_HIT_RAM	(1 << 1)
+/* Resolve the BIOS calls through the kernel's A0/B0/C0 jump tables,
+ * skipping the dispatch code. Requires a BIOS whose dispatchers are not
+ * hooked, and must be set before the BIOS vectors are first executed. */
+#define LIGHTREC_OPT_BIOS_CALLS		(1 << 2)
+
+/* Optimization passes, in the order they are run */
+enum lightrec_opt_pass {
+	LIGHTREC_PASS_REMOVE_DIV_BY_ZERO_SEQ,
+	LIGHTREC_PASS_REPLACE_FUNCTIONS,
+	LIGHTREC_PASS_DETECT_IMPOSSIBLE_BRANCHES,
+	LIGHTREC_PASS_HANDLE_LOAD_DELAYS,
+	LIGHTREC_PASS_SWAP_LOAD_DELAYS,
+	LIGHTREC_PASS_TRANSFORM_BRANCHES,
+	LIGHTREC_PASS_LOCAL_BRANCHES,
+	LIGHTREC_PASS_TRANSFORM_OPS,
+	LIGHTREC_PASS_SSA,
+	LIGHTREC_PASS_SWITCH_DELAY_SLOTS,
+	LIGHTREC_PASS_FLAG_IO,
+	LIGHTREC_PASS_GROUP_IO,
+	LIGHTREC_PASS_FORWARD_LOADS,
+	LIGHTREC_PASS_FIND_ENTRY_REGS,
+	LIGHTREC_PASS_FLAG_MULT_DIV,
+	LIGHTREC_PASS_EARLY_UNLOAD,
+	LIGHTREC_PASS_LICM,
+	LIGHTREC_PASS_DETECT_IDLE_LOOPS,
+	LIGHTREC_PASS_PAIR_IO,
+	LIGHTREC_PASS_INLINE_CALLS,
+	LIGHTREC_PASS_JUMP_TABLES,
+	LIGHTREC_PASS_PRELOAD_PC,
+
+	LIGHTREC_PASS_COUNT,
+};
+
+#define LIGHTREC_ALL_PASSES	((1u << LIGHTREC_PASS_COUNT) - 1)
+
+struct lightrec_pass_stats {
+	u64 time_ns;		/* Time spent running the pass */
+	u32 nb_blocks;		/* Number of blocks modified by the pass */
+	u32 nb_ops;		/* Number of opcodes modified by the pass */
+};
 
 enum psx_map {
 	PSX_MAP_KERNEL_USER_RAM,
@@ -85,6 +125,12 @@ enum psx_map {
 	PSX_MAP_UNKNOWN,
 };
 
+struct lightrec_hw_write {
+	u32 opcode;
+	u32 addr;
+	u32 data;
+};
+
 struct lightrec_mem_map_ops {
 	void (*sb)(struct lightrec_state *, u32 opcode,
 		   void *host, u32 addr, u32 data);
@@ -98,6 +144,12 @@ struct lightrec_mem_map_ops {
 	u32 (*lwu)(struct lightrec_state *, u32 opcode, void *host, u32 addr);
 	void (*swu)(struct lightrec_state *, u32 opcode,
 		    void *host, u32 addr, u32 data);
+
+	/* Optional: called with a sequence of consecutive stores to this
+	 * map, in program order. If NULL, sb/sh/sw are called instead. */
+	void (*write_burst)(struct lightrec_state *,
+			    const struct lightrec_hw_write *writes,
+			    unsigned int count);
 };
 
 struct lightrec_mem_map {
@@ -108,12 +160,34 @@ struct lightrec_mem_map {
 	const struct lightrec_mem_map *mirror_of;
 };
 
+enum lightrec_hw_policy {
+	/* Always go through the memory map's callbacks */
+	LIGHTREC_HW_CALLBACK,
+	/* Plain memory, read and written directly */
+	LIGHTREC_HW_MEMORY,
+	/* Read and written directly; writes are notified with hw_notify()
+	 * when the emulated code exits the current block */
+	LIGHTREC_HW_LAZY_NOTIFY,
+	/* Read directly from a shadow copy refreshed by the host; writes
+	 * go through the memory map's callbacks */
+	LIGHTREC_HW_SHADOW,
+};
+
 struct lightrec_ops {
 	void (*cop2_notify)(struct lightrec_state *state, u32 op, u32 data);
 	void (*cop2_op)(struct lightrec_state *state, u32 op);
 	void (*enable_ram)(struct lightrec_state *state, _Bool enable);
 	_Bool (*hw_direct)(u32 kaddr, _Bool is_write, u8 size);
 	void (*code_inv)(void *addr, u32 len);
+	enum lightrec_hw_policy (*hw_policy)(u32 kaddr, u8 size);
+	void (*hw_notify)(struct lightrec_state *state, u32 kaddr);
+
+	/* Optional: called when the emulated code calls the BIOS function
+	 * number "func" through the "vector" (0xa0, 0xb0 or 0xc0) address.
+	 * Return true if the call was handled, after setting the result
+	 * registers; the code then returns to $ra. Return false to run the
+	 * BIOS function. */
+	_Bool (*bios_call)(struct lightrec_state *state, u32 vector, u32 func);
 };
 
 struct lightrec_registers {
@@ -143,6 +217,23 @@ __api u32 lightrec_exit_flags(struct lightrec_state *state);
 
 __api void lightrec_set_unsafe_opt_flags(struct lightrec_state *state, u32 flags);
 
+/* Select the optimization passes run on new blocks, as a mask of
+ * (1 << enum lightrec_opt_pass). Passes disabled at build time never run.
+ * Changing the mask frees all the blocks, which are then built and compiled
+ * again with the new passes; it must not be done from a callback called
+ * while lightrec_execute() is running. */
+__api void lightrec_set_opt_passes(struct lightrec_state *state, u32 passes);
+__api u32 lightrec_get_opt_passes(const struct lightrec_state *state);
+__api const char * lightrec_get_pass_name(enum lightrec_opt_pass pass);
+
+/* Per-pass statistics are only collected while enabled. Enabling them
+ * resets the counters. */
+__api void lightrec_enable_pass_stats(struct lightrec_state *state,
+				      _Bool enable);
+__api int lightrec_get_pass_stats(const struct lightrec_state *state,
+				  enum lightrec_opt_pass pass,
+				  struct lightrec_pass_stats *stats);
+
 __api __cnst struct lightrec_registers *
 lightrec_get_registers(struct lightrec_state *state);
 
@@ -152,6 +243,37 @@ __api void lightrec_set_target_cycle_count(struct lightrec_state *state,
 					   u32 cycles);
 __api void lightrec_set_cycles_per_opcode(struct lightrec_state *state, u32 cycles);
 
+struct lightrec_memory {
+	void *ram;
+	void *bios;
+	void *scratch;
+};
+
+/* Map the PSX RAM, BIOS and scratchpad with the layout that gives the best
+ * emitted code: all at the same offset from their PSX address, with the RAM
+ * mirrors aliased every 0x200000 bytes. The memory maps passed to
+ * lightrec_init() should then use the returned pointers, and
+ * RAM + 0x200000 * N for the mirrors.
+ * When built with ENABLE_SMC_PROTECT, the RAM pages holding compiled code are
+ * then write-protected, and the write faults invalidate the code. Writes
+ * done by the kernel on behalf of the host, e.g. read(2) directly into the
+ * RAM, fail with EFAULT instead of faulting: such data must be read into a
+ * separate buffer, then copied to the RAM.
+ * Returns 0 on success, or -ENOSYS on hosts that don't support memfd. */
+__api int lightrec_map_memory(struct lightrec_memory *mem);
+__api void lightrec_unmap_memory(struct lightrec_memory *mem);
+
+/* Fastmem: map the PSX RAM, BIOS and scratchpad over a 4 GiB area, with all
+ * their mirrors. The returned pointer must be used as the base address of
+ * the memory maps passed to lightrec_init(): RAM at base + 0x0 (mirrors
+ * every 0x200000 bytes), scratchpad at base + 0x1f800000 and BIOS at
+ * base + 0x1fc00000.
+ * Only loads, and stores that don't need to invalidate code, are emitted as
+ * fastmem accesses; the other stores still check the address.
+ * Returns NULL when not built with ENABLE_FASTMEM. */
+__api void * lightrec_map_fastmem(void);
+__api void lightrec_unmap_fastmem(void *base);
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,567 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#define _GNU_SOURCE
+
+#include "debug.h"
+#include "lightrec.h"
+#include "lightrec-private.h"
+#include "memmanager.h"
+#include "memmap.h"
+
+#include <errno.h>
+#include <stdbool.h>
+
+#if HAS_MEMFD
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if HAS_MEMFD
+#define FASTMEM_SIZE	0x100000000ULL
+#define FASTMEM_GUARD	0x10000
+
+#define MEMORY_SIZE	0x20000000
+
+#define SCRATCH_ADDR	0x1f800000
+#define BIOS_ADDR	0x1fc00000
+
+#define SMC_PAGES	(RAM_SIZE / 0x1000)
+
+#define MEMMAP_MAX_AREAS	8
+#define SMC_MAX_STATES		MEMMAP_MAX_AREAS
+
+struct memmap_area {
+	u8 *base;
+	size_t size;
+	size_t guard;
+	const u32 *segments;
+	unsigned int nb_segments;
+	bool mapped;
+	bool fastmem;
+};
+
+struct lightrec_smc {
+	struct lightrec_state *state;
+	const struct memmap_area *area;
+	size_t page_size;
+	atomic_flag lock;
+	atomic_bool pending;
+	bool protected[SMC_PAGES];
+	atomic_bool dirty[SMC_PAGES];
+};
+
+static const u32 kuseg_segments[] = { 0x00000000 };
+
+static struct memmap_area areas[MEMMAP_MAX_AREAS];
+
+#if ENABLE_FASTMEM
+/* KUSEG, KSEG0 and KSEG1 all alias the same physical memory */
+static const u32 fastmem_segments[] = { 0x00000000, 0x80000000, 0xa0000000 };
+#endif
+
+static struct memmap_area * memmap_find_area(const void *base)
+{
+	unsigned int i;
+
+	for (i = 0; i < MEMMAP_MAX_AREAS; i++) {
+		if (areas[i].mapped && areas[i].base == base)
+			return &areas[i];
+	}
+
+	return NULL;
+}
+
+static struct memmap_area * memmap_add_area(u8 *base, size_t size,
+					    size_t guard, const u32 *segments,
+					    unsigned int nb_segments)
+{
+	unsigned int i;
+
+	for (i = 0; i < MEMMAP_MAX_AREAS; i++) {
+		if (!areas[i].mapped)
+			break;
+	}
+
+	if (i == MEMMAP_MAX_AREAS) {
+		pr_err("Too many memory areas mapped\n");
+		munmap(base - guard, size + 2 * guard);
+		return NULL;
+	}
+
+	areas[i] = (struct memmap_area){
+		.base = base,
+		.size = size,
+		.guard = guard,
+		.segments = segments,
+		.nb_segments = nb_segments,
+		.mapped = true,
+	};
+
+	return &areas[i];
+}
+
+static void memmap_remove_area(struct memmap_area *area)
+{
+	munmap(area->base - area->guard, area->size + 2 * area->guard);
+	area->mapped = false;
+}
+
+static bool map_fd(u8 *base, u32 addr, int fd, size_t offset, size_t len)
+{
+	void *ptr = mmap(base + addr, len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_FIXED, fd, offset);
+
+	return ptr == base + addr;
+}
+
+/* Map RAM (with its three mirrors), BIOS and scratchpad from a memfd at
+ * their PSX address in each one of the given segments. The pages of the
+ * area that don't alias memory are backed by zero pages, so that a stray
+ * access to hardware registers or unmapped areas won't crash the
+ * emulator. The guard areas around it, if any, are inaccessible.
+ * Returns NULL on error. */
+static u8 * map_memory(size_t size, size_t guard,
+		       const u32 *segments, unsigned int nb_segments)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t scratch_size = page_size > 0x1000 ? page_size : 0x1000;
+	size_t fd_size = RAM_SIZE + BIOS_SIZE + scratch_size;
+	unsigned int i, j;
+	u8 *ptr, *base;
+	u32 seg;
+	int fd;
+
+	fd = memfd_create("lightrec", 0);
+	if (fd < 0) {
+		pr_err("Unable to create memfd\n");
+		return NULL;
+	}
+
+	if (ftruncate(fd, fd_size) < 0) {
+		pr_err("Unable to resize memfd\n");
+		goto err_close_fd;
+	}
+
+	ptr = mmap(NULL, size + 2 * guard, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED) {
+		pr_err("Unable to reserve memory area\n");
+		goto err_close_fd;
+	}
+
+	base = ptr + guard;
+
+	/* Accesses to the guard areas must fault */
+	if (guard && (mprotect(ptr, guard, PROT_NONE) < 0 ||
+		      mprotect(base + size, guard, PROT_NONE) < 0)) {
+		pr_err("Unable to protect guard areas\n");
+		goto err_unmap;
+	}
+
+	for (i = 0; i < nb_segments; i++) {
+		seg = segments[i];
+
+		for (j = 0; j < 4; j++) {
+			if (!map_fd(base, seg + j * RAM_SIZE, fd, 0, RAM_SIZE))
+				goto err_unmap;
+		}
+
+		if (!map_fd(base, seg + BIOS_ADDR, fd, RAM_SIZE, BIOS_SIZE))
+			goto err_unmap;
+
+		if (!map_fd(base, seg + SCRATCH_ADDR, fd,
+			    RAM_SIZE + BIOS_SIZE, scratch_size))
+			goto err_unmap;
+	}
+
+	/* The mappings hold a reference to the memfd */
+	close(fd);
+
+	return base;
+
+err_unmap:
+	pr_err("Unable to map memory area\n");
+	munmap(ptr, size + 2 * guard);
+err_close_fd:
+	close(fd);
+	return NULL;
+}
+
+#if ENABLE_FASTMEM
+void * lightrec_map_fastmem(void)
+{
+	struct memmap_area *area;
+	u8 *base;
+
+	/* Reserve the whole 32-bit address space, plus inaccessible guard
+	 * areas on both sides, so that base+offset accesses that wrap around
+	 * fault instead of hitting unrelated host memory. */
+	base = map_memory(FASTMEM_SIZE, FASTMEM_GUARD, fastmem_segments,
+			  ARRAY_SIZE(fastmem_segments));
+	if (!base)
+		return NULL;
+
+	area = memmap_add_area(base, FASTMEM_SIZE, FASTMEM_GUARD,
+			       fastmem_segments, ARRAY_SIZE(fastmem_segments));
+	if (!area)
+		return NULL;
+
+	area->fastmem = true;
+
+	pr_info("Fastmem area mapped at %p\n", base);
+
+	return base;
+}
+
+void lightrec_unmap_fastmem(void *base)
+{
+	struct memmap_area *area = memmap_find_area(base);
+
+	if (area && area->fastmem)
+		memmap_remove_area(area);
+}
+
+bool lightrec_is_fastmem(uintptr_t offset)
+{
+	const struct memmap_area *area = memmap_find_area((void *)offset);
+
+	return area && area->fastmem;
+}
+#endif /* ENABLE_FASTMEM */
+
+int lightrec_map_memory(struct lightrec_memory *mem)
+{
+	u8 *base;
+
+	/* Map the KUSEG area, so that the RAM, BIOS and scratchpad share the
+	 * same offset. The area is never mapped at address 0x0, as a NULL
+	 * memory map address means that the map can't be accessed directly. */
+	base = map_memory(MEMORY_SIZE, 0, kuseg_segments,
+			  ARRAY_SIZE(kuseg_segments));
+	if (!base)
+		return -ENOMEM;
+
+	if (!memmap_add_area(base, MEMORY_SIZE, 0, kuseg_segments,
+			     ARRAY_SIZE(kuseg_segments)))
+		return -EBUSY;
+
+	pr_info("Memory area mapped at %p\n", base);
+
+	mem->ram = base;
+	mem->bios = base + BIOS_ADDR;
+	mem->scratch = base + SCRATCH_ADDR;
+
+	return 0;
+}
+
+void lightrec_unmap_memory(struct lightrec_memory *mem)
+{
+	struct memmap_area *area = memmap_find_area(mem->ram);
+
+	if (area && !area->fastmem)
+		memmap_remove_area(area);
+
+	mem->ram = mem->bios = mem->scratch = NULL;
+}
+
+#if ENABLE_SMC_PROTECT
+/* The SIGSEGV handler is shared by all the lightrec instances; it finds the
+ * one owning the faulting address in this list. */
+static struct lightrec_smc *_Atomic smc_list[SMC_MAX_STATES];
+static atomic_flag smc_list_lock = ATOMIC_FLAG_INIT;
+static unsigned int smc_nb_users;
+static struct sigaction smc_old_action;
+
+static void smc_spin_lock(atomic_flag *lock)
+{
+	while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire));
+}
+
+static void smc_spin_unlock(atomic_flag *lock)
+{
+	atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+static void smc_set_page_prot(const struct lightrec_smc *smc,
+			      unsigned int page, int prot)
+{
+	const struct memmap_area *area = smc->area;
+	unsigned int i, j;
+	u8 *addr;
+
+	/* Protect the page in all the mirrors and segments */
+	for (i = 0; i < area->nb_segments; i++) {
+		for (j = 0; j < 4; j++) {
+			addr = area->base + area->segments[i]
+				+ j * RAM_SIZE + page * smc->page_size;
+
+			mprotect(addr, smc->page_size, prot);
+		}
+	}
+}
+
+static bool smc_get_page(const struct lightrec_smc *smc,
+			 const u8 *addr, unsigned int *page)
+{
+	const struct memmap_area *area = smc->area;
+	unsigned int i;
+	const u8 *ram;
+
+	for (i = 0; i < area->nb_segments; i++) {
+		ram = area->base + area->segments[i];
+
+		if (addr >= ram && addr < ram + RAM_SIZE * 4) {
+			*page = ((addr - ram) & (RAM_SIZE - 1)) / smc->page_size;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void smc_forward_signal(int sig, siginfo_t *info, void *ctx)
+{
+	if (smc_old_action.sa_flags & SA_SIGINFO) {
+		smc_old_action.sa_sigaction(sig, info, ctx);
+	} else if (smc_old_action.sa_handler != SIG_DFL &&
+		   smc_old_action.sa_handler != SIG_IGN) {
+		smc_old_action.sa_handler(sig);
+	} else {
+		/* Restore the default handler; the faulting access will be
+		 * retried and crash as it should. */
+		sigaction(SIGSEGV, &smc_old_action, NULL);
+	}
+}
+
+/* Only async-signal-safe operations are allowed here: the blocks on the
+ * page are invalidated later by lightrec_smc_flush(). */
+static void smc_handler(int sig, siginfo_t *info, void *ctx)
+{
+	struct lightrec_smc *smc;
+	unsigned int i, page;
+	u32 kaddr;
+
+	for (i = 0; i < SMC_MAX_STATES; i++) {
+		smc = atomic_load_explicit(&smc_list[i], memory_order_acquire);
+		if (smc && smc_get_page(smc, info->si_addr, &page))
+			break;
+	}
+
+	if (i == SMC_MAX_STATES) {
+		/* Not ours - forward to the previous handler */
+		smc_forward_signal(sig, info, ctx);
+		return;
+	}
+
+	smc_spin_lock(&smc->lock);
+
+	/* The page may have been unprotected by another thread in the
+	 * meantime, in which case there is nothing to do but retry */
+	if (smc->protected[page]) {
+		smc->protected[page] = false;
+		smc_set_page_prot(smc, page, PROT_READ | PROT_WRITE);
+
+		/* Clear the LUT entries of the page, so that the dispatcher
+		 * won't jump to the outdated code and will call
+		 * lightrec_smc_flush() instead. */
+		kaddr = page * smc->page_size;
+		memset(lut_address(smc->state, lut_offset(kaddr)), 0,
+		       smc->page_size / 4 * lut_elm_size(smc->state));
+
+		atomic_store_explicit(&smc->dirty[page], true,
+				      memory_order_relaxed);
+		atomic_store_explicit(&smc->pending, true,
+				      memory_order_release);
+	}
+
+	smc_spin_unlock(&smc->lock);
+}
+
+bool lightrec_smc_protect_init(struct lightrec_state *state)
+{
+	const void *ram = state->maps[PSX_MAP_KERNEL_USER_RAM].address;
+	const struct memmap_area *area;
+	struct lightrec_smc *smc;
+	struct sigaction action;
+	size_t page_size;
+	unsigned int i;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size < 0x1000 || page_size > RAM_SIZE)
+		return false;
+
+	/* Page protection requires to know all the aliases of the RAM, so it
+	 * only works with memory mapped by lightrec itself */
+	area = memmap_find_area(ram);
+	if (!area || !state->mirrors_mapped)
+		return false;
+
+	smc = lightrec_calloc(state, MEM_FOR_LIGHTREC, sizeof(*smc));
+	if (!smc) {
+		pr_err("Unable to allocate page protection context\n");
+		return false;
+	}
+
+	smc->state = state;
+	smc->area = area;
+	smc->page_size = page_size;
+	atomic_flag_clear(&smc->lock);
+
+	smc_spin_lock(&smc_list_lock);
+
+	for (i = 0; i < SMC_MAX_STATES; i++) {
+		/* Two instances can't protect the same memory */
+		if (smc_list[i] && smc_list[i]->area == area) {
+			i = SMC_MAX_STATES;
+			break;
+		}
+	}
+
+	if (i == SMC_MAX_STATES) {
+		for (i = 0; i < SMC_MAX_STATES; i++) {
+			if (!smc_list[i])
+				break;
+		}
+	}
+
+	if (i == SMC_MAX_STATES)
+		goto err_unlock;
+
+	if (!smc_nb_users) {
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = smc_handler;
+		action.sa_flags = SA_SIGINFO | SA_NODEFER;
+		sigemptyset(&action.sa_mask);
+
+		if (sigaction(SIGSEGV, &action, &smc_old_action) < 0) {
+			pr_err("Unable to install SIGSEGV handler\n");
+			goto err_unlock;
+		}
+	}
+
+	smc_nb_users++;
+	atomic_store_explicit(&smc_list[i], smc, memory_order_release);
+	state->smc = smc;
+
+	smc_spin_unlock(&smc_list_lock);
+
+	return true;
+
+err_unlock:
+	smc_spin_unlock(&smc_list_lock);
+	lightrec_free(state, MEM_FOR_LIGHTREC, sizeof(*smc), smc);
+	return false;
+}
+
+void lightrec_smc_protect_exit(struct lightrec_state *state)
+{
+	struct lightrec_smc *smc = state->smc;
+	unsigned int i;
+
+	smc_spin_lock(&smc_list_lock);
+
+	for (i = 0; i < SMC_MAX_STATES; i++) {
+		if (smc_list[i] == smc)
+			atomic_store_explicit(&smc_list[i], NULL,
+					      memory_order_release);
+	}
+
+	if (!--smc_nb_users)
+		sigaction(SIGSEGV, &smc_old_action, NULL);
+
+	smc_spin_unlock(&smc_list_lock);
+
+	smc_spin_lock(&smc->lock);
+
+	for (i = 0; i < RAM_SIZE / smc->page_size; i++) {
+		if (smc->protected[i]) {
+			smc->protected[i] = false;
+			smc_set_page_prot(smc, i, PROT_READ | PROT_WRITE);
+		}
+	}
+
+	smc_spin_unlock(&smc->lock);
+
+	lightrec_free(state, MEM_FOR_LIGHTREC, sizeof(*smc), smc);
+	state->smc = NULL;
+}
+
+void lightrec_smc_protect(struct lightrec_state *state, u32 kaddr, u32 len)
+{
+	struct lightrec_smc *smc = state->smc;
+	unsigned int page, last;
+
+	/* Only the RAM is protected */
+	if (kaddr >= RAM_SIZE * 4 || !len)
+		return;
+
+	kaddr &= RAM_SIZE - 1;
+	page = kaddr / smc->page_size;
+	last = (kaddr + len - 1) / smc->page_size;
+	if (last >= RAM_SIZE / smc->page_size)
+		last = RAM_SIZE / smc->page_size - 1;
+
+	smc_spin_lock(&smc->lock);
+
+	for (; page <= last; page++) {
+		if (!smc->protected[page]) {
+			smc->protected[page] = true;
+			smc_set_page_prot(smc, page, PROT_READ);
+		}
+	}
+
+	smc_spin_unlock(&smc->lock);
+}
+
+void lightrec_smc_flush(struct lightrec_state *state)
+{
+	struct lightrec_smc *smc = state->smc;
+	unsigned int i;
+
+	if (!atomic_exchange_explicit(&smc->pending, false,
+				      memory_order_acquire))
+		return;
+
+	/* The LUT entries were cleared by the signal handler, but the
+	 * threaded compiler may have installed a block on the page since */
+	for (i = 0; i < RAM_SIZE / smc->page_size; i++) {
+		if (atomic_exchange_explicit(&smc->dirty[i], false,
+					     memory_order_relaxed)) {
+			lightrec_invalidate(state, i * smc->page_size,
+					    smc->page_size);
+		}
+	}
+}
+#endif /* ENABLE_SMC_PROTECT */
+#else /* HAS_MEMFD */
+int lightrec_map_memory(struct lightrec_memory *mem)
+{
+	return -ENOSYS;
+}
+
+void lightrec_unmap_memory(struct lightrec_memory *mem)
+{
+}
+#endif /* HAS_MEMFD */
+
+#if !ENABLE_FASTMEM
+void * lightrec_map_fastmem(void)
+{
+	return NULL;
+}
+
+void lightrec_unmap_fastmem(void *base)
+{
+}
+
+bool lightrec_is_fastmem(uintptr_t offset)
+{
+	return false;
+}
+#endif /* !ENABLE_FASTMEM */
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#ifndef __LIGHTREC_MEMMAP_H__
+#define __LIGHTREC_MEMMAP_H__
+
+#include "lightrec.h"
+
+#include <stdint.h>
+
+struct lightrec_state;
+
+_Bool lightrec_is_fastmem(uintptr_t offset);
+
+_Bool lightrec_smc_protect_init(struct lightrec_state *state);
+void lightrec_smc_protect_exit(struct lightrec_state *state);
+void lightrec_smc_protect(struct lightrec_state *state, u32 kaddr, u32 len);
+void lightrec_smc_flush(struct lightrec_state *state);
+
+#endif /* __LIGHTREC_MEMMAP_H__ */
@@ -3,18 +3,24 @@
  * Copyright (C) 2014-2021 Paul Cercueil <paul@crapouillou.net>
  */
 
+#include "blockcache.h"
 #include "constprop.h"
+#include "hle.h"
 #include "lightrec-config.h"
 #include "disassembler.h"
 #include "lightrec.h"
 #include "memmanager.h"
 #include "optimizer.h"
+#include "reaper.h"
+#include "recompiler.h"
 #include "regcache.h"
+#include "ssa.h"
 
 #include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define IF_OPT(opt, ptr) ((opt) ? (ptr) : NULL)
 
@@ -52,7 +58,12 @@ bool is_syscall(union code c)
 		 (c.r.rd == 12 || c.r.rd == 13));
 }
 
-static u64 opcode_read_mask(union code op)
+bool is_return(union code c)
+{
+	return c.i.op == OP_SPECIAL && c.r.op == OP_SPECIAL_JR && c.r.rs == 31;
+}
+
+u64 opcode_read_mask(union code op)
 {
 	switch (op.i.op) {
 	case OP_SPECIAL:
@@ -148,6 +159,8 @@ u64 opcode_write_mask(union code op)
 	switch (op.i.op) {
 	case OP_META_MULT2:
 	case OP_META_MULTU2:
+	case OP_META_DIVI:
+	case OP_META_DIVIU:
 		return mult_div_write_mask(op);
 	case OP_META:
 		return BIT(op.m.rd);
@@ -504,7 +517,7 @@ static bool is_nop(union code op)
 }
 
 static void lightrec_optimize_sll_sra(struct opcode *list, unsigned int offset,
-				      struct constprop_data *v)
+				      struct constprop_cache *cache)
 {
 	struct opcode *ldop = NULL, *curr = &list[offset], *next;
 	struct opcode *to_change, *to_nop;
@@ -594,8 +607,6 @@ static void lightrec_optimize_sll_sra(struct opcode *list, unsigned int offset,
 				/* The target register of the SRA is dead after the
 				 * LBU/LHU; we can change the target register of the
 				 * LBU/LHU to the one of the SRA. */
-				v[ldop->i.rt].known = 0;
-				v[ldop->i.rt].sign = 0;
 				ldop->i.rt = next->r.rd;
 				to_change->opcode = 0;
 			} else {
@@ -610,8 +621,9 @@ static void lightrec_optimize_sll_sra(struct opcode *list, unsigned int offset,
 			else
 				pr_debug("Convert LHU+SLL+SRA to LH\n");
 
-			v[ldop->i.rt].known = 0;
-			v[ldop->i.rt].sign = 0xffffff80 << (24 - curr->r.imm);
+			/* The load was modified, the known bits after it
+			 * must be computed again */
+			lightrec_consts_invalidate(cache, idx2 + 1);
 		}
 	}
 
@@ -828,6 +840,8 @@ static void lightrec_patch_known_zero(struct opcode *op,
 	case OP_XORI:
 	case OP_META_MULT2:
 	case OP_META_MULTU2:
+	case OP_META_DIVI:
+	case OP_META_DIVIU:
 	case OP_META:
 		if (is_known_zero(v, op->m.rs))
 			op->m.rs = 0;
@@ -893,7 +907,7 @@ static void maybe_remove_load_delay(struct opcode *op)
 static int lightrec_transform_ops(struct lightrec_state *state, struct block *block)
 {
 	struct opcode *op, *list = block->opcode_list;
-	struct constprop_data v[32] = LIGHTREC_CONSTPROP_INITIALIZER;
+	const struct constprop_data *v;
 	unsigned int i;
 	bool local;
 	int idx;
@@ -902,7 +916,7 @@ static int lightrec_transform_ops(struct lightrec_state *state, struct block *bl
 	for (i = 0; i < block->nb_ops; i++) {
 		op = &list[i];
 
-		lightrec_consts_propagate(block, i, v);
+		v = lightrec_consts_get(state->constprop, i);
 
 		lightrec_patch_known_zero(op, v);
 
@@ -1139,7 +1153,8 @@ static int lightrec_transform_ops(struct lightrec_state *state, struct block *bl
 					op->i.op = OP_META;
 				}
 
-				lightrec_optimize_sll_sra(block->opcode_list, i, v);
+				lightrec_optimize_sll_sra(block->opcode_list, i,
+							  state->constprop);
 				break;
 
 			case OP_SPECIAL_SRLV:
@@ -1182,6 +1197,25 @@ static int lightrec_transform_ops(struct lightrec_state *state, struct block *bl
 
 				op->r.op = ctz32(v[op->r.rt].value);
 				break;
+			case OP_SPECIAL_DIV:
+			case OP_SPECIAL_DIVU:
+				/* Only small divisors fit in the opcode. Negative
+				 * divisors are rejected here as well. */
+				if (!is_known(v, op->r.rt) || !v[op->r.rt].value ||
+				    v[op->r.rt].value > 0x7ff)
+					break;
+
+				pr_debug("Divide by constant: %"PRIu32"\n",
+					 v[op->r.rt].value);
+
+				if (op->r.op == OP_SPECIAL_DIV)
+					op->i.op = OP_META_DIVI;
+				else
+					op->i.op = OP_META_DIVIU;
+
+				op->r.op = v[op->r.rt].value & 0x3f;
+				op->r.rt = v[op->r.rt].value >> 6;
+				break;
 			case OP_SPECIAL_NOR:
 				if (op->r.rs == 0 || op->r.rt == 0) {
 					pr_debug("Convert NOR $zero to COM\n");
@@ -1716,19 +1750,57 @@ static int lightrec_early_unload(struct lightrec_state *state, struct block *blo
 	return 0;
 }
 
+static u32 lightrec_get_hw_io_flags(const struct lightrec_state *state,
+				    union code c, u32 kaddr)
+{
+	bool is_store = opcode_is_store(c);
+	u8 size = opcode_get_io_size(c);
+	enum lightrec_hw_policy policy;
+
+	if (state->ops.hw_direct && state->ops.hw_direct(kaddr, is_store, size))
+		return LIGHTREC_IO_MODE(LIGHTREC_IO_DIRECT_HW);
+
+	if (!state->ops.hw_policy)
+		return LIGHTREC_IO_MODE(LIGHTREC_IO_HW);
+
+	policy = state->ops.hw_policy(kaddr, size);
+
+	switch (policy) {
+	case LIGHTREC_HW_LAZY_NOTIFY:
+		if (!state->ops.hw_notify)
+			break;
+
+		if (is_store) {
+			return LIGHTREC_IO_MODE(LIGHTREC_IO_DIRECT_HW)
+				| LIGHTREC_IO_NOTIFY;
+		}
+		fallthrough;
+	case LIGHTREC_HW_MEMORY:
+		return LIGHTREC_IO_MODE(LIGHTREC_IO_DIRECT_HW);
+	case LIGHTREC_HW_SHADOW:
+		if (!is_store)
+			return LIGHTREC_IO_MODE(LIGHTREC_IO_DIRECT_HW);
+		break;
+	default:
+		break;
+	}
+
+	return LIGHTREC_IO_MODE(LIGHTREC_IO_HW);
+}
+
 static int lightrec_flag_io(struct lightrec_state *state, struct block *block)
 {
 	struct opcode *list;
 	enum psx_map psx_map;
-	struct constprop_data v[32] = LIGHTREC_CONSTPROP_INITIALIZER;
+	const struct constprop_data *v;
 	unsigned int i;
-	u32 val, kunseg_val;
+	u32 val, kunseg_val, hw_flags;
 	bool no_mask;
 
 	for (i = 0; i < block->nb_ops; i++) {
 		list = &block->opcode_list[i];
 
-		lightrec_consts_propagate(block, i, v);
+		v = lightrec_consts_get(state->constprop, i);
 
 		switch (list->i.op) {
 		case OP_SB:
@@ -1813,21 +1885,21 @@ static int lightrec_flag_io(struct lightrec_state *state, struct block *block)
 					list->flags |= LIGHTREC_NO_INVALIDATE;
 					break;
 				case PSX_MAP_HW_REGISTERS:
-					if (state->ops.hw_direct &&
-					    state->ops.hw_direct(kunseg_val,
-								 opcode_is_store(list->c),
-								 opcode_get_io_size(list->c))) {
+					hw_flags = lightrec_get_hw_io_flags(state, list->c,
+									    kunseg_val);
+
+					if (LIGHTREC_FLAGS_GET_IO_MODE(hw_flags) == LIGHTREC_IO_DIRECT_HW) {
 						pr_debug("Flagging opcode %u as direct I/O access\n",
 							 i);
-						list->flags |= LIGHTREC_IO_MODE(LIGHTREC_IO_DIRECT_HW);
 
 						if (no_mask)
-							list->flags |= LIGHTREC_NO_MASK;
+							hw_flags |= LIGHTREC_NO_MASK;
 					} else {
 						pr_debug("Flagging opcode %u as I/O access\n",
 							 i);
-						list->flags |= LIGHTREC_IO_MODE(LIGHTREC_IO_HW);
 					}
+
+					list->flags |= hw_flags;
 					break;
 				default:
 					break;
@@ -1855,405 +1927,1757 @@ static int lightrec_flag_io(struct lightrec_state *state, struct block *block)
 	return 0;
 }
 
-static u8 get_mfhi_mflo_reg(const struct block *block, u16 offset,
-			    const struct opcode *last,
-			    u32 mask, bool sync, bool mflo, bool another)
+static bool opcode_can_burst(const struct opcode *list, u16 offset)
 {
-	const struct opcode *op, *next = &block->opcode_list[offset];
-	u32 old_mask;
-	u8 reg2, reg = mflo ? REG_LO : REG_HI;
-	u16 branch_offset;
-	unsigned int i;
+	const struct opcode *op = &list[offset];
 
-	for (i = offset; i < block->nb_ops; i++) {
-		op = next;
-		next = &block->opcode_list[i + 1];
-		old_mask = mask;
+	switch (op->i.op) {
+	case OP_SB:
+	case OP_SH:
+	case OP_SW:
+		return LIGHTREC_FLAGS_GET_IO_MODE(op->flags) == LIGHTREC_IO_HW
+			&& !is_delay_slot(list, offset);
+	default:
+		return false;
+	}
+}
 
-		/* If any other opcode writes or reads to the register
-		 * we'd use, then we cannot use it anymore. */
-		mask |= opcode_read_mask(op->c);
-		mask |= opcode_write_mask(op->c);
+static bool opcode_is_simple_alu(union code op)
+{
+	switch (op.i.op) {
+	case OP_SPECIAL:
+		switch (op.r.op) {
+		case OP_SPECIAL_JR:
+		case OP_SPECIAL_JALR:
+		case OP_SPECIAL_SYSCALL:
+		case OP_SPECIAL_BREAK:
+			return false;
+		default:
+			return true;
+		}
+	case OP_ADDI:
+	case OP_ADDIU:
+	case OP_SLTI:
+	case OP_SLTIU:
+	case OP_ANDI:
+	case OP_ORI:
+	case OP_XORI:
+	case OP_LUI:
+	case OP_META:
+	case OP_META_MULT2:
+	case OP_META_MULTU2:
+	case OP_META_DIVI:
+	case OP_META_DIVIU:
+		return true;
+	default:
+		return false;
+	}
+}
 
-		if (op_flag_sync(op->flags))
-			sync = true;
+static void lightrec_flag_burst(struct block *block, u16 first, u16 last)
+{
+	struct opcode *list = block->opcode_list;
+	unsigned int i;
 
-		switch (op->i.op) {
-		case OP_BEQ:
-		case OP_BNE:
-		case OP_BLEZ:
-		case OP_BGTZ:
-		case OP_REGIMM:
-			/* TODO: handle backwards branches too */
-			if (!last && op_flag_local_branch(op->flags) &&
-			    (s16)op->c.i.imm >= 0) {
-				branch_offset = i + 1 + (s16)op->c.i.imm
-					- !!op_flag_no_ds(op->flags);
+	pr_debug("Grouping hardware writes at offsets 0x%x to 0x%x\n",
+		 first << 2, last << 2);
 
-				reg = get_mfhi_mflo_reg(block, branch_offset, NULL,
-							mask, sync, mflo, false);
-				reg2 = get_mfhi_mflo_reg(block, offset + 1, next,
-							 mask, sync, mflo, false);
-				if (reg > 0 && reg == reg2)
-					return reg;
-				if (!reg && !reg2)
-					return 0;
-			}
+	for (i = first; i <= last; i++) {
+		if (opcode_can_burst(list, i))
+			list[i].flags |= LIGHTREC_IO_BURST;
+	}
 
-			return mflo ? REG_LO : REG_HI;
-		case OP_META_MULT2:
-		case OP_META_MULTU2:
-			return 0;
-		case OP_SPECIAL:
-			switch (op->r.op) {
-			case OP_SPECIAL_MULT:
-			case OP_SPECIAL_MULTU:
-			case OP_SPECIAL_DIV:
-			case OP_SPECIAL_DIVU:
-				return 0;
-			case OP_SPECIAL_MTHI:
-				if (!mflo)
-					return 0;
-				continue;
-			case OP_SPECIAL_MTLO:
-				if (mflo)
-					return 0;
-				continue;
-			case OP_SPECIAL_JR:
-				if (op->r.rs != 31)
-					return reg;
+	list[last].flags |= LIGHTREC_IO_BURST_END;
+}
 
-				if (!sync && !op_flag_no_ds(op->flags) &&
-				    (next->i.op == OP_SPECIAL) &&
-				    ((!mflo && next->r.op == OP_SPECIAL_MFHI) ||
-				    (mflo && next->r.op == OP_SPECIAL_MFLO)))
-					return next->r.rd;
+static int lightrec_group_io(struct lightrec_state *state, struct block *block)
+{
+	struct opcode *list = block->opcode_list;
+	unsigned int i, nb = 0;
+	u16 first = 0, last = 0;
 
-				return 0;
-			case OP_SPECIAL_JALR:
-				return reg;
-			case OP_SPECIAL_MFHI:
-				if (!mflo) {
-					if (another)
-						return op->r.rd;
-					/* Must use REG_HI if there is another MFHI target*/
-					reg2 = get_mfhi_mflo_reg(block, i + 1, next,
-							 0, sync, mflo, true);
-					if (reg2 > 0 && reg2 != REG_HI)
-						return REG_HI;
+	for (i = 0; i < block->nb_ops; i++) {
+		if (opcode_can_burst(list, i)) {
+			/* A branch target ends the current group */
+			if (nb && op_flag_sync(list[i].flags)) {
+				if (nb > 1)
+					lightrec_flag_burst(block, first, last);
+				nb = 0;
+			}
 
-					if (!sync && !(old_mask & BIT(op->r.rd)))
-						return op->r.rd;
-					else
-						return REG_HI;
-				}
-				continue;
-			case OP_SPECIAL_MFLO:
-				if (mflo) {
-					if (another)
-						return op->r.rd;
-					/* Must use REG_LO if there is another MFLO target*/
-					reg2 = get_mfhi_mflo_reg(block, i + 1, next,
-							 0, sync, mflo, true);
-					if (reg2 > 0 && reg2 != REG_LO)
-						return REG_LO;
+			if (!nb)
+				first = i;
 
-					if (!sync && !(old_mask & BIT(op->r.rd)))
-						return op->r.rd;
-					else
-						return REG_LO;
-				}
-				continue;
-			default:
-				break;
+			last = i;
+
+			if (++nb == IO_BURST_MAX) {
+				lightrec_flag_burst(block, first, last);
+				nb = 0;
 			}
 
-			fallthrough;
-		default:
 			continue;
 		}
+
+		/* Only allow opcodes that can't observe or modify the memory,
+		 * or change the control flow, in between grouped writes. */
+		if (nb && (!opcode_is_simple_alu(list[i].c)
+			   || op_flag_sync(list[i].flags))) {
+			if (nb > 1)
+				lightrec_flag_burst(block, first, last);
+			nb = 0;
+		}
 	}
 
-	return reg;
-}
+	if (nb > 1)
+		lightrec_flag_burst(block, first, last);
 
-static void lightrec_replace_lo_hi(struct block *block, u16 offset,
-				   u16 last, bool lo)
-{
-	unsigned int i;
-	u32 branch_offset;
+	return 0;
+}
 
-	/* This function will remove the following MFLO/MFHI. It must be called
-	 * only if get_mfhi_mflo_reg() returned a non-zero value. */
+#define MEM_VALUES_MAX 8
 
-	for (i = offset; i < last; i++) {
-		struct opcode *op = &block->opcode_list[i];
+/* A memory location whose value is known to be held in a register */
+struct lightrec_mem_value {
+	u32 addr;
+	s16 imm;
+	u8 base, reg, op, len;
+	bool known;
+};
 
-		switch (op->i.op) {
-		case OP_BEQ:
-		case OP_BNE:
-		case OP_BLEZ:
-		case OP_BGTZ:
-		case OP_REGIMM:
-			/* TODO: handle backwards branches too */
-			if (op_flag_local_branch(op->flags) && (s16)op->c.i.imm >= 0) {
-				branch_offset = i + 1 + (s16)op->c.i.imm
-					- !!op_flag_no_ds(op->flags);
+static bool io_mode_is_memory(u32 flags, bool load)
+{
+	switch (LIGHTREC_FLAGS_GET_IO_MODE(flags)) {
+	case LIGHTREC_IO_BIOS:
+		/* Stores to the BIOS may be ignored */
+		return load;
+	case LIGHTREC_IO_RAM:
+	case LIGHTREC_IO_SCRATCH:
+	case LIGHTREC_IO_DIRECT:
+		return true;
+	default:
+		return false;
+	}
+}
 
-				lightrec_replace_lo_hi(block, branch_offset, last, lo);
-				lightrec_replace_lo_hi(block, i + 1, branch_offset, lo);
-			}
-			break;
+static bool opcode_is_mem_barrier(const struct opcode *op)
+{
+	switch (op->i.op) {
+	case OP_CP0:
+	case OP_CP2:
+		/* May call C code */
+		return true;
+	default:
+		break;
+	}
 
-		case OP_SPECIAL:
-			if (lo && op->r.op == OP_SPECIAL_MFLO) {
-				pr_debug("Removing MFLO opcode at offset 0x%x\n",
-					 i << 2);
-				op->opcode = 0;
-				return;
-			} else if (!lo && op->r.op == OP_SPECIAL_MFHI) {
-				pr_debug("Removing MFHI opcode at offset 0x%x\n",
-					 i << 2);
-				op->opcode = 0;
-				return;
-			}
+	if (has_delay_slot(op->c) || is_syscall(op->c))
+		return true;
 
-			fallthrough;
-		default:
-			break;
-		}
-	}
+	/* Accesses to hardware registers call C code, which may trigger
+	 * DMA transfers to RAM */
+	return opcode_is_io(op->c) &&
+		LIGHTREC_FLAGS_GET_IO_MODE(op->flags) != LIGHTREC_IO_DIRECT_HW &&
+		!io_mode_is_memory(op->flags, true);
 }
 
-static bool lightrec_always_skip_div_check(void)
+static bool lightrec_mem_overlap(const struct lightrec_mem_value *val,
+				 union code c, u32 addr, bool known)
 {
-#ifdef __mips__
-	return true;
-#else
-	return false;
-#endif
+	s32 len = opcode_get_io_size(c) >> 3;
+	s32 start = (s16)c.i.imm;
+
+	/* SWL writes the bytes below the address, SWR the ones above */
+	if (c.i.op == OP_SWL) {
+		start -= 3;
+		addr -= 3;
+	}
+
+	if (c.i.rs == val->base)
+		return start < val->imm + val->len && val->imm < start + len;
+
+	if (!known || !val->known)
+		return true;
+
+	/* Compare the addresses modulo the RAM size, to take the mirrors
+	 * into account */
+	return ((addr - val->addr) & 0x1fffff) < val->len
+		|| ((val->addr - addr) & 0x1fffff) < (u32)len;
 }
 
-static int lightrec_flag_mults_divs(struct lightrec_state *state, struct block *block)
+static const struct lightrec_mem_value *
+lightrec_find_mem_value(const struct lightrec_mem_value *vals, unsigned int nb,
+			union code c, u32 addr, bool known)
 {
-	struct opcode *list = NULL;
-	struct constprop_data v[32] = LIGHTREC_CONSTPROP_INITIALIZER;
-	u8 reg_hi, reg_lo;
 	unsigned int i;
 
-	for (i = 0; i < block->nb_ops - 1; i++) {
-		list = &block->opcode_list[i];
+	for (i = 0; i < nb; i++) {
+		/* A stored word can only be forwarded to a LW */
+		if (vals[i].op != c.i.op &&
+		    (vals[i].op != OP_SW || c.i.op != OP_LW))
+			continue;
+
+		if (vals[i].base == c.i.rs && vals[i].imm == (s16)c.i.imm)
+			return &vals[i];
+
+		if (known && vals[i].known && vals[i].addr == addr)
+			return &vals[i];
+	}
+
+	return NULL;
+}
+
+static void lightrec_forward_load(struct opcode *op, u8 reg)
+{
+	u8 rt = op->i.rt;
+
+	if (rt == reg) {
+		pr_debug("Remove redundant load\n");
+		op->opcode = 0;
+	} else {
+		pr_debug("Forward value of %s to load\n", lightrec_reg_name(reg));
+		op->opcode = 0;
+		op->i.op = OP_META;
+		op->m.op = OP_META_MOV;
+		op->m.rs = reg;
+		op->m.rd = rt;
+	}
+
+	op->flags &= LIGHTREC_SYNC;
+}
+
+static bool opcode_can_forward(const struct opcode *op)
+{
+	switch (op->i.op) {
+	case OP_SW:
+		return io_mode_is_memory(op->flags, false);
+	case OP_LB:
+	case OP_LBU:
+	case OP_LH:
+	case OP_LHU:
+	case OP_LW:
+		return op->i.rt && op->i.rt != op->i.rs
+			&& io_mode_is_memory(op->flags, true);
+	default:
+		return false;
+	}
+}
+
+static int lightrec_forward_loads(struct lightrec_state *state,
+				  struct block *block)
+{
+	struct lightrec_mem_value vals[MEM_VALUES_MAX];
+	const struct lightrec_mem_value *val;
+	struct opcode *op, *list = block->opcode_list;
+	const struct constprop_data *v;
+	unsigned int i, j, nb = 0, next = 0;
+	u64 write, delayed = 0;
+	bool known, skip;
+	u32 addr;
+
+	for (i = 0; i < block->nb_ops; i++) {
+		op = &list[i];
+
+		if (op_flag_sync(op->flags))
+			nb = 0;
+
+		v = lightrec_consts_get(state->constprop, i);
+		known = is_known(v, op->i.rs);
+		addr = kunseg(v[op->i.rs].value + (s16)op->i.imm);
+
+		/* The registers read may be the targets of the load delay of
+		 * the previous opcode, so we can't tell what they hold */
+		skip = is_delay_slot(list, i) ||
+			(opcode_read_mask(op->c) & delayed);
+
+		if (skip) {
+			if (opcode_is_store(op->c))
+				nb = 0;
+		} else if (opcode_is_store(op->c)) {
+			/* Drop the values this store may overwrite */
+			for (j = 0; j < nb; ) {
+				if (lightrec_mem_overlap(&vals[j], op->c,
+							 addr, known))
+					vals[j] = vals[--nb];
+				else
+					j++;
+			}
+		} else if (opcode_is_load(op->c) && op->i.rt &&
+			   !op_flag_load_delay(op->flags) &&
+			   io_mode_is_memory(op->flags, true)) {
+			val = lightrec_find_mem_value(vals, nb, op->c,
+						      addr, known);
+			if (val)
+				lightrec_forward_load(op, val->reg);
+		}
+
+		if (opcode_is_mem_barrier(op) || is_delay_slot(list, i))
+			nb = 0;
+
+		/* Drop the values whose register is overwritten */
+		write = opcode_write_mask(op->c);
+
+		for (j = 0; j < nb; ) {
+			if (write & (BIT(vals[j].base) | BIT(vals[j].reg)))
+				vals[j] = vals[--nb];
+			else
+				j++;
+		}
+
+		if (opcode_has_load_delay(op->c) && op_flag_load_delay(op->flags))
+			delayed = write;
+		else
+			delayed = 0;
+
+		if (skip || delayed || !opcode_can_forward(op))
+			continue;
+
+		/* Remember the value of this memory location */
+		if (nb == MEM_VALUES_MAX)
+			next = (next + 1) % MEM_VALUES_MAX;
+		else
+			next = nb++;
+
+		vals[next] = (struct lightrec_mem_value){
+			.addr = addr,
+			.imm = (s16)op->i.imm,
+			.base = op->i.rs,
+			.reg = op->i.rt,
+			.op = op->i.op,
+			.len = opcode_get_io_size(op->c) >> 3,
+			.known = known,
+		};
+	}
+
+	return 0;
+}
+
+static bool opcode_can_specialize(union code c)
+{
+	switch (c.i.op) {
+	case OP_SB:
+	case OP_SH:
+	case OP_SW:
+	case OP_SWL:
+	case OP_SWR:
+	case OP_SWC2:
+	case OP_LB:
+	case OP_LBU:
+	case OP_LH:
+	case OP_LHU:
+	case OP_LW:
+	case OP_LWL:
+	case OP_LWR:
+	case OP_LWC2:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool io_mode_can_specialize(u32 flags)
+{
+	switch (LIGHTREC_FLAGS_GET_IO_MODE(flags)) {
+	case LIGHTREC_IO_UNKNOWN:
+	case LIGHTREC_IO_DIRECT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int lightrec_find_entry_regs(struct lightrec_state *state,
+				    struct block *block)
+{
+	const struct opcode *op, *list = block->opcode_list;
+	struct block_entry_spec *spec;
+	u8 regs[ENTRY_SPEC_REGS];
+	unsigned int i, j, nb = 0;
+	u64 written = 0;
+
+	if (block_has_flag(block, BLOCK_NEVER_COMPILE | BLOCK_IS_HLE)
+	    || op_flag_sync(list[0].flags) || should_emulate(&list[0]))
+		return 0;
+
+	/* Find the registers used as base address by load/store opcodes,
+	 * that still hold their value from the entry of the block, and whose
+	 * target could not be found by lightrec_flag_io(). */
+	for (i = 0; i < block->nb_ops && nb < ENTRY_SPEC_REGS; i++) {
+		op = &list[i];
+
+		if (i && op_flag_sync(op->flags))
+			break;
+
+		if (opcode_can_specialize(op->c) && op->i.rs
+		    && !(written & BIT(op->i.rs))
+		    && io_mode_can_specialize(op->flags)) {
+			for (j = 0; j < nb; j++)
+				if (regs[j] == op->i.rs)
+					break;
+
+			if (j == nb)
+				regs[nb++] = op->i.rs;
+		}
+
+		written |= opcode_write_mask(op->c);
+	}
+
+	if (!nb)
+		return 0;
+
+	/* The profile is optional; don't fail the optimization over it */
+	spec = lightrec_calloc(state, MEM_FOR_IR, sizeof(*spec));
+	if (!spec)
+		return 0;
+
+	memcpy(spec->reg, regs, nb);
+	spec->nb_regs = nb;
+	block->entry_spec = spec;
+
+	pr_debug("Profiling %u entry registers of block at "PC_FMT"\n",
+		 nb, block->pc);
+
+	return 0;
+}
+
+/* Return the mask of the address bits that select the memory map containing
+ * the given address, or 0 if the map is not naturally aligned */
+static u32 lightrec_entry_region_mask(const struct lightrec_state *state,
+				      u32 addr)
+{
+	const struct lightrec_mem_map *map;
+	u32 kaddr = kunseg(addr), size;
+	unsigned int i;
+
+	for (i = 0; i < state->nb_maps; i++) {
+		map = &state->maps[i];
+
+		if (kaddr < map->pc || kaddr >= map->pc + map->length)
+			continue;
+
+		for (size = 1; size && size < map->length; size <<= 1);
+
+		if (!size || (map->pc & (size - 1)))
+			return 0;
+
+		return ~(size - 1);
+	}
+
+	return 0;
+}
+
+bool lightrec_specialize_entry(struct lightrec_state *state,
+			       struct block *block)
+{
+	struct constprop_data entry[32] = LIGHTREC_CONSTPROP_INITIALIZER;
+	struct block_entry_spec *spec = block->entry_spec;
+	struct constprop_cache cache;
+	const struct constprop_data *v;
+	unsigned int i, nb = 0;
+	enum psx_map psx_map;
+	struct opcode *op;
+	u32 mask, stable, flags;
+	bool no_mask;
+
+	if (!spec || spec->active || spec->disabled)
+		return spec && spec->active;
+
+	/* Wait for a stable profile; the block is compiled again once there
+	 * are enough samples */
+	if (spec->nb_samples < ENTRY_SPEC_MIN_SAMPLES)
+		return false;
+
+	/* Assume the high bits that were stable over the whole profile. They
+	 * must at least select the memory region; the lower stable bits narrow
+	 * the range of the register enough for base + offset accesses to be
+	 * classified too. The entry check tests the very same bits. */
+	for (i = 0; i < spec->nb_regs; i++) {
+		mask = lightrec_entry_region_mask(state, spec->value[i]);
+		stable = ~spec->known[i];
+		stable = stable ? ~GENMASK(31 - clz32(stable), 0) : 0xffffffff;
+
+		if (!mask || (stable & mask) != mask) {
+			spec->known[i] = 0;
+			spec->value[i] = 0;
+			continue;
+		}
+
+		spec->known[i] = stable;
+		spec->value[i] &= stable;
+
+		entry[spec->reg[i]].known = stable;
+		entry[spec->reg[i]].value = spec->value[i];
+		entry[spec->reg[i]].sign = 0;
+	}
+
+	lightrec_consts_init(state, &cache, block);
+	lightrec_consts_set_entry(&cache, entry);
+
+	for (i = 0; i < block->nb_ops; i++) {
+		op = &block->opcode_list[i];
+		v = lightrec_consts_get(&cache, i);
+
+		if (!opcode_can_specialize(op->c)
+		    || !io_mode_can_specialize(op->flags)
+		    || !(v[op->i.rs].known | v[op->i.rs].sign))
+			continue;
+
+		psx_map = lightrec_get_constprop_map(state, v, op->i.rs,
+						     (s16) op->i.imm);
+		no_mask = (v[op->i.rs].known & ~v[op->i.rs].value
+			   & 0xe0000000) == 0xe0000000;
+
+		switch (psx_map) {
+		case PSX_MAP_KERNEL_USER_RAM:
+			flags = LIGHTREC_IO_MODE(LIGHTREC_IO_RAM);
+			if (no_mask)
+				flags |= LIGHTREC_NO_MASK;
+			break;
+		case PSX_MAP_MIRROR1:
+		case PSX_MAP_MIRROR2:
+		case PSX_MAP_MIRROR3:
+			flags = LIGHTREC_IO_MODE(LIGHTREC_IO_RAM);
+			if (no_mask && state->mirrors_mapped)
+				flags |= LIGHTREC_NO_MASK;
+			break;
+		case PSX_MAP_BIOS:
+			flags = LIGHTREC_IO_MODE(LIGHTREC_IO_BIOS);
+			if (no_mask)
+				flags |= LIGHTREC_NO_MASK;
+			break;
+		case PSX_MAP_SCRATCH_PAD:
+			flags = LIGHTREC_IO_MODE(LIGHTREC_IO_SCRATCH);
+			if (no_mask)
+				flags |= LIGHTREC_NO_MASK;
+			break;
+		default:
+			continue;
+		}
+
+		pr_debug("Flagging opcode %u as %s access from entry values\n",
+			 i, psx_map == PSX_MAP_BIOS ? "BIOS" :
+			 psx_map == PSX_MAP_SCRATCH_PAD ? "scratchpad" : "RAM");
+
+		op->flags &= ~(LIGHTREC_IO_MASK | LIGHTREC_NO_MASK);
+		op->flags |= flags | LIGHTREC_IO_SPEC;
+		nb++;
+	}
+
+	lightrec_consts_free(state, &cache);
+
+	/* Nothing to gain - don't pay for the entry check */
+	if (!nb) {
+		spec->disabled = true;
+		return false;
+	}
+
+	pr_debug("Specialized %u opcodes of block at "PC_FMT
+		 " on its entry values\n", nb, block->pc);
+
+	spec->active = true;
+
+	return true;
+}
+
+void lightrec_unspecialize_entry(struct block *block)
+{
+	struct opcode *op;
+	unsigned int i;
+
+	/* Forget the I/O modes that were deduced from the entry values; the
+	 * opcodes will be tagged again by the interpreter. */
+	for (i = 0; i < block->nb_ops; i++) {
+		op = &block->opcode_list[i];
+
+		if (op_flag_io_spec(op->flags))
+			op->flags &= ~(LIGHTREC_IO_MASK | LIGHTREC_NO_MASK
+				       | LIGHTREC_IO_SPEC);
+	}
+
+	block->entry_spec->active = false;
+	block->entry_spec->disabled = true;
+}
+
+static u8 get_mfhi_mflo_reg(const struct block *block, u16 offset,
+			    const struct opcode *last,
+			    u32 mask, bool sync, bool mflo, bool another)
+{
+	const struct opcode *op, *next = &block->opcode_list[offset];
+	u32 old_mask;
+	u8 reg2, reg = mflo ? REG_LO : REG_HI;
+	u16 branch_offset;
+	unsigned int i;
+
+	for (i = offset; i < block->nb_ops; i++) {
+		op = next;
+		next = &block->opcode_list[i + 1];
+		old_mask = mask;
+
+		/* If any other opcode writes or reads to the register
+		 * we'd use, then we cannot use it anymore. */
+		mask |= opcode_read_mask(op->c);
+		mask |= opcode_write_mask(op->c);
+
+		if (op_flag_sync(op->flags))
+			sync = true;
+
+		switch (op->i.op) {
+		case OP_BEQ:
+		case OP_BNE:
+		case OP_BLEZ:
+		case OP_BGTZ:
+		case OP_REGIMM:
+			/* TODO: handle backwards branches too */
+			if (!last && op_flag_local_branch(op->flags) &&
+			    (s16)op->c.i.imm >= 0) {
+				branch_offset = i + 1 + (s16)op->c.i.imm
+					- !!op_flag_no_ds(op->flags);
+
+				reg = get_mfhi_mflo_reg(block, branch_offset, NULL,
+							mask, sync, mflo, false);
+				reg2 = get_mfhi_mflo_reg(block, offset + 1, next,
+							 mask, sync, mflo, false);
+				if (reg > 0 && reg == reg2)
+					return reg;
+				if (!reg && !reg2)
+					return 0;
+			}
+
+			return mflo ? REG_LO : REG_HI;
+		case OP_META_MULT2:
+		case OP_META_MULTU2:
+		case OP_META_DIVI:
+		case OP_META_DIVIU:
+			return 0;
+		case OP_SPECIAL:
+			switch (op->r.op) {
+			case OP_SPECIAL_MULT:
+			case OP_SPECIAL_MULTU:
+			case OP_SPECIAL_DIV:
+			case OP_SPECIAL_DIVU:
+				return 0;
+			case OP_SPECIAL_MTHI:
+				if (!mflo)
+					return 0;
+				continue;
+			case OP_SPECIAL_MTLO:
+				if (mflo)
+					return 0;
+				continue;
+			case OP_SPECIAL_JR:
+				if (op->r.rs != 31)
+					return reg;
+
+				if (!sync && !op_flag_no_ds(op->flags) &&
+				    (next->i.op == OP_SPECIAL) &&
+				    ((!mflo && next->r.op == OP_SPECIAL_MFHI) ||
+				    (mflo && next->r.op == OP_SPECIAL_MFLO)))
+					return next->r.rd;
+
+				return 0;
+			case OP_SPECIAL_JALR:
+				return reg;
+			case OP_SPECIAL_MFHI:
+				if (!mflo) {
+					if (another)
+						return op->r.rd;
+					/* Must use REG_HI if there is another MFHI target*/
+					reg2 = get_mfhi_mflo_reg(block, i + 1, next,
+							 0, sync, mflo, true);
+					if (reg2 > 0 && reg2 != REG_HI)
+						return REG_HI;
+
+					if (!sync && !(old_mask & BIT(op->r.rd)))
+						return op->r.rd;
+					else
+						return REG_HI;
+				}
+				continue;
+			case OP_SPECIAL_MFLO:
+				if (mflo) {
+					if (another)
+						return op->r.rd;
+					/* Must use REG_LO if there is another MFLO target*/
+					reg2 = get_mfhi_mflo_reg(block, i + 1, next,
+							 0, sync, mflo, true);
+					if (reg2 > 0 && reg2 != REG_LO)
+						return REG_LO;
+
+					if (!sync && !(old_mask & BIT(op->r.rd)))
+						return op->r.rd;
+					else
+						return REG_LO;
+				}
+				continue;
+			default:
+				break;
+			}
+
+			fallthrough;
+		default:
+			continue;
+		}
+	}
+
+	return reg;
+}
+
+static void lightrec_replace_lo_hi(struct block *block, u16 offset,
+				   u16 last, bool lo)
+{
+	unsigned int i;
+	u32 branch_offset;
+
+	/* This function will remove the following MFLO/MFHI. It must be called
+	 * only if get_mfhi_mflo_reg() returned a non-zero value. */
+
+	for (i = offset; i < last; i++) {
+		struct opcode *op = &block->opcode_list[i];
+
+		switch (op->i.op) {
+		case OP_BEQ:
+		case OP_BNE:
+		case OP_BLEZ:
+		case OP_BGTZ:
+		case OP_REGIMM:
+			/* TODO: handle backwards branches too */
+			if (op_flag_local_branch(op->flags) && (s16)op->c.i.imm >= 0) {
+				branch_offset = i + 1 + (s16)op->c.i.imm
+					- !!op_flag_no_ds(op->flags);
+
+				lightrec_replace_lo_hi(block, branch_offset, last, lo);
+				lightrec_replace_lo_hi(block, i + 1, branch_offset, lo);
+			}
+			break;
+
+		case OP_SPECIAL:
+			if (lo && op->r.op == OP_SPECIAL_MFLO) {
+				pr_debug("Removing MFLO opcode at offset 0x%x\n",
+					 i << 2);
+				op->opcode = 0;
+				return;
+			} else if (!lo && op->r.op == OP_SPECIAL_MFHI) {
+				pr_debug("Removing MFHI opcode at offset 0x%x\n",
+					 i << 2);
+				op->opcode = 0;
+				return;
+			}
+
+			fallthrough;
+		default:
+			break;
+		}
+	}
+}
+
+static bool lightrec_always_skip_div_check(void)
+{
+#ifdef __mips__
+	return true;
+#else
+	return false;
+#endif
+}
+
+static int lightrec_flag_mults_divs(struct lightrec_state *state, struct block *block)
+{
+	struct opcode *list = NULL;
+	const struct constprop_data *v;
+	u8 reg_hi, reg_lo;
+	unsigned int i;
+
+	for (i = 0; i < block->nb_ops - 1; i++) {
+		list = &block->opcode_list[i];
+
+		v = lightrec_consts_get(state->constprop, i);
+
+		switch (list->i.op) {
+		case OP_SPECIAL:
+			switch (list->r.op) {
+			case OP_SPECIAL_DIV:
+			case OP_SPECIAL_DIVU:
+				/* If we are dividing by a non-zero constant, don't
+				 * emit the div-by-zero check. */
+				if (lightrec_always_skip_div_check() ||
+				    (v[list->r.rt].known & v[list->r.rt].value)) {
+					list->flags |= LIGHTREC_NO_DIV_CHECK;
+				}
+				fallthrough;
+			case OP_SPECIAL_MULT:
+			case OP_SPECIAL_MULTU:
+				break;
+			default:
+				continue;
+			}
+			fallthrough;
+		case OP_META_MULT2:
+		case OP_META_MULTU2:
+		case OP_META_DIVI:
+		case OP_META_DIVIU:
+			break;
+		default:
+			continue;
+		}
+
+		/* Don't support opcodes in delay slots */
+		if (is_delay_slot(block->opcode_list, i) ||
+		    op_flag_no_ds(list->flags)) {
+			continue;
+		}
+
+		reg_lo = get_mfhi_mflo_reg(block, i + 1, NULL, 0, false, true, false);
+		if (reg_lo == 0) {
+			pr_debug("Mark MULT(U)/DIV(U) opcode at offset 0x%x as"
+				 " not writing LO\n", i << 2);
+			list->flags |= LIGHTREC_NO_LO;
+		}
+
+		reg_hi = get_mfhi_mflo_reg(block, i + 1, NULL, 0, false, false, false);
+		if (reg_hi == 0) {
+			pr_debug("Mark MULT(U)/DIV(U) opcode at offset 0x%x as"
+				 " not writing HI\n", i << 2);
+			list->flags |= LIGHTREC_NO_HI;
+		}
+
+		if (!reg_lo && !reg_hi) {
+			pr_debug("Both LO/HI unused in this block, they will "
+				 "probably be used in parent block - removing "
+				 "flags.\n");
+			list->flags &= ~(LIGHTREC_NO_LO | LIGHTREC_NO_HI);
+		}
+
+		if (0/* Broken */ && reg_lo > 0 && reg_lo != REG_LO) {
+			pr_debug("Found register %s to hold LO (rs = %u, rt = %u)\n",
+				 lightrec_reg_name(reg_lo), list->r.rs, list->r.rt);
+
+			lightrec_replace_lo_hi(block, i + 1, block->nb_ops, true);
+			list->r.rd = reg_lo;
+		} else {
+			list->r.rd = 0;
+		}
+
+		if (0/* Broken */ && reg_hi > 0 && reg_hi != REG_HI) {
+			pr_debug("Found register %s to hold HI (rs = %u, rt = %u)\n",
+				 lightrec_reg_name(reg_hi), list->r.rs, list->r.rt);
+
+			lightrec_replace_lo_hi(block, i + 1, block->nb_ops, false);
+			list->r.imm = reg_hi;
+		} else {
+			list->r.imm = 0;
+		}
+	}
+
+	return 0;
+}
+
+static bool remove_div_sequence(struct block *block, unsigned int offset)
+{
+	struct opcode *op;
+	unsigned int i, found = 0;
+
+	/*
+	 * Scan for the zero-checking sequence that GCC automatically introduced
+	 * after most DIV/DIVU opcodes. This sequence checks the value of the
+	 * divisor, and if zero, executes a BREAK opcode, causing the BIOS
+	 * handler to crash the PS1.
+	 *
+	 * For DIV opcodes, this sequence additionally checks that the signed
+	 * operation does not overflow.
+	 *
+	 * With the assumption that the games never crashed the PS1, we can
+	 * therefore assume that the games never divided by zero or overflowed,
+	 * and these sequences can be removed.
+	 */
+
+	for (i = offset; i < block->nb_ops; i++) {
+		op = &block->opcode_list[i];
+
+		if (!found) {
+			if (op->i.op == OP_SPECIAL &&
+			    (op->r.op == OP_SPECIAL_DIV || op->r.op == OP_SPECIAL_DIVU))
+				break;
+
+			if ((op->opcode & 0xfc1fffff) == 0x14000002) {
+				/* BNE ???, zero, +8 */
+				found++;
+			} else {
+				offset++;
+			}
+		} else if (found == 1 && !op->opcode) {
+			/* NOP */
+			found++;
+		} else if (found == 2 && op->opcode == 0x0007000d) {
+			/* BREAK 0x1c00 */
+			found++;
+		} else if (found == 3 && op->opcode == 0x2401ffff) {
+			/* LI at, -1 */
+			found++;
+		} else if (found == 4 && (op->opcode & 0xfc1fffff) == 0x14010004) {
+			/* BNE ???, at, +16 */
+			found++;
+		} else if (found == 5 && op->opcode == 0x3c018000) {
+			/* LUI at, 0x8000 */
+			found++;
+		} else if (found == 6 && (op->opcode & 0x141fffff) == 0x14010002) {
+			/* BNE ???, at, +16 */
+			found++;
+		} else if (found == 7 && !op->opcode) {
+			/* NOP */
+			found++;
+		} else if (found == 8 && op->opcode == 0x0006000d) {
+			/* BREAK 0x1800 */
+			found++;
+			break;
+		} else {
+			break;
+		}
+	}
+
+	if (found >= 3) {
+		if (found != 9)
+			found = 3;
+
+		pr_debug("Removing DIV%s sequence at offset 0x%x\n",
+			 found == 9 ? "" : "U", offset << 2);
+
+		for (i = 0; i < found; i++)
+			block->opcode_list[offset + i].opcode = 0;
+
+		return true;
+	}
+
+	return false;
+}
+
+static int lightrec_remove_div_by_zero_check_sequence(struct lightrec_state *state,
+						      struct block *block)
+{
+	struct opcode *op;
+	unsigned int i;
+
+	for (i = 0; i < block->nb_ops; i++) {
+		op = &block->opcode_list[i];
+
+		if (op->i.op == OP_SPECIAL &&
+		    (op->r.op == OP_SPECIAL_DIVU || op->r.op == OP_SPECIAL_DIV) &&
+		    remove_div_sequence(block, i + 1))
+			op->flags |= LIGHTREC_NO_DIV_CHECK;
+	}
+
+	return 0;
+}
+
+static int lightrec_replace_functions(struct lightrec_state *state,
+				      struct block *block)
+{
+	u8 func = lightrec_hle_find(state, block->pc);
+
+	if (func == HLE_NONE)
+		return 0;
+
+	block->hle_func = func;
+	block_set_flags(block, BLOCK_IS_HLE | BLOCK_NEVER_COMPILE);
+
+	/* Return non-zero to skip other optimizers. */
+	return 1;
+}
+
+static bool opcode_can_hoist(const struct opcode *op)
+{
+	union code c = op->c;
+
+	switch (c.i.op) {
+	case OP_SPECIAL:
+		switch (c.r.op) {
+		case OP_SPECIAL_SLL:
+		case OP_SPECIAL_SRL:
+		case OP_SPECIAL_SRA:
+		case OP_SPECIAL_SLLV:
+		case OP_SPECIAL_SRLV:
+		case OP_SPECIAL_SRAV:
+		case OP_SPECIAL_ADD:
+		case OP_SPECIAL_ADDU:
+		case OP_SPECIAL_SUB:
+		case OP_SPECIAL_SUBU:
+		case OP_SPECIAL_AND:
+		case OP_SPECIAL_OR:
+		case OP_SPECIAL_XOR:
+		case OP_SPECIAL_NOR:
+		case OP_SPECIAL_SLT:
+		case OP_SPECIAL_SLTU:
+			return c.r.rd != 0;
+		default:
+			return false;
+		}
+	case OP_META:
+		switch (c.m.op) {
+		case OP_META_MOV:
+		case OP_META_EXTC:
+		case OP_META_EXTS:
+		case OP_META_COM:
+			return c.m.rd != 0;
+		default:
+			return false;
+		}
+	case OP_ADDI:
+	case OP_ADDIU:
+	case OP_SLTI:
+	case OP_SLTIU:
+	case OP_ANDI:
+	case OP_ORI:
+	case OP_XORI:
+	case OP_LUI:
+		return c.i.rt != 0;
+	case OP_LB:
+	case OP_LBU:
+	case OP_LH:
+	case OP_LHU:
+	case OP_LW:
+		if (!c.i.rt || op_flag_load_delay(op->flags))
+			return false;
+
+		switch (LIGHTREC_FLAGS_GET_IO_MODE(op->flags)) {
+		case LIGHTREC_IO_RAM:
+		case LIGHTREC_IO_BIOS:
+		case LIGHTREC_IO_SCRATCH:
+			return true;
+		default:
+			return false;
+		}
+	default:
+		return false;
+	}
+}
+
+static bool opcode_may_modify_memory(const struct opcode *op)
+{
+	if (opcode_is_store(op->c) || is_syscall(op->c))
+		return true;
+
+	/* Reading hardware registers may have side effects */
+	if (opcode_is_load(op->c)) {
+		switch (LIGHTREC_FLAGS_GET_IO_MODE(op->flags)) {
+		case LIGHTREC_IO_RAM:
+		case LIGHTREC_IO_BIOS:
+		case LIGHTREC_IO_SCRATCH:
+			return false;
+		default:
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static u64 lightrec_licm_read_mask(const struct opcode *op)
+{
+	switch (op->i.op) {
+	case OP_ORI:
+	case OP_ADDI:
+	case OP_ADDIU:
+		/* The second opcode of a LUI+ORI pair doesn't read its
+		 * register */
+		if (op->flags & LIGHTREC_MOVI)
+			return 0;
+		fallthrough;
+	default:
+		return opcode_read_mask(op->c);
+	}
+}
+
+static bool lightrec_licm_check(const struct opcode *list,
+				u16 head, u16 end, u16 offset)
+{
+	const struct opcode *other, *op = &list[offset];
+	u64 read = lightrec_licm_read_mask(op);
+	u64 write = opcode_write_mask(op->c);
+	u64 mask;
+	unsigned int i;
+
+	for (i = head; i < end; i++) {
+		other = &list[i];
+		mask = opcode_write_mask(other->c);
+
+		/* The sources cannot change in the loop, unless they are
+		 * written by a previous hoisted opcode */
+		if ((mask & read) && (i >= offset || !op_flag_hoisted(other->flags)))
+			return false;
+
+		/* All the writers of the destination must be hoisted */
+		if ((mask & write) && !op_flag_hoisted(other->flags))
+			return false;
 
-		lightrec_consts_propagate(block, i, v);
+		/* The destination cannot be read before it is written */
+		if (i < offset && !op_flag_hoisted(other->flags) &&
+		    (lightrec_licm_read_mask(other) & write))
+			return false;
+	}
 
-		switch (list->i.op) {
-		case OP_SPECIAL:
-			switch (list->r.op) {
-			case OP_SPECIAL_DIV:
-			case OP_SPECIAL_DIVU:
-				/* If we are dividing by a non-zero constant, don't
-				 * emit the div-by-zero check. */
-				if (lightrec_always_skip_div_check() ||
-				    (v[list->r.rt].known & v[list->r.rt].value)) {
-					list->flags |= LIGHTREC_NO_DIV_CHECK;
-				}
-				fallthrough;
-			case OP_SPECIAL_MULT:
-			case OP_SPECIAL_MULTU:
+	return true;
+}
+
+static void lightrec_licm_clear_reg_ops(struct opcode *op, u8 reg)
+{
+	if (op->r.rs == reg)
+		op->flags &= ~LIGHTREC_REG_RS_MASK;
+	if (op->r.rt == reg)
+		op->flags &= ~LIGHTREC_REG_RT_MASK;
+	if (op->r.rd == reg)
+		op->flags &= ~LIGHTREC_REG_RD_MASK;
+}
+
+static void lightrec_licm_loop(struct block *block, u16 head, u16 end)
+{
+	struct opcode *op, *list = block->opcode_list;
+	unsigned int i, j, k, prefix, nb = 0;
+	bool changed, can_load = true;
+	u64 mask;
+
+	for (i = head; i < end; i++) {
+		if (opcode_may_modify_memory(&list[i]))
+			can_load = false;
+	}
+
+	/* Only the opcodes that run on every iteration, before the first
+	 * branch of the loop, can be hoisted. */
+	for (prefix = head; prefix < end; prefix++) {
+		op = &list[prefix];
+
+		if ((prefix > head && op_flag_sync(op->flags))
+		    || has_delay_slot(op->c))
+			break;
+
+		if (opcode_can_hoist(op) && (can_load || !opcode_is_load(op->c)))
+			op->flags |= LIGHTREC_HOISTED;
+	}
+
+	do {
+		changed = false;
+
+		for (i = head; i < prefix; i++) {
+			op = &list[i];
+
+			if (op_flag_hoisted(op->flags) &&
+			    !lightrec_licm_check(list, head, end, i)) {
+				op->flags &= ~LIGHTREC_HOISTED;
+				changed = true;
+			}
+		}
+	} while (changed);
+
+	for (i = head; i < prefix; i++) {
+		op = &list[i];
+
+		if (!op_flag_hoisted(op->flags))
+			continue;
+
+		pr_debug("Hoisting opcode "X32_FMT" at offset 0x%x out of the "
+			 "loop at offset 0x%x\n", op->opcode, i << 2, head << 2);
+		nb++;
+
+		/* The register unloads were computed for the opcode's place
+		 * in the loop; the hoisted value must stay live through the
+		 * whole loop instead. */
+		op->flags &= ~(LIGHTREC_REG_RS_MASK | LIGHTREC_REG_RT_MASK
+			       | LIGHTREC_REG_RD_MASK);
+
+		mask = opcode_write_mask(op->c);
+
+		for (j = 1; j < 32; j++) {
+			if (!(mask & BIT(j)))
+				continue;
+
+			for (k = head; k < end; k++)
+				lightrec_licm_clear_reg_ops(&list[k], j);
+		}
+	}
+
+	if (nb)
+		pr_debug("Hoisted %u opcodes out of loop\n", nb);
+}
+
+static s32 lightrec_local_branch_target(const struct block *block, u16 offset)
+{
+	const struct opcode *op = &block->opcode_list[offset];
+
+	return offset + 1 - op_flag_no_ds(op->flags) + (s16)op->i.imm;
+}
+
+static bool lightrec_licm_loop_is_closed(const struct block *block,
+					 u16 head, u16 end)
+{
+	const struct opcode *op;
+	unsigned int i;
+	s32 target;
+
+	/* Reject loops that can be entered from anywhere but the top, as the
+	 * hoisted opcodes would be skipped. Only the loop head runs the
+	 * pre-header when entered from the LUT; any other label in the loop
+	 * can be entered from other blocks or from the dispatcher. */
+	for (i = head + 1; i < end; i++) {
+		if (op_flag_sync(block->opcode_list[i].flags))
+			return false;
+	}
+
+	for (i = 0; i < block->nb_ops; i++) {
+		op = &block->opcode_list[i];
+
+		if (!op_flag_local_branch(op->flags) || (i >= head && i < end))
+			continue;
+
+		target = lightrec_local_branch_target(block, i);
+		if (target >= head && target < end)
+			return false;
+	}
+
+	return true;
+}
+
+static int lightrec_licm(struct lightrec_state *state, struct block *block)
+{
+	const struct opcode *op, *list = block->opcode_list;
+	unsigned int i, j;
+	s32 head, end;
+
+	for (i = 0; i < block->nb_ops; i++) {
+		op = &list[i];
+
+		if (!op_flag_local_branch(op->flags) || should_emulate(op))
+			continue;
+
+		head = lightrec_local_branch_target(block, i);
+		if (head <= 0 || head > i || !op_flag_sync(list[head].flags)
+		    || is_delay_slot(list, head))
+			continue;
+
+		/* Handle each loop once, using its last backwards branch */
+		for (j = i + 1; j < block->nb_ops; j++) {
+			if (op_flag_local_branch(list[j].flags) &&
+			    lightrec_local_branch_target(block, j) == head)
 				break;
-			default:
+		}
+
+		if (j < block->nb_ops)
+			continue;
+
+		end = i + 1 + !op_flag_no_ds(op->flags);
+
+		if (lightrec_licm_loop_is_closed(block, head, end))
+			lightrec_licm_loop(block, head, end);
+	}
+
+	return 0;
+}
+
+static bool opcode_can_idle(const struct opcode *op)
+{
+	union code c = op->c;
+
+	switch (c.i.op) {
+	case OP_SPECIAL:
+		switch (c.r.op) {
+		case OP_SPECIAL_JR:
+		case OP_SPECIAL_JALR:
+		case OP_SPECIAL_SYSCALL:
+		case OP_SPECIAL_BREAK:
+			return false;
+		default:
+			return true;
+		}
+	case OP_META:
+		switch (c.m.op) {
+		case OP_META_MOV:
+		case OP_META_EXTC:
+		case OP_META_EXTS:
+		case OP_META_COM:
+			return true;
+		default:
+			return false;
+		}
+	case OP_CP0:
+		return c.r.rs == OP_CP0_MFC0;
+	case OP_ADDI:
+	case OP_ADDIU:
+	case OP_SLTI:
+	case OP_SLTIU:
+	case OP_ANDI:
+	case OP_ORI:
+	case OP_XORI:
+	case OP_LUI:
+		return true;
+	case OP_LB:
+	case OP_LBU:
+	case OP_LH:
+	case OP_LHU:
+	case OP_LW:
+	case OP_LWL:
+	case OP_LWR:
+		if (op_flag_load_delay(op->flags))
+			return false;
+
+		/* Hardware registers may change between two reads, or have
+		 * side effects when read */
+		switch (LIGHTREC_FLAGS_GET_IO_MODE(op->flags)) {
+		case LIGHTREC_IO_RAM:
+		case LIGHTREC_IO_SCRATCH:
+			return true;
+		default:
+			return false;
+		}
+	default:
+		return false;
+	}
+}
+
+static bool lightrec_is_idle_loop(const struct opcode *list,
+				  u16 head, u16 branch, u16 end)
+{
+	const struct opcode *op;
+	u64 written = 0, loop_written = 0, read;
+	unsigned int i;
+
+	for (i = head; i < end; i++) {
+		if (i != branch && !opcode_can_idle(&list[i]))
+			return false;
+
+		loop_written |= opcode_write_mask(list[i].c);
+	}
+
+	/* Each iteration must compute the same values from the same inputs:
+	 * no register may be read before it is written in the loop, as its
+	 * value would then depend on the previous iteration. */
+	for (i = head; i < end; i++) {
+		op = &list[i];
+		read = opcode_read_mask(op->c) & ~BIT(0);
+
+		if (read & loop_written & ~written)
+			return false;
+
+		written |= opcode_write_mask(op->c);
+	}
+
+	return true;
+}
+
+static int lightrec_detect_idle_loops(struct lightrec_state *state,
+				      struct block *block)
+{
+	struct opcode *op, *list = block->opcode_list;
+	unsigned int i;
+	s32 head;
+
+	for (i = 0; i < block->nb_ops; i++) {
+		op = &list[i];
+
+		switch (op->i.op) {
+		case OP_REGIMM:
+			if (op->r.rt != OP_REGIMM_BLTZ &&
+			    op->r.rt != OP_REGIMM_BGEZ)
 				continue;
-			}
 			fallthrough;
-		case OP_META_MULT2:
-		case OP_META_MULTU2:
+		case OP_BEQ:
+		case OP_BNE:
+		case OP_BLEZ:
+		case OP_BGTZ:
 			break;
 		default:
 			continue;
 		}
 
-		/* Don't support opcodes in delay slots */
-		if (is_delay_slot(block->opcode_list, i) ||
-		    op_flag_no_ds(list->flags)) {
-			continue;
-		}
+		if (should_emulate(op) || !op_flag_local_branch(op->flags))
+			continue;
+
+		head = lightrec_local_branch_target(block, i);
+		if (head < 0 || head > i || is_delay_slot(list, head))
+			continue;
+
+		if (!lightrec_is_idle_loop(list, head, i,
+					   i + 1 + !op_flag_no_ds(op->flags)))
+			continue;
+
+		pr_debug("Found idle loop at offset 0x%x (PC "X32_FMT")\n",
+			 head << 2, block->pc + (head << 2));
+
+		op->flags |= LIGHTREC_IDLE_LOOP;
+	}
+
+	return 0;
+}
+
+static bool lightrec_can_pair_io(const struct opcode *op,
+				 const struct opcode *next)
+{
+	u32 mode = LIGHTREC_FLAGS_GET_IO_MODE(op->flags);
+	s32 delta;
+
+	if (op->i.op != next->i.op || op->i.rs != next->i.rs)
+		return false;
+
+	if (op->i.op != OP_LW && op->i.op != OP_SW)
+		return false;
+
+	if ((op->i.imm | next->i.imm) & 0x3)
+		return false;
+
+	delta = (s32)(s16)next->i.imm - (s32)(s16)op->i.imm;
+	if (delta != 4 && delta != -4)
+		return false;
+
+	switch (mode) {
+	case LIGHTREC_IO_RAM:
+	case LIGHTREC_IO_SCRATCH:
+		break;
+	case LIGHTREC_IO_BIOS:
+		if (op->i.op == OP_LW)
+			break;
+		fallthrough;
+	default:
+		return false;
+	}
+
+	/* Both opcodes must take the exact same code path */
+	if ((op->flags ^ next->flags) & (LIGHTREC_IO_MASK | LIGHTREC_NO_MASK |
+					 LIGHTREC_NO_INVALIDATE))
+		return false;
+
+	if (op_flag_sync(next->flags) || op_flag_smc(op->flags)
+	    || op_flag_smc(next->flags)
+	    || op_flag_load_delay(op->flags) || op_flag_load_delay(next->flags)
+	    || op_flag_hoisted(op->flags) || op_flag_hoisted(next->flags))
+		return false;
+
+	/* The loads are emitted in reverse order, with the address computed
+	 * in the first target register */
+	if (op->i.op == OP_LW && (!op->i.rt || !next->i.rt
+				   || op->i.rt == op->i.rs
+				   || next->i.rt == op->i.rs
+				   || op->i.rt == next->i.rt))
+		return false;
+
+	return true;
+}
+
+static int lightrec_pair_io(struct lightrec_state *state, struct block *block)
+{
+	struct opcode *list = block->opcode_list;
+	unsigned int i;
+
+	for (i = 0; i + 1 < block->nb_ops; i++) {
+		if (is_delay_slot(list, i)
+		    || !lightrec_can_pair_io(&list[i], &list[i + 1]))
+			continue;
+
+		pr_debug("Pairing memory accesses at offset 0x%x\n", i << 2);
+
+		list[i].flags |= LIGHTREC_IO_PAIR;
+
+		/* The second opcode can't start another pair */
+		i++;
+	}
+
+	return 0;
+}
+
+static bool opcode_can_inline(const struct opcode *op)
+{
+	if (has_delay_slot(op->c) || is_syscall(op->c)
+	    || opcode_writes_register(op->c, 31))
+		return false;
+
+	switch (op->i.op) {
+	case OP_CP0:
+	case OP_CP2:
+	case OP_LWC2:
+	case OP_SWC2:
+		/* May call C code */
+		return false;
+	default:
+		break;
+	}
+
+	if (!opcode_is_io(op->c))
+		return true;
+
+	/* The generic I/O handler needs to find the opcode in its block, so
+	 * memory accesses must already be tagged with a direct access mode */
+	if (op_flag_smc(op->flags) || op_flag_load_delay(op->flags)
+	    || op_flag_io_spec(op->flags))
+		return false;
+
+	switch (LIGHTREC_FLAGS_GET_IO_MODE(op->flags)) {
+	case LIGHTREC_IO_BIOS:
+		return opcode_is_load(op->c);
+	case LIGHTREC_IO_RAM:
+	case LIGHTREC_IO_SCRATCH:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int lightrec_inline_calls(struct lightrec_state *state,
+				 struct block *block)
+{
+	const struct opcode *op, *list = block->opcode_list;
+	struct block_inline_call *inl;
+	struct block *callee;
+	unsigned int i, jal;
+	u32 target;
+
+	if (block->inline_call
+	    || block_has_flag(block, BLOCK_NEVER_COMPILE | BLOCK_IS_HLE))
+		return 0;
+
+	/* The JAL always ends the block */
+	for (i = 0; i < block->nb_ops; i++) {
+		if (list[i].i.op == OP_JAL)
+			break;
+	}
+
+	if (i == block->nb_ops || is_delay_slot(list, i) || should_emulate(&list[i]))
+		return 0;
+
+	jal = i;
+	op = &list[jal];
+
+	/* A delayed load would be visible after the first opcode of the
+	 * callee; let the dispatcher handle that */
+	if (!op_flag_no_ds(op->flags) && op_flag_load_delay(list[jal + 1].flags))
+		return 0;
+
+	target = (block->pc & 0xf0000000) | (op->j.imm << 2);
+
+	callee = lightrec_find_block(state->block_cache, target);
+	if (!callee || callee == block || callee->nb_ops > INLINE_CALL_MAX_OPS
+	    || block_has_flag(callee, BLOCK_IS_DEAD | BLOCK_NO_OPCODE_LIST |
+			      BLOCK_NEVER_COMPILE | BLOCK_IS_HLE))
+		return 0;
+
+	/* The callee's opcode list must match the code in memory */
+	if (callee->hash != lightrec_calculate_block_hash(callee))
+		return 0;
 
-		reg_lo = get_mfhi_mflo_reg(block, i + 1, NULL, 0, false, true, false);
-		if (reg_lo == 0) {
-			pr_debug("Mark MULT(U)/DIV(U) opcode at offset 0x%x as"
-				 " not writing LO\n", i << 2);
-			list->flags |= LIGHTREC_NO_LO;
-		}
+	list = callee->opcode_list;
 
-		reg_hi = get_mfhi_mflo_reg(block, i + 1, NULL, 0, false, false, false);
-		if (reg_hi == 0) {
-			pr_debug("Mark MULT(U)/DIV(U) opcode at offset 0x%x as"
-				 " not writing HI\n", i << 2);
-			list->flags |= LIGHTREC_NO_HI;
-		}
+	for (i = 0; i < callee->nb_ops && !is_return(list[i].c); i++) {
+		if (!opcode_can_inline(&list[i]))
+			return 0;
+	}
 
-		if (!reg_lo && !reg_hi) {
-			pr_debug("Both LO/HI unused in this block, they will "
-				 "probably be used in parent block - removing "
-				 "flags.\n");
-			list->flags &= ~(LIGHTREC_NO_LO | LIGHTREC_NO_HI);
-		}
+	/* The function must end with JR $ra and its delay slot */
+	if (i == callee->nb_ops
+	    || i + 1 + !op_flag_no_ds(list[i].flags) != callee->nb_ops
+	    || (!op_flag_no_ds(list[i].flags) && !opcode_can_inline(&list[i + 1])))
+		return 0;
 
-		if (0/* Broken */ && reg_lo > 0 && reg_lo != REG_LO) {
-			pr_debug("Found register %s to hold LO (rs = %u, rt = %u)\n",
-				 lightrec_reg_name(reg_lo), list->r.rs, list->r.rt);
+	inl = lightrec_malloc(state, MEM_FOR_IR, sizeof(*inl));
+	if (!inl)
+		return 0;
 
-			lightrec_replace_lo_hi(block, i + 1, block->nb_ops, true);
-			list->r.rd = reg_lo;
-		} else {
-			list->r.rd = 0;
-		}
+	inl->code = callee->code;
+	inl->pc = target;
+	inl->nb_ops = callee->nb_ops;
 
-		if (0/* Broken */ && reg_hi > 0 && reg_hi != REG_HI) {
-			pr_debug("Found register %s to hold HI (rs = %u, rt = %u)\n",
-				 lightrec_reg_name(reg_hi), list->r.rs, list->r.rt);
+	for (i = 0; i < inl->nb_ops; i++) {
+		inl->words[i] = callee->code[i];
+		inl->ops[i] = list[i];
 
-			lightrec_replace_lo_hi(block, i + 1, block->nb_ops, false);
-			list->r.imm = reg_hi;
-		} else {
-			list->r.imm = 0;
-		}
+		/* The callee's branch targets and hoisted opcodes don't mean
+		 * anything in the caller */
+		inl->ops[i].flags &= ~(LIGHTREC_SYNC | LIGHTREC_HOISTED);
 	}
 
+	pr_debug("Inlining leaf function at "PC_FMT" (%u opcodes) into block "
+		 "at "PC_FMT"\n", target, inl->nb_ops, block->pc);
+
+	block->inline_call = inl;
+	block->opcode_list[jal].flags |= LIGHTREC_INLINE_CALL;
+
 	return 0;
 }
 
-static bool remove_div_sequence(struct block *block, unsigned int offset)
+/* Find the opcode that last wrote the given register before the given
+ * offset, on the only path that leads there */
+static s32 lightrec_find_writer(const struct block *block, u16 offset, u8 reg)
 {
-	struct opcode *op;
-	unsigned int i, found = 0;
-
-	/*
-	 * Scan for the zero-checking sequence that GCC automatically introduced
-	 * after most DIV/DIVU opcodes. This sequence checks the value of the
-	 * divisor, and if zero, executes a BREAK opcode, causing the BIOS
-	 * handler to crash the PS1.
-	 *
-	 * For DIV opcodes, this sequence additionally checks that the signed
-	 * operation does not overflow.
-	 *
-	 * With the assumption that the games never crashed the PS1, we can
-	 * therefore assume that the games never divided by zero or overflowed,
-	 * and these sequences can be removed.
-	 */
+	const struct opcode *op;
+	s32 i;
 
-	for (i = offset; i < block->nb_ops; i++) {
+	for (i = offset - 1; i >= 0; i--) {
 		op = &block->opcode_list[i];
 
-		if (!found) {
-			if (op->i.op == OP_SPECIAL &&
-			    (op->r.op == OP_SPECIAL_DIV || op->r.op == OP_SPECIAL_DIVU))
-				break;
+		if (opcode_writes_register(op->c, reg))
+			return op_flag_load_delay(op->flags) ? -1 : i;
 
-			if ((op->opcode & 0xfc1fffff) == 0x14000002) {
-				/* BNE ???, zero, +8 */
-				found++;
-			} else {
-				offset++;
-			}
-		} else if (found == 1 && !op->opcode) {
-			/* NOP */
-			found++;
-		} else if (found == 2 && op->opcode == 0x0007000d) {
-			/* BREAK 0x1c00 */
-			found++;
-		} else if (found == 3 && op->opcode == 0x2401ffff) {
-			/* LI at, -1 */
-			found++;
-		} else if (found == 4 && (op->opcode & 0xfc1fffff) == 0x14010004) {
-			/* BNE ???, at, +16 */
-			found++;
-		} else if (found == 5 && op->opcode == 0x3c018000) {
-			/* LUI at, 0x8000 */
-			found++;
-		} else if (found == 6 && (op->opcode & 0x141fffff) == 0x14010002) {
-			/* BNE ???, at, +16 */
-			found++;
-		} else if (found == 7 && !op->opcode) {
-			/* NOP */
-			found++;
-		} else if (found == 8 && op->opcode == 0x0006000d) {
-			/* BREAK 0x1800 */
-			found++;
-			break;
-		} else {
+		/* Branch target: the value may come from somewhere else */
+		if (op_flag_sync(op->flags))
 			break;
-		}
 	}
 
-	if (found >= 3) {
-		if (found != 9)
-			found = 3;
-
-		pr_debug("Removing DIV%s sequence at offset 0x%x\n",
-			 found == 9 ? "" : "U", offset << 2);
+	return -1;
+}
 
-		for (i = 0; i < found; i++)
-			block->opcode_list[offset + i].opcode = 0;
+static bool lightrec_reg_is_stable(const struct block *block,
+				   u16 start, u16 end, u8 reg)
+{
+	unsigned int i;
 
-		return true;
+	for (i = start + 1; i < end; i++) {
+		if (opcode_writes_register(block->opcode_list[i].c, reg))
+			return false;
 	}
 
-	return false;
+	return true;
 }
 
-static int lightrec_remove_div_by_zero_check_sequence(struct lightrec_state *state,
-						      struct block *block)
+/* Find the "sltiu $t, $idx, N; beq $t, $zero, default" check that bounds the
+ * index of the table, and return N */
+static u32 lightrec_jump_table_size(const struct block *block,
+				    u16 offset, u8 idx)
 {
-	struct opcode *op;
-	unsigned int i;
+	const struct opcode *op;
+	s32 i, w;
+	u8 reg;
 
-	for (i = 0; i < block->nb_ops; i++) {
+	for (i = offset - 1; i >= 0; i--) {
 		op = &block->opcode_list[i];
 
-		if (op->i.op == OP_SPECIAL &&
-		    (op->r.op == OP_SPECIAL_DIVU || op->r.op == OP_SPECIAL_DIV) &&
-		    remove_div_sequence(block, i + 1))
-			op->flags |= LIGHTREC_NO_DIV_CHECK;
+		if (op->i.op == OP_BEQ && !!op->i.rs != !!op->i.rt) {
+			reg = op->i.rs ?: op->i.rt;
+			w = lightrec_find_writer(block, i, reg);
+
+			if (w >= 0 && block->opcode_list[w].i.op == OP_SLTIU
+			    && block->opcode_list[w].i.rs == idx
+			    && block->opcode_list[w].i.rt == reg
+			    && lightrec_reg_is_stable(block, w, offset, idx))
+				return (u32)(s32)(s16)block->opcode_list[w].i.imm;
+		}
+
+		if (op_flag_sync(op->flags))
+			break;
 	}
 
 	return 0;
 }
 
-static const u32 memset_code[] = {
-	0x10a00006,	// beqz		a1, 2f
-	0x24a2ffff,	// addiu	v0,a1,-1
-	0x2403ffff,	// li		v1,-1
-	0xac800000,	// 1: sw	zero,0(a0)
-	0x2442ffff,	// addiu	v0,v0,-1
-	0x1443fffd,	// bne		v0,v1, 1b
-	0x24840004,	// addiu	a0,a0,4
-	0x03e00008,	// 2: jr	ra
-	0x00000000,	// nop
-};
+static bool lightrec_is_code_map(struct lightrec_state *state, u32 pc)
+{
+	const struct lightrec_mem_map *map;
+
+	map = lightrec_get_map(state, NULL, kunseg(pc));
 
-static int lightrec_replace_memset(struct lightrec_state *state, struct block *block)
+	return map == &state->maps[PSX_MAP_KERNEL_USER_RAM]
+		|| map == &state->maps[PSX_MAP_BIOS];
+}
+
+static int lightrec_detect_jump_tables(struct lightrec_state *state,
+				       struct block *block)
 {
-	unsigned int i;
-	union code c;
+	const struct lightrec_mem_map *map, *map2;
+	const struct opcode *op, *list = block->opcode_list;
+	const struct constprop_data *v;
+	struct block_jump_table *jt;
+	s32 lw, add, sll;
+	u32 base, nb, pc, i, j;
+	void *host, *host2;
+	const u32 *code;
+	u8 idx, sreg;
+
+	if (block->jump_table || block_has_flag(block, BLOCK_NEVER_COMPILE))
+		return 0;
 
-	for (i = 0; i < block->nb_ops; i++) {
-		c = block->opcode_list[i].c;
+	/* The JR always ends the block */
+	for (j = 0; j < block->nb_ops; j++) {
+		if (list[j].i.op == OP_SPECIAL && list[j].r.op == OP_SPECIAL_JR)
+			break;
+	}
+
+	if (j == block->nb_ops || is_return(list[j].c) || is_delay_slot(list, j))
+		return 0;
+
+	/* lw $rs, lo(table)($base) */
+	lw = lightrec_find_writer(block, j, list[j].r.rs);
+	if (lw < 0 || list[lw].i.op != OP_LW)
+		return 0;
+
+	/* addu $base, $table_hi, $offset */
+	add = lightrec_find_writer(block, lw, list[lw].i.rs);
+	if (add < 0)
+		return 0;
+
+	op = &list[add];
+	if (op->i.op != OP_SPECIAL || (op->r.op != OP_SPECIAL_ADDU &&
+				       op->r.op != OP_SPECIAL_ADD))
+		return 0;
+
+	v = lightrec_consts_get(state->constprop, add);
+	if (is_known(v, op->r.rs)) {
+		base = v[op->r.rs].value;
+		sreg = op->r.rt;
+	} else if (is_known(v, op->r.rt)) {
+		base = v[op->r.rt].value;
+		sreg = op->r.rs;
+	} else {
+		return 0;
+	}
+
+	/* sll $offset, $idx, 2 */
+	sll = lightrec_find_writer(block, add, sreg);
+	if (sll < 0 || list[sll].i.op != OP_SPECIAL
+	    || list[sll].r.op != OP_SPECIAL_SLL || list[sll].r.imm != 2)
+		return 0;
 
-		if (c.opcode != memset_code[i])
+	idx = list[sll].r.rt;
+
+	/* The index is read back after the delay slot of the JR */
+	if (!idx || !lightrec_reg_is_stable(block, sll, j, idx)
+	    || (!op_flag_no_ds(list[j].flags)
+		&& opcode_writes_register(list[j + 1].c, idx)))
+		return 0;
+
+	nb = lightrec_jump_table_size(block, j, idx);
+	if (!nb || nb > JUMP_TABLE_MAX)
+		return 0;
+
+	base += (s16)list[lw].i.imm;
+	if (base & 0x3)
+		return 0;
+
+	/* The table must be in RAM */
+	map = lightrec_get_map(state, &host, kunseg(base));
+	map2 = lightrec_get_map(state, &host2, kunseg(base + (nb - 1) * 4));
+	if (map != &state->maps[PSX_MAP_KERNEL_USER_RAM] || map2 != map
+	    || host2 != (u8 *)host + (nb - 1) * 4)
+		return 0;
+
+	code = host;
+
+	for (i = 0; i < nb; i++) {
+		pc = LE32TOH(code[i]);
+
+		if ((pc & 0x3) || !lightrec_is_code_map(state, pc))
 			return 0;
+	}
 
-		if (i == ARRAY_SIZE(memset_code) - 1) {
-			/* success! */
-			pr_debug("Block at "PC_FMT" is a memset\n", block->pc);
-			block_set_flags(block,
-					BLOCK_IS_MEMSET | BLOCK_NEVER_COMPILE);
+	jt = lightrec_malloc(state, MEM_FOR_IR, sizeof(*jt) + nb * 2 * sizeof(u32));
+	if (!jt)
+		return 0;
 
-			/* Return non-zero to skip other optimizers. */
-			return 1;
-		}
+	jt->nb = nb;
+	jt->reg = idx;
+
+	for (i = 0; i < nb; i++) {
+		pc = LE32TOH(code[i]);
+
+		jt->table[i] = pc;
+		jt->table[nb + i] = lut_offset(pc) * lut_elm_size(state);
 	}
 
+	pr_debug("Found jump table of %u entries at "X32_FMT" in block at "
+		 PC_FMT"\n", nb, base, block->pc);
+
+	block->jump_table = jt;
+	block->opcode_list[j].flags |= LIGHTREC_JUMP_TABLE;
+
 	return 0;
 }
 
@@ -2317,34 +3741,226 @@ static int lightrec_test_preload_pc(struct lightrec_state *state, struct block *
 	return 0;
 }
 
-static int (*lightrec_optimizers[])(struct lightrec_state *state, struct block *) = {
-	IF_OPT(OPT_REMOVE_DIV_BY_ZERO_SEQ, &lightrec_remove_div_by_zero_check_sequence),
-	IF_OPT(OPT_REPLACE_MEMSET, &lightrec_replace_memset),
-	IF_OPT(OPT_DETECT_IMPOSSIBLE_BRANCHES, &lightrec_detect_impossible_branches),
-	IF_OPT(OPT_HANDLE_LOAD_DELAYS, &lightrec_handle_load_delays),
-	IF_OPT(OPT_HANDLE_LOAD_DELAYS, &lightrec_swap_load_delays),
-	IF_OPT(OPT_TRANSFORM_OPS, &lightrec_transform_branches),
-	IF_OPT(OPT_LOCAL_BRANCHES, &lightrec_local_branches),
-	IF_OPT(OPT_TRANSFORM_OPS, &lightrec_transform_ops),
-	IF_OPT(OPT_SWITCH_DELAY_SLOTS, &lightrec_switch_delay_slots),
-	IF_OPT(OPT_FLAG_IO, &lightrec_flag_io),
-	IF_OPT(OPT_FLAG_MULT_DIV, &lightrec_flag_mults_divs),
-	IF_OPT(OPT_EARLY_UNLOAD, &lightrec_early_unload),
-	IF_OPT(OPT_PRELOAD_PC, &lightrec_test_preload_pc),
+static int (*lightrec_optimizers[LIGHTREC_PASS_COUNT])(struct lightrec_state *state, struct block *) = {
+	[LIGHTREC_PASS_REMOVE_DIV_BY_ZERO_SEQ] = IF_OPT(OPT_REMOVE_DIV_BY_ZERO_SEQ, &lightrec_remove_div_by_zero_check_sequence),
+	[LIGHTREC_PASS_REPLACE_FUNCTIONS] = IF_OPT(OPT_REPLACE_FUNCTIONS, &lightrec_replace_functions),
+	[LIGHTREC_PASS_DETECT_IMPOSSIBLE_BRANCHES] = IF_OPT(OPT_DETECT_IMPOSSIBLE_BRANCHES, &lightrec_detect_impossible_branches),
+	[LIGHTREC_PASS_HANDLE_LOAD_DELAYS] = IF_OPT(OPT_HANDLE_LOAD_DELAYS, &lightrec_handle_load_delays),
+	[LIGHTREC_PASS_SWAP_LOAD_DELAYS] = IF_OPT(OPT_HANDLE_LOAD_DELAYS, &lightrec_swap_load_delays),
+	[LIGHTREC_PASS_TRANSFORM_BRANCHES] = IF_OPT(OPT_TRANSFORM_OPS, &lightrec_transform_branches),
+	[LIGHTREC_PASS_LOCAL_BRANCHES] = IF_OPT(OPT_LOCAL_BRANCHES, &lightrec_local_branches),
+	[LIGHTREC_PASS_TRANSFORM_OPS] = IF_OPT(OPT_TRANSFORM_OPS, &lightrec_transform_ops),
+	[LIGHTREC_PASS_SSA] = IF_OPT(OPT_SSA, &lightrec_ssa_optimize),
+	[LIGHTREC_PASS_SWITCH_DELAY_SLOTS] = IF_OPT(OPT_SWITCH_DELAY_SLOTS, &lightrec_switch_delay_slots),
+	[LIGHTREC_PASS_FLAG_IO] = IF_OPT(OPT_FLAG_IO, &lightrec_flag_io),
+	[LIGHTREC_PASS_GROUP_IO] = IF_OPT(OPT_GROUP_IO, &lightrec_group_io),
+	[LIGHTREC_PASS_FORWARD_LOADS] = IF_OPT(OPT_FORWARD_LOADS, &lightrec_forward_loads),
+	[LIGHTREC_PASS_FIND_ENTRY_REGS] = IF_OPT(OPT_ENTRY_SPEC && OPT_DETECT_IMPOSSIBLE_BRANCHES, &lightrec_find_entry_regs),
+	[LIGHTREC_PASS_FLAG_MULT_DIV] = IF_OPT(OPT_FLAG_MULT_DIV, &lightrec_flag_mults_divs),
+	[LIGHTREC_PASS_EARLY_UNLOAD] = IF_OPT(OPT_EARLY_UNLOAD, &lightrec_early_unload),
+	[LIGHTREC_PASS_LICM] = IF_OPT(OPT_LICM, &lightrec_licm),
+	[LIGHTREC_PASS_DETECT_IDLE_LOOPS] = IF_OPT(OPT_DETECT_IDLE_LOOPS, &lightrec_detect_idle_loops),
+	[LIGHTREC_PASS_PAIR_IO] = IF_OPT(OPT_PAIR_IO, &lightrec_pair_io),
+	[LIGHTREC_PASS_INLINE_CALLS] = IF_OPT(OPT_INLINE_CALLS, &lightrec_inline_calls),
+	[LIGHTREC_PASS_JUMP_TABLES] = IF_OPT(OPT_JUMP_TABLES, &lightrec_detect_jump_tables),
+	[LIGHTREC_PASS_PRELOAD_PC] = IF_OPT(OPT_PRELOAD_PC, &lightrec_test_preload_pc),
 };
 
-int lightrec_optimize(struct lightrec_state *state, struct block *block)
+static const char * const lightrec_pass_names[LIGHTREC_PASS_COUNT] = {
+	[LIGHTREC_PASS_REMOVE_DIV_BY_ZERO_SEQ] = "remove-div-by-zero-seq",
+	[LIGHTREC_PASS_REPLACE_FUNCTIONS] = "replace-functions",
+	[LIGHTREC_PASS_DETECT_IMPOSSIBLE_BRANCHES] = "detect-impossible-branches",
+	[LIGHTREC_PASS_HANDLE_LOAD_DELAYS] = "handle-load-delays",
+	[LIGHTREC_PASS_SWAP_LOAD_DELAYS] = "swap-load-delays",
+	[LIGHTREC_PASS_TRANSFORM_BRANCHES] = "transform-branches",
+	[LIGHTREC_PASS_LOCAL_BRANCHES] = "local-branches",
+	[LIGHTREC_PASS_TRANSFORM_OPS] = "transform-ops",
+	[LIGHTREC_PASS_SSA] = "ssa",
+	[LIGHTREC_PASS_SWITCH_DELAY_SLOTS] = "switch-delay-slots",
+	[LIGHTREC_PASS_FLAG_IO] = "flag-io",
+	[LIGHTREC_PASS_GROUP_IO] = "group-io",
+	[LIGHTREC_PASS_FORWARD_LOADS] = "forward-loads",
+	[LIGHTREC_PASS_FIND_ENTRY_REGS] = "find-entry-regs",
+	[LIGHTREC_PASS_FLAG_MULT_DIV] = "flag-mult-div",
+	[LIGHTREC_PASS_EARLY_UNLOAD] = "early-unload",
+	[LIGHTREC_PASS_LICM] = "licm",
+	[LIGHTREC_PASS_DETECT_IDLE_LOOPS] = "detect-idle-loops",
+	[LIGHTREC_PASS_PAIR_IO] = "pair-io",
+	[LIGHTREC_PASS_INLINE_CALLS] = "inline-calls",
+	[LIGHTREC_PASS_JUMP_TABLES] = "jump-tables",
+	[LIGHTREC_PASS_PRELOAD_PC] = "preload-pc",
+};
+
+static u64 lightrec_get_time_ns(void)
 {
-	unsigned int i;
+	struct timespec ts;
+
+	if (!timespec_get(&ts, TIME_UTC))
+		return 0;
+
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int lightrec_run_pass_with_stats(struct lightrec_state *state,
+					struct block *block, unsigned int pass)
+{
+	struct lightrec_pass_stats *stats = &state->pass_stats[pass];
+	unsigned int i, nb_ops = block->nb_ops, nb_changed;
+	unsigned int len = nb_ops * sizeof(struct opcode);
+	const struct opcode *list;
+	struct opcode *copy;
+	u64 start;
 	int ret;
 
+	copy = lightrec_malloc(state, MEM_FOR_IR, len);
+	if (copy)
+		memcpy(copy, block->opcode_list, len);
+
+	start = lightrec_get_time_ns();
+	ret = (*lightrec_optimizers[pass])(state, block);
+	stats->time_ns += lightrec_get_time_ns() - start;
+
+	if (!copy)
+		return ret;
+
+	list = block->opcode_list;
+
+	if (block->nb_ops < nb_ops) {
+		nb_changed = nb_ops - block->nb_ops;
+		nb_ops = block->nb_ops;
+	} else {
+		nb_changed = block->nb_ops - nb_ops;
+	}
+
+	for (i = 0; i < nb_ops; i++) {
+		if (copy[i].opcode != list[i].opcode ||
+		    copy[i].flags != list[i].flags)
+			nb_changed++;
+	}
+
+	if (nb_changed) {
+		stats->nb_ops += nb_changed;
+		stats->nb_blocks++;
+	}
+
+	lightrec_free(state, MEM_FOR_IR, len, copy);
+
+	return ret;
+}
+
+/* Passes that are only worth their cost on hot blocks. They must be able to
+ * run on an opcode list already processed by all the other passes. */
+#define LIGHTREC_HOT_PASSES	(BIT(LIGHTREC_PASS_FORWARD_LOADS) | \
+				 BIT(LIGHTREC_PASS_EARLY_UNLOAD) | \
+				 BIT(LIGHTREC_PASS_LICM) | \
+				 BIT(LIGHTREC_PASS_PAIR_IO) | \
+				 BIT(LIGHTREC_PASS_INLINE_CALLS))
+
+static int lightrec_run_passes(struct lightrec_state *state,
+			       struct block *block, u32 passes)
+{
+	struct constprop_cache constprop;
+	unsigned int i;
+	int ret = 0;
+
+	/* The known bits are computed once and shared by all the passes */
+	lightrec_consts_init(state, &constprop, block);
+	state->constprop = &constprop;
+
 	for (i = 0; i < ARRAY_SIZE(lightrec_optimizers); i++) {
-		if (lightrec_optimizers[i]) {
+		if (!lightrec_optimizers[i] || !(passes & BIT(i)))
+			continue;
+
+		if (state->pass_stats_enabled)
+			ret = lightrec_run_pass_with_stats(state, block, i);
+		else
 			ret = (*lightrec_optimizers[i])(state, block);
-			if (ret)
-				return ret;
-		}
+		if (ret)
+			break;
+	}
+
+	state->constprop = NULL;
+	lightrec_consts_free(state, &constprop);
+
+	return ret;
+}
+
+int lightrec_optimize(struct lightrec_state *state, struct block *block)
+{
+	u32 passes = state->opt_passes;
+
+	if (OPT_HOT_RECOMPILE)
+		passes &= ~LIGHTREC_HOT_PASSES;
+
+	return lightrec_run_passes(state, block, passes);
+}
+
+int lightrec_optimize_hot(struct lightrec_state *state, struct block *block)
+{
+	return lightrec_run_passes(state, block,
+				   state->opt_passes & LIGHTREC_HOT_PASSES);
+}
+
+void lightrec_set_opt_passes(struct lightrec_state *state, u32 passes)
+{
+	passes &= LIGHTREC_ALL_PASSES;
+
+	if (passes == state->opt_passes)
+		return;
+
+	state->opt_passes = passes;
+
+	/* The blocks already built were optimized with the old passes; drop
+	 * them, so that they are built again from the guest code. */
+	if (ENABLE_THREADED_COMPILER) {
+		lightrec_recompiler_pause(state->rec);
+		lightrec_reaper_reap(state->reaper);
+	}
+
+	lightrec_invalidate_all(state);
+	lightrec_free_all_blocks(state->block_cache);
+
+	if (ENABLE_THREADED_COMPILER)
+		lightrec_recompiler_unpause(state->rec);
+}
+
+u32 lightrec_get_opt_passes(const struct lightrec_state *state)
+{
+	u32 passes = 0;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(lightrec_optimizers); i++) {
+		if (lightrec_optimizers[i])
+			passes |= BIT(i);
 	}
 
+	return state->opt_passes & passes;
+}
+
+const char * lightrec_get_pass_name(enum lightrec_opt_pass pass)
+{
+	if ((unsigned int)pass >= LIGHTREC_PASS_COUNT)
+		return NULL;
+
+	return lightrec_pass_names[pass];
+}
+
+void lightrec_enable_pass_stats(struct lightrec_state *state, _Bool enable)
+{
+	if (enable && !state->pass_stats_enabled)
+		memset(state->pass_stats, 0, sizeof(state->pass_stats));
+
+	state->pass_stats_enabled = enable;
+}
+
+int lightrec_get_pass_stats(const struct lightrec_state *state,
+			    enum lightrec_opt_pass pass,
+			    struct lightrec_pass_stats *stats)
+{
+	if ((unsigned int)pass >= LIGHTREC_PASS_COUNT)
+		return -EINVAL;
+
+	*stats = state->pass_stats[pass];
+
 	return 0;
 }
@@ -13,6 +13,7 @@ struct opcode;
 
 __cnst _Bool opcode_reads_register(union code op, u8 reg);
 __cnst _Bool opcode_writes_register(union code op, u8 reg);
+__cnst u64 opcode_read_mask(union code op);
 __cnst u64 opcode_write_mask(union code op);
 __cnst _Bool has_delay_slot(union code op);
 _Bool is_delay_slot(const struct opcode *list, unsigned int offset);
@@ -20,9 +21,15 @@ __cnst _Bool opcode_has_load_delay(union code op);
 __cnst _Bool opcode_is_io(union code op);
 __cnst _Bool is_unconditional_jump(union code c);
 __cnst _Bool is_syscall(union code c);
+__cnst _Bool is_return(union code c);
 
 _Bool should_emulate(const struct opcode *op);
 
 int lightrec_optimize(struct lightrec_state *state, struct block *block);
+int lightrec_optimize_hot(struct lightrec_state *state, struct block *block);
+
+_Bool lightrec_specialize_entry(struct lightrec_state *state,
+				struct block *block);
+void lightrec_unspecialize_entry(struct block *block);
 
 #endif /* __OPTIMIZER_H__ */
@@ -432,12 +432,16 @@ void * lightrec_recompiler_run_first_pass(struct lightrec_state *state,
 
 	/* If the block is already fully tagged, there is no point in running
 	 * the first pass. Request a recompilation of the block, and maybe the
-	 * interpreter will run the block in the meantime. */
-	if (block_has_flag(block, BLOCK_FULLY_TAGGED))
+	 * interpreter will run the block in the meantime.
+	 * Without first pass, the block is compiled right away; its untagged
+	 * I/O opcodes will go through the generic handler, which will tag
+	 * them and flag the block for recompilation. */
+	if (!ENABLE_FIRST_PASS || block_has_flag(block, BLOCK_FULLY_TAGGED))
 		lightrec_recompiler_add(state->rec, block);
 
 	if (likely(block->function)) {
-		if (block_has_flag(block, BLOCK_FULLY_TAGGED)) {
+		if (block_has_flag(block, BLOCK_FULLY_TAGGED) &&
+		    !block_keeps_opcode_list(block)) {
 			old_flags = block_set_flags(block, BLOCK_NO_OPCODE_LIST);
 
 			if (!(old_flags & BLOCK_NO_OPCODE_LIST)) {
@@ -465,7 +469,8 @@ void * lightrec_recompiler_run_first_pass(struct lightrec_state *state,
 
 	/* The block got compiled while the interpreter was running.
 	 * We can free the opcode list now. */
-	if (block->function && block_has_flag(block, BLOCK_FULLY_TAGGED)) {
+	if (block->function && block_has_flag(block, BLOCK_FULLY_TAGGED) &&
+	    !block_keeps_opcode_list(block)) {
 		old_flags = block_set_flags(block, BLOCK_NO_OPCODE_LIST);
 
 		if (!(old_flags & BLOCK_NO_OPCODE_LIST)) {
@@ -0,0 +1,1153 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include "debug.h"
+#include "disassembler.h"
+#include "lightrec-private.h"
+#include "memmanager.h"
+#include "optimizer.h"
+#include "ssa.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define SSA_SRC_RS	BIT(0)
+#define SSA_SRC_RT	BIT(1)
+
+#define SSA_NB_REGS	34
+#define SSA_NONE	0xffffffff
+#define SSA_ENTRY	0xffff
+
+enum ssa_value_type {
+	SSA_VALUE_ENTRY,	/* Value of the register when entering the block */
+	SSA_VALUE_PHI,		/* Merge of values at a join point */
+	SSA_VALUE_OP,		/* Value written by an opcode */
+};
+
+struct ssa_value {
+	u32 copy_of;		/* Value this one is a copy of, or itself */
+	u32 first_use;		/* Head of the def-use chain */
+	u32 def;		/* Defining opcode, or index of the phi */
+	u8 reg;
+	u8 type;
+	_Bool escapes;		/* Visible outside of the block */
+	_Bool live;
+};
+
+struct ssa_use {
+	u32 value;
+	u32 next;		/* Next use of the same value */
+	u32 user;		/* Using opcode, or phi index */
+	_Bool is_phi;
+};
+
+struct ssa_bblock {
+	u16 first, end;		/* Opcodes in [first, end[ */
+	u16 succs[2];
+	u8 nb_succs;
+	_Bool is_exit;		/* Can leave the block */
+	u16 nb_preds;
+	u32 preds;		/* Index in the preds array */
+};
+
+struct ssa_phi {
+	u32 value;
+	u32 operands;		/* Index of the first operand in the uses array */
+	u16 bb;
+	u8 reg;
+};
+
+struct ssa_vn_entry {
+	u32 opcode;
+	u32 a, b;
+	u32 value;
+};
+
+struct ssa_op {
+	u32 uses;		/* Index of the first use in the uses array */
+	u8 nb_uses;
+	_Bool live;
+};
+
+struct ssa {
+	struct lightrec_state *state;
+	struct block *block;
+
+	struct ssa_bblock *bbs;
+	u16 *preds;
+	u16 *bb_of;
+	unsigned int nb_bbs, nb_preds, max_preds;
+
+	struct ssa_op *ops;
+
+	struct ssa_value *values;
+	unsigned int nb_values, max_values;
+
+	struct ssa_use *uses;
+	unsigned int nb_uses, max_uses;
+
+	struct ssa_phi *phis;
+	unsigned int nb_phis, max_phis;
+
+	/* Values of the registers at the end of each basic block */
+	u32 *out;
+
+	/* Value numbering hash table */
+	struct ssa_vn_entry *vn;
+	unsigned int vn_size;
+};
+
+static inline u32 ssa_root(const struct ssa *ssa, u32 value)
+{
+	return ssa->values[value].copy_of;
+}
+
+static bool ssa_opcode_is_movi(const struct opcode *op)
+{
+	switch (op->i.op) {
+	case OP_LUI:
+	case OP_ORI:
+	case OP_ADDI:
+	case OP_ADDIU:
+		/* The LUI of a LUI+ORI pair does not write its register;
+		 * the ORI does not read it. Leave those alone. */
+		return op->flags & LIGHTREC_MOVI;
+	default:
+		return false;
+	}
+}
+
+/* Return true if the emulated program can observe all the registers when
+ * executing this opcode (exceptions, unknown opcodes). */
+static bool ssa_opcode_escapes(union code c)
+{
+	if (is_syscall(c))
+		return true;
+
+	switch (c.i.op) {
+	case OP_SPECIAL:
+		switch (c.r.op) {
+		case OP_SPECIAL_SLL:
+		case OP_SPECIAL_SRL:
+		case OP_SPECIAL_SRA:
+		case OP_SPECIAL_SLLV:
+		case OP_SPECIAL_SRLV:
+		case OP_SPECIAL_SRAV:
+		case OP_SPECIAL_JR:
+		case OP_SPECIAL_JALR:
+		case OP_SPECIAL_MFHI:
+		case OP_SPECIAL_MTHI:
+		case OP_SPECIAL_MFLO:
+		case OP_SPECIAL_MTLO:
+		case OP_SPECIAL_MULT:
+		case OP_SPECIAL_MULTU:
+		case OP_SPECIAL_DIV:
+		case OP_SPECIAL_DIVU:
+		case OP_SPECIAL_ADD:
+		case OP_SPECIAL_ADDU:
+		case OP_SPECIAL_SUB:
+		case OP_SPECIAL_SUBU:
+		case OP_SPECIAL_AND:
+		case OP_SPECIAL_OR:
+		case OP_SPECIAL_XOR:
+		case OP_SPECIAL_NOR:
+		case OP_SPECIAL_SLT:
+		case OP_SPECIAL_SLTU:
+			return false;
+		default:
+			return true;
+		}
+	case OP_REGIMM:
+		switch (c.r.rt) {
+		case OP_REGIMM_BLTZ:
+		case OP_REGIMM_BGEZ:
+		case OP_REGIMM_BLTZAL:
+		case OP_REGIMM_BGEZAL:
+			return false;
+		default:
+			return true;
+		}
+	case OP_CP0:
+		switch (c.r.rs) {
+		case OP_CP0_MFC0:
+		case OP_CP0_CFC0:
+		case OP_CP0_MTC0:
+		case OP_CP0_CTC0:
+			return false;
+		default:
+			return true;
+		}
+	case OP_J:
+	case OP_JAL:
+	case OP_BEQ:
+	case OP_BNE:
+	case OP_BLEZ:
+	case OP_BGTZ:
+	case OP_ADDI:
+	case OP_ADDIU:
+	case OP_SLTI:
+	case OP_SLTIU:
+	case OP_ANDI:
+	case OP_ORI:
+	case OP_XORI:
+	case OP_LUI:
+	case OP_CP2:
+	case OP_LB:
+	case OP_LH:
+	case OP_LWL:
+	case OP_LW:
+	case OP_LBU:
+	case OP_LHU:
+	case OP_LWR:
+	case OP_SB:
+	case OP_SH:
+	case OP_SWL:
+	case OP_SW:
+	case OP_SWR:
+	case OP_LWC2:
+	case OP_SWC2:
+	case OP_META:
+	case OP_META_MULT2:
+	case OP_META_MULTU2:
+	case OP_META_DIVI:
+	case OP_META_DIVIU:
+	case OP_META_LWU:
+	case OP_META_SWU:
+		return false;
+	default:
+		return true;
+	}
+}
+
+/* Register fields of the opcode that are only read, and can therefore be
+ * changed to another register holding the same value. */
+static u8 ssa_opcode_src_fields(union code c)
+{
+	switch (c.i.op) {
+	case OP_SPECIAL:
+		switch (c.r.op) {
+		case OP_SPECIAL_SLL:
+		case OP_SPECIAL_SRL:
+		case OP_SPECIAL_SRA:
+			return SSA_SRC_RT;
+		case OP_SPECIAL_JR:
+		case OP_SPECIAL_JALR:
+		case OP_SPECIAL_MTHI:
+		case OP_SPECIAL_MTLO:
+			return SSA_SRC_RS;
+		case OP_SPECIAL_SYSCALL:
+		case OP_SPECIAL_BREAK:
+		case OP_SPECIAL_MFHI:
+		case OP_SPECIAL_MFLO:
+			return 0;
+		default:
+			return SSA_SRC_RS | SSA_SRC_RT;
+		}
+	case OP_BEQ:
+	case OP_BNE:
+	case OP_SB:
+	case OP_SH:
+	case OP_SWL:
+	case OP_SW:
+	case OP_SWR:
+	case OP_META_SWU:
+		return SSA_SRC_RS | SSA_SRC_RT;
+	case OP_REGIMM:
+	case OP_BLEZ:
+	case OP_BGTZ:
+	case OP_ADDI:
+	case OP_ADDIU:
+	case OP_SLTI:
+	case OP_SLTIU:
+	case OP_ANDI:
+	case OP_ORI:
+	case OP_XORI:
+	case OP_LB:
+	case OP_LH:
+	case OP_LWL:
+	case OP_LW:
+	case OP_LBU:
+	case OP_LHU:
+	case OP_LWR:
+	case OP_LWC2:
+	case OP_SWC2:
+	case OP_META:
+	case OP_META_LWU:
+	case OP_META_MULT2:
+	case OP_META_MULTU2:
+	case OP_META_DIVI:
+	case OP_META_DIVIU:
+		return SSA_SRC_RS;
+	default:
+		return 0;
+	}
+}
+
+/* Opcodes that compute a single register from their operands */
+static bool ssa_opcode_is_expr(union code c)
+{
+	switch (c.i.op) {
+	case OP_SPECIAL:
+		switch (c.r.op) {
+		case OP_SPECIAL_SLL:
+		case OP_SPECIAL_SRL:
+		case OP_SPECIAL_SRA:
+		case OP_SPECIAL_SLLV:
+		case OP_SPECIAL_SRLV:
+		case OP_SPECIAL_SRAV:
+		case OP_SPECIAL_ADD:
+		case OP_SPECIAL_ADDU:
+		case OP_SPECIAL_SUB:
+		case OP_SPECIAL_SUBU:
+		case OP_SPECIAL_AND:
+		case OP_SPECIAL_OR:
+		case OP_SPECIAL_XOR:
+		case OP_SPECIAL_NOR:
+		case OP_SPECIAL_SLT:
+		case OP_SPECIAL_SLTU:
+			return true;
+		default:
+			return false;
+		}
+	case OP_ADDI:
+	case OP_ADDIU:
+	case OP_SLTI:
+	case OP_SLTIU:
+	case OP_ANDI:
+	case OP_ORI:
+	case OP_XORI:
+	case OP_LUI:
+		return true;
+	case OP_META:
+		switch (c.m.op) {
+		case OP_META_EXTC:
+		case OP_META_EXTS:
+		case OP_META_COM:
+			return true;
+		default:
+			return false;
+		}
+	default:
+		return false;
+	}
+}
+
+static bool ssa_opcode_is_commutative(union code c)
+{
+	if (c.i.op != OP_SPECIAL)
+		return false;
+
+	switch (c.r.op) {
+	case OP_SPECIAL_ADD:
+	case OP_SPECIAL_ADDU:
+	case OP_SPECIAL_AND:
+	case OP_SPECIAL_OR:
+	case OP_SPECIAL_XOR:
+	case OP_SPECIAL_NOR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool ssa_opcode_is_copy(union code c)
+{
+	switch (c.i.op) {
+	case OP_SPECIAL:
+		switch (c.r.op) {
+		case OP_SPECIAL_MFHI:
+		case OP_SPECIAL_MTHI:
+		case OP_SPECIAL_MFLO:
+		case OP_SPECIAL_MTLO:
+			return true;
+		default:
+			return false;
+		}
+	case OP_META:
+		return c.m.op == OP_META_MOV;
+	default:
+		return false;
+	}
+}
+
+static u8 ssa_copy_src(union code c)
+{
+	if (c.i.op == OP_META)
+		return c.m.rs;
+
+	switch (c.r.op) {
+	case OP_SPECIAL_MFHI:
+		return REG_HI;
+	case OP_SPECIAL_MFLO:
+		return REG_LO;
+	default:
+		return c.r.rs;
+	}
+}
+
+static u8 ssa_copy_dst(union code c)
+{
+	if (c.i.op == OP_META)
+		return c.m.rd;
+
+	switch (c.r.op) {
+	case OP_SPECIAL_MTHI:
+		return REG_HI;
+	case OP_SPECIAL_MTLO:
+		return REG_LO;
+	default:
+		return c.r.rd;
+	}
+}
+
+static u8 ssa_expr_dst(union code c)
+{
+	switch (c.i.op) {
+	case OP_SPECIAL:
+		return c.r.rd;
+	case OP_META:
+		return c.m.rd;
+	default:
+		return c.i.rt;
+	}
+}
+
+/* Opcodes without side effects, that can be removed if their result is
+ * never used */
+static bool ssa_opcode_is_pure(const struct opcode *op)
+{
+	if (ssa_opcode_is_movi(op))
+		return false;
+
+	if (ssa_opcode_is_expr(op->c) || ssa_opcode_is_copy(op->c))
+		return true;
+
+	switch (op->i.op) {
+	case OP_SPECIAL:
+		switch (op->r.op) {
+		case OP_SPECIAL_MULT:
+		case OP_SPECIAL_MULTU:
+		case OP_SPECIAL_DIV:
+		case OP_SPECIAL_DIVU:
+			return true;
+		default:
+			return false;
+		}
+	case OP_META_MULT2:
+	case OP_META_MULTU2:
+	case OP_META_DIVI:
+	case OP_META_DIVIU:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void ssa_nop(struct opcode *op)
+{
+	op->opcode = 0;
+	op->flags &= LIGHTREC_SYNC;
+}
+
+static u32 ssa_new_value(struct ssa *ssa, u8 type, u8 reg, u32 def)
+{
+	struct ssa_value *value = &ssa->values[ssa->nb_values];
+
+	value->copy_of = ssa->nb_values;
+	value->first_use = SSA_NONE;
+	value->def = def;
+	value->reg = reg;
+	value->type = type;
+	value->escapes = false;
+	value->live = false;
+
+	return ssa->nb_values++;
+}
+
+static void ssa_add_use(struct ssa *ssa, u32 value, u32 user, bool is_phi)
+{
+	struct ssa_use *use = &ssa->uses[ssa->nb_uses];
+
+	use->value = value;
+	use->user = user;
+	use->is_phi = is_phi;
+	use->next = ssa->values[value].first_use;
+
+	ssa->values[value].first_use = ssa->nb_uses++;
+}
+
+static int ssa_find_holder(const struct ssa *ssa, const u32 *cur,
+			   u32 value, bool exact)
+{
+	u8 reg = ssa->values[value].reg;
+	unsigned int i;
+
+	if (reg < 32 && cur[reg] == value)
+		return reg;
+
+	for (i = 0; i < 32; i++)
+		if (cur[i] == value)
+			return i;
+
+	if (!exact) {
+		for (i = 0; i < 32; i++)
+			if (ssa_root(ssa, cur[i]) == value)
+				return i;
+	}
+
+	return -1;
+}
+
+static void ssa_free_array(struct ssa *ssa, void *ptr, unsigned int len)
+{
+	if (ptr)
+		lightrec_free(ssa->state, MEM_FOR_IR, len, ptr);
+}
+
+static void ssa_free(struct ssa *ssa)
+{
+	unsigned int nb_ops = ssa->block->nb_ops;
+
+	ssa_free_array(ssa, ssa->vn, sizeof(*ssa->vn) * ssa->vn_size);
+	ssa_free_array(ssa, ssa->out,
+		       sizeof(*ssa->out) * SSA_NB_REGS * ssa->nb_bbs);
+	ssa_free_array(ssa, ssa->phis, sizeof(*ssa->phis) * ssa->max_phis);
+	ssa_free_array(ssa, ssa->uses, sizeof(*ssa->uses) * ssa->max_uses);
+	ssa_free_array(ssa, ssa->values,
+		       sizeof(*ssa->values) * ssa->max_values);
+	ssa_free_array(ssa, ssa->ops, sizeof(*ssa->ops) * nb_ops);
+	ssa_free_array(ssa, ssa->preds, sizeof(*ssa->preds) * ssa->max_preds);
+	ssa_free_array(ssa, ssa->bb_of, sizeof(*ssa->bb_of) * nb_ops);
+	ssa_free_array(ssa, ssa->bbs, sizeof(*ssa->bbs) * nb_ops);
+
+	lightrec_free(ssa->state, MEM_FOR_IR, sizeof(*ssa), ssa);
+}
+
+static int ssa_build_cfg(struct ssa *ssa)
+{
+	const struct opcode *op, *list = ssa->block->opcode_list;
+	unsigned int i, b, nb_ops = ssa->block->nb_ops;
+	struct ssa_bblock *bb;
+	u16 *leader = ssa->bb_of;
+	u32 end, target;
+	bool local;
+	int br;
+
+	memset(leader, 0, sizeof(*leader) * nb_ops);
+	leader[0] = 1;
+
+	for (i = 0; i < nb_ops; i++) {
+		op = &list[i];
+
+		/* Emulated branches and load delays are not handled */
+		if (should_emulate(op) || (op_flag_load_delay(op->flags) &&
+					   opcode_has_load_delay(op->c)))
+			return -ENOTSUP;
+
+		if (op_flag_sync(op->flags))
+			leader[i] = 1;
+
+		if (!has_delay_slot(op->c))
+			continue;
+
+		end = i + 1 + !op_flag_no_ds(op->flags);
+		if (end < nb_ops)
+			leader[end] = 1;
+
+		if (op_flag_local_branch(op->flags)) {
+			target = i + 1 - op_flag_no_ds(op->flags) + (s16)op->i.imm;
+			leader[target] = 1;
+		}
+	}
+
+	for (i = 1; i < nb_ops; i++) {
+		if (leader[i] && is_delay_slot(list, i))
+			return -ENOTSUP;
+	}
+
+	for (i = 0, b = 0; i < nb_ops; i++) {
+		if (leader[i]) {
+			if (b)
+				ssa->bbs[b - 1].end = i;
+
+			ssa->bbs[b++].first = i;
+		}
+
+		ssa->bb_of[i] = b - 1;
+	}
+
+	ssa->bbs[b - 1].end = nb_ops;
+	ssa->nb_bbs = b;
+
+	for (b = 0; b < ssa->nb_bbs; b++) {
+		bb = &ssa->bbs[b];
+		bb->nb_succs = 0;
+		bb->nb_preds = 0;
+		bb->is_exit = false;
+
+		for (br = -1, i = bb->first; i < bb->end; i++) {
+			if (has_delay_slot(list[i].c))
+				br = i;
+		}
+
+		if (br >= 0) {
+			op = &list[br];
+			local = op_flag_local_branch(op->flags);
+
+			if (local) {
+				target = br + 1 - op_flag_no_ds(op->flags)
+					+ (s16)op->i.imm;
+				bb->succs[bb->nb_succs++] = ssa->bb_of[target];
+			} else {
+				bb->is_exit = true;
+			}
+
+			if (is_unconditional_jump(op->c))
+				continue;
+		}
+
+		if (bb->end < nb_ops)
+			bb->succs[bb->nb_succs++] = ssa->bb_of[bb->end];
+		else
+			bb->is_exit = true;
+	}
+
+	/* The first basic block, and the ones starting with a SYNC label,
+	 * are also entered from outside: the latter have an entry in the
+	 * LUT, and can be reached from other blocks or from the dispatcher. */
+	for (b = 0; b < ssa->nb_bbs; b++) {
+		bb = &ssa->bbs[b];
+
+		if (!b || op_flag_sync(list[bb->first].flags))
+			bb->nb_preds++;
+	}
+
+	for (b = 0; b < ssa->nb_bbs; b++) {
+		bb = &ssa->bbs[b];
+
+		for (i = 0; i < bb->nb_succs; i++)
+			ssa->bbs[bb->succs[i]].nb_preds++;
+	}
+
+	for (b = 0, end = 0; b < ssa->nb_bbs; b++) {
+		bb = &ssa->bbs[b];
+		bb->preds = end;
+		end += bb->nb_preds;
+		bb->nb_preds = 0;
+
+		if (!b || op_flag_sync(list[bb->first].flags))
+			ssa->preds[bb->preds + bb->nb_preds++] = SSA_ENTRY;
+	}
+
+	ssa->nb_preds = end;
+
+	for (b = 0; b < ssa->nb_bbs; b++) {
+		bb = &ssa->bbs[b];
+
+		for (i = 0; i < bb->nb_succs; i++) {
+			struct ssa_bblock *succ = &ssa->bbs[bb->succs[i]];
+
+			ssa->preds[succ->preds + succ->nb_preds++] = b;
+		}
+	}
+
+	return 0;
+}
+
+static void ssa_enter_bblock(struct ssa *ssa, unsigned int b, u32 *cur)
+{
+	const struct ssa_bblock *bb = &ssa->bbs[b];
+	const u16 *preds = &ssa->preds[bb->preds];
+	u32 v, value, root;
+	unsigned int i, reg;
+	struct ssa_phi *phi;
+	bool known;
+
+	if (bb->nb_preds == 1 && preds[0] != SSA_ENTRY && preds[0] < b) {
+		memcpy(cur, &ssa->out[preds[0] * SSA_NB_REGS],
+		       sizeof(*cur) * SSA_NB_REGS);
+		return;
+	}
+
+	/* $zero never changes */
+	cur[0] = 0;
+
+	for (reg = 1; reg < SSA_NB_REGS; reg++) {
+		known = bb->nb_preds > 0;
+		value = SSA_NONE;
+		root = SSA_NONE;
+
+		for (i = 0; known && i < bb->nb_preds; i++) {
+			if (preds[i] == SSA_ENTRY && b) {
+				/* Entered from outside at a SYNC label - the
+				 * incoming value can be anything */
+				known = false;
+				break;
+			} else if (preds[i] == SSA_ENTRY) {
+				v = reg;
+			} else if (preds[i] >= b) {
+				/* Back edge - the incoming value is not known
+				 * yet */
+				known = false;
+				break;
+			} else {
+				v = ssa->out[preds[i] * SSA_NB_REGS + reg];
+			}
+
+			if (!i) {
+				value = v;
+				root = ssa_root(ssa, v);
+			} else {
+				if (v != value)
+					value = SSA_NONE;
+				if (ssa_root(ssa, v) != root)
+					root = SSA_NONE;
+			}
+		}
+
+		if (known && value != SSA_NONE) {
+			cur[reg] = value;
+			continue;
+		}
+
+		phi = &ssa->phis[ssa->nb_phis];
+		phi->bb = b;
+		phi->reg = reg;
+		phi->operands = SSA_NONE;
+		phi->value = ssa_new_value(ssa, SSA_VALUE_PHI, reg, ssa->nb_phis++);
+
+		/* A merge of copies of the same value is that value */
+		if (known && root != SSA_NONE)
+			ssa->values[phi->value].copy_of = root;
+
+		cur[reg] = phi->value;
+	}
+}
+
+static void ssa_resolve_phis(struct ssa *ssa)
+{
+	const struct ssa_bblock *bb;
+	struct ssa_phi *phi;
+	unsigned int i, j;
+	u16 pred;
+	u32 value;
+
+	for (i = 0; i < ssa->nb_phis; i++) {
+		phi = &ssa->phis[i];
+		bb = &ssa->bbs[phi->bb];
+		phi->operands = ssa->nb_uses;
+
+		for (j = 0; j < bb->nb_preds; j++) {
+			pred = ssa->preds[bb->preds + j];
+
+			if (pred == SSA_ENTRY)
+				value = phi->reg;
+			else
+				value = ssa->out[pred * SSA_NB_REGS + phi->reg];
+
+			ssa_add_use(ssa, value, i, true);
+		}
+	}
+}
+
+static void ssa_vn_key(const struct ssa *ssa, union code c, const u32 *cur,
+		       struct ssa_vn_entry *key)
+{
+	u8 fields = ssa_opcode_src_fields(c);
+	u32 tmp;
+
+	/* Keep the opcode, function and immediate; drop the registers */
+	if (c.i.op == OP_SPECIAL || c.i.op == OP_META)
+		key->opcode = c.opcode & ~0x03fff800;
+	else
+		key->opcode = c.opcode & ~0x03ff0000;
+
+	key->a = (fields & SSA_SRC_RS) ? ssa_root(ssa, cur[c.i.rs]) : SSA_NONE;
+	key->b = (fields & SSA_SRC_RT) ? ssa_root(ssa, cur[c.i.rt]) : SSA_NONE;
+
+	if (ssa_opcode_is_commutative(c) && key->a > key->b) {
+		tmp = key->a;
+		key->a = key->b;
+		key->b = tmp;
+	}
+}
+
+static struct ssa_vn_entry * ssa_vn_find(struct ssa *ssa,
+					 const struct ssa_vn_entry *key)
+{
+	struct ssa_vn_entry *entry;
+	unsigned int idx;
+
+	idx = (key->opcode * 0x9e3779b1) ^ (key->a * 0x85ebca6b)
+		^ (key->b * 0xc2b2ae35);
+
+	for (;; idx++) {
+		entry = &ssa->vn[idx & (ssa->vn_size - 1)];
+
+		if (entry->value == SSA_NONE ||
+		    (entry->opcode == key->opcode &&
+		     entry->a == key->a && entry->b == key->b))
+			return entry;
+	}
+}
+
+/* Returns true if the opcode was removed */
+static bool ssa_value_number(struct ssa *ssa, struct opcode *op, const u32 *cur)
+{
+	struct ssa_vn_entry key, *entry;
+	u8 dst;
+	int reg;
+
+	if (ssa_opcode_is_copy(op->c)) {
+		dst = ssa_copy_dst(op->c);
+
+		if (ssa_root(ssa, cur[dst]) == ssa_root(ssa, cur[ssa_copy_src(op->c)])) {
+			pr_debug("SSA: Removing useless copy "X32_FMT"\n",
+				 op->opcode);
+			ssa_nop(op);
+			return true;
+		}
+
+		return false;
+	}
+
+	dst = ssa_expr_dst(op->c);
+
+	if (!ssa_opcode_is_expr(op->c) || !dst)
+		return false;
+
+	ssa_vn_key(ssa, op->c, cur, &key);
+
+	entry = ssa_vn_find(ssa, &key);
+	if (entry->value == SSA_NONE)
+		return false;
+
+	if (ssa_root(ssa, cur[dst]) == entry->value) {
+		pr_debug("SSA: Removing redundant opcode "X32_FMT"\n",
+			 op->opcode);
+		ssa_nop(op);
+		return true;
+	}
+
+	reg = ssa_find_holder(ssa, cur, entry->value, false);
+	if (reg >= 0) {
+		pr_debug("SSA: Replacing redundant opcode "X32_FMT" with MOV\n",
+			 op->opcode);
+		ssa_nop(op);
+		op->i.op = OP_META;
+		op->m.op = OP_META_MOV;
+		op->m.rd = dst;
+		op->m.rs = reg;
+	}
+
+	return false;
+}
+
+static int ssa_copy_holder(const struct ssa *ssa, const u32 *cur, u8 reg)
+{
+	u32 root = ssa_root(ssa, cur[reg]);
+
+	if (cur[reg] == root)
+		return -1;
+
+	return ssa_find_holder(ssa, cur, root, true);
+}
+
+static void ssa_copy_propagate(struct ssa *ssa, struct opcode *op,
+			       const u32 *cur)
+{
+	u8 fields = ssa_opcode_src_fields(op->c);
+	int reg;
+
+	/* Read the original value instead of one of its copies, so that the
+	 * copy may become dead */
+	if (fields & SSA_SRC_RS) {
+		reg = ssa_copy_holder(ssa, cur, op->i.rs);
+		if (reg >= 0)
+			op->i.rs = reg;
+	}
+
+	if (fields & SSA_SRC_RT) {
+		reg = ssa_copy_holder(ssa, cur, op->i.rt);
+		if (reg >= 0)
+			op->i.rt = reg;
+	}
+}
+
+static void ssa_process_opcode(struct ssa *ssa, u16 offset, u32 *cur)
+{
+	struct opcode *op = &ssa->block->opcode_list[offset];
+	struct ssa_op *sop = &ssa->ops[offset];
+	struct ssa_vn_entry key, *entry = NULL;
+	bool movi = ssa_opcode_is_movi(op);
+	u32 value, root = SSA_NONE;
+	unsigned int reg;
+	u64 mask;
+
+	sop->uses = ssa->nb_uses;
+	sop->nb_uses = 0;
+	sop->live = false;
+
+	if (!op->opcode)
+		return;
+
+	if (!movi) {
+		ssa_copy_propagate(ssa, op, cur);
+
+		if (ssa_value_number(ssa, op, cur))
+			return;
+
+		if (ssa_opcode_is_expr(op->c) && ssa_expr_dst(op->c)) {
+			ssa_vn_key(ssa, op->c, cur, &key);
+			entry = ssa_vn_find(ssa, &key);
+		}
+	}
+
+	if (ssa_opcode_escapes(op->c)) {
+		for (reg = 0; reg < SSA_NB_REGS; reg++)
+			ssa->values[cur[reg]].escapes = true;
+	}
+
+	mask = opcode_read_mask(op->c);
+
+	for (reg = 0; reg < SSA_NB_REGS; reg++) {
+		if (mask & BIT(reg)) {
+			ssa_add_use(ssa, cur[reg], offset, false);
+			sop->nb_uses++;
+		}
+	}
+
+	if (!movi && ssa_opcode_is_copy(op->c))
+		root = ssa_root(ssa, cur[ssa_copy_src(op->c)]);
+
+	mask = opcode_write_mask(op->c) & ~BIT(0);
+
+	for (reg = 0; reg < SSA_NB_REGS; reg++) {
+		if (mask & BIT(reg)) {
+			value = ssa_new_value(ssa, SSA_VALUE_OP, reg, offset);
+			if (root != SSA_NONE)
+				ssa->values[value].copy_of = root;
+
+			cur[reg] = value;
+		}
+	}
+
+	if (entry) {
+		*entry = key;
+		entry->value = cur[ssa_expr_dst(op->c)];
+	}
+}
+
+static int ssa_construct(struct ssa *ssa)
+{
+	struct lightrec_state *state = ssa->state;
+	unsigned int i, b, nb_ops = ssa->block->nb_ops;
+	const struct ssa_bblock *bb;
+	u32 cur[SSA_NB_REGS];
+
+	ssa->max_phis = SSA_NB_REGS * ssa->nb_bbs;
+	ssa->max_values = SSA_NB_REGS + ssa->max_phis + 2 * nb_ops;
+	ssa->max_uses = 3 * nb_ops + SSA_NB_REGS * ssa->nb_preds;
+
+	ssa->ops = lightrec_malloc(state, MEM_FOR_IR, sizeof(*ssa->ops) * nb_ops);
+	ssa->values = lightrec_malloc(state, MEM_FOR_IR,
+				      sizeof(*ssa->values) * ssa->max_values);
+	ssa->uses = lightrec_malloc(state, MEM_FOR_IR,
+				    sizeof(*ssa->uses) * ssa->max_uses);
+	ssa->phis = lightrec_malloc(state, MEM_FOR_IR,
+				    sizeof(*ssa->phis) * ssa->max_phis);
+	ssa->out = lightrec_malloc(state, MEM_FOR_IR, sizeof(*ssa->out)
+				   * SSA_NB_REGS * ssa->nb_bbs);
+	if (!ssa->ops || !ssa->values || !ssa->uses || !ssa->phis || !ssa->out)
+		return -ENOMEM;
+
+	for (ssa->vn_size = 16; ssa->vn_size < 2 * nb_ops; )
+		ssa->vn_size <<= 1;
+
+	ssa->vn = lightrec_malloc(state, MEM_FOR_IR,
+				  sizeof(*ssa->vn) * ssa->vn_size);
+	if (!ssa->vn)
+		return -ENOMEM;
+
+	for (i = 0; i < ssa->vn_size; i++)
+		ssa->vn[i].value = SSA_NONE;
+
+	for (i = 0; i < SSA_NB_REGS; i++)
+		ssa_new_value(ssa, SSA_VALUE_ENTRY, i, 0);
+
+	for (b = 0; b < ssa->nb_bbs; b++) {
+		bb = &ssa->bbs[b];
+
+		ssa_enter_bblock(ssa, b, cur);
+
+		for (i = bb->first; i < bb->end; i++)
+			ssa_process_opcode(ssa, i, cur);
+
+		memcpy(&ssa->out[b * SSA_NB_REGS], cur, sizeof(cur));
+
+		if (bb->is_exit) {
+			for (i = 0; i < SSA_NB_REGS; i++)
+				ssa->values[cur[i]].escapes = true;
+		}
+	}
+
+	ssa_resolve_phis(ssa);
+
+	return 0;
+}
+
+static struct ssa * ssa_create(struct lightrec_state *state,
+			       struct block *block)
+{
+	unsigned int nb_ops = block->nb_ops;
+	struct ssa *ssa;
+	int ret;
+
+	ssa = lightrec_calloc(state, MEM_FOR_IR, sizeof(*ssa));
+	if (!ssa)
+		return NULL;
+
+	ssa->state = state;
+	ssa->block = block;
+	/* Up to two successors per opcode, plus the external entries */
+	ssa->max_preds = 3 * nb_ops;
+
+	ssa->bbs = lightrec_malloc(state, MEM_FOR_IR, sizeof(*ssa->bbs) * nb_ops);
+	ssa->bb_of = lightrec_malloc(state, MEM_FOR_IR,
+				     sizeof(*ssa->bb_of) * nb_ops);
+	ssa->preds = lightrec_malloc(state, MEM_FOR_IR,
+				     sizeof(*ssa->preds) * ssa->max_preds);
+	if (!ssa->bbs || !ssa->bb_of || !ssa->preds)
+		goto err_free_ssa;
+
+	ret = ssa_build_cfg(ssa);
+	if (ret)
+		goto err_free_ssa;
+
+	ret = ssa_construct(ssa);
+	if (ret) {
+		pr_err("Unable to build SSA form: Out of memory\n");
+		goto err_free_ssa;
+	}
+
+	return ssa;
+
+err_free_ssa:
+	ssa_free(ssa);
+	return NULL;
+}
+
+static void ssa_mark_op_live(struct ssa *ssa, u32 offset,
+			     u32 *worklist, unsigned int *nb)
+{
+	struct ssa_op *sop = &ssa->ops[offset];
+	struct ssa_value *value;
+	unsigned int i;
+
+	if (sop->live)
+		return;
+
+	sop->live = true;
+
+	for (i = 0; i < sop->nb_uses; i++) {
+		value = &ssa->values[ssa->uses[sop->uses + i].value];
+
+		if (!value->live) {
+			value->live = true;
+			worklist[(*nb)++] = ssa->uses[sop->uses + i].value;
+		}
+	}
+}
+
+static int ssa_mark_live(struct ssa *ssa)
+{
+	const struct opcode *list = ssa->block->opcode_list;
+	const struct ssa_bblock *bb;
+	const struct ssa_phi *phi;
+	struct ssa_value *value;
+	unsigned int i, nb = 0;
+	u32 *worklist, v;
+
+	worklist = lightrec_malloc(ssa->state, MEM_FOR_IR,
+				   sizeof(*worklist) * ssa->nb_values);
+	if (!worklist)
+		return -ENOMEM;
+
+	for (i = 0; i < ssa->nb_values; i++) {
+		if (ssa->values[i].escapes) {
+			ssa->values[i].live = true;
+			worklist[nb++] = i;
+		}
+	}
+
+	for (i = 0; i < ssa->block->nb_ops; i++) {
+		if (list[i].opcode && !ssa_opcode_is_pure(&list[i]))
+			ssa_mark_op_live(ssa, i, worklist, &nb);
+	}
+
+	while (nb) {
+		v = worklist[--nb];
+		value = &ssa->values[v];
+
+		if (value->type == SSA_VALUE_OP) {
+			ssa_mark_op_live(ssa, value->def, worklist, &nb);
+		} else if (value->type == SSA_VALUE_PHI) {
+			phi = &ssa->phis[value->def];
+			bb = &ssa->bbs[phi->bb];
+
+			for (i = 0; i < bb->nb_preds; i++) {
+				v = ssa->uses[phi->operands + i].value;
+
+				if (!ssa->values[v].live) {
+					ssa->values[v].live = true;
+					worklist[nb++] = v;
+				}
+			}
+		}
+	}
+
+	lightrec_free(ssa->state, MEM_FOR_IR,
+		      sizeof(*worklist) * ssa->nb_values, worklist);
+
+	return 0;
+}
+
+int lightrec_ssa_optimize(struct lightrec_state *state, struct block *block)
+{
+	struct opcode *op;
+	unsigned int i, nb_removed = 0;
+	struct ssa *ssa;
+	int ret;
+
+	if (block_has_flag(block, BLOCK_IS_HLE))
+		return 0;
+
+	ssa = ssa_create(state, block);
+	if (!ssa)
+		return 0;
+
+	ret = ssa_mark_live(ssa);
+	if (ret)
+		goto out_free_ssa;
+
+	for (i = 0; i < block->nb_ops; i++) {
+		op = &block->opcode_list[i];
+
+		if (op->opcode && !ssa->ops[i].live && ssa_opcode_is_pure(op)) {
+			pr_debug("SSA: Removing dead opcode "X32_FMT
+				 " at offset 0x%x\n", op->opcode, i << 2);
+			ssa_nop(op);
+			nb_removed++;
+		}
+	}
+
+	if (nb_removed)
+		pr_debug("SSA: Removed %u dead opcodes\n", nb_removed);
+
+out_free_ssa:
+	ssa_free(ssa);
+	return ret;
+}
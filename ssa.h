@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#ifndef __LIGHTREC_SSA_H__
+#define __LIGHTREC_SSA_H__
+
+#include "lightrec.h"
+
+struct block;
+struct lightrec_state;
+
+int lightrec_ssa_optimize(struct lightrec_state *state, struct block *block);
+
+#endif /* __LIGHTREC_SSA_H__ */